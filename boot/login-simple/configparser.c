@@ -385,6 +385,10 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	ss (ipv4_addr, &name, &src, &len, "ip.netmask", "ip.netmask");
 	ss (ipv4_addr, &name, &src, &len, "ip.gateway", "ip.gateway");
 	ss (uintnum, &name, &src, &len, "ip.use_dhcp", "ip.use_dhcp");
+	ss (uintnum, &name, &src, &len, "ip.input_queue_max",
+	    "ip.input_queue_max");
+	ss (uintnum, &name, &src, &len, "ip.input_drop_policy",
+	    "ip.input_drop_policy");
 	/* storage */
 	for (i = 0; i < NUM_OF_STORAGE_KEYS; i++)
 		ssi (keyplace, &name, &src, &len,
@@ -435,6 +439,10 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	    "vmm.allow_pt");
 	ss (uintnum, &name, &src, &len, "vmm.localapic_intercept",
 	    "vmm.localapic_intercept");
+	ss (uintnum, &name, &src, &len, "vmm.paging_fault_around",
+	    "vmm.paging_fault_around");
+	ss (uintnum, &name, &src, &len, "vmm.paging_premap_ram",
+	    "vmm.paging_premap_ram");
 	ss (mac_addr, &name, &src, &len, "vmm.tty_mac_address",
 	    "vmm.tty_mac_address");
 	ss (uintnum, &name, &src, &len, "vmm.tty_syslog.enable",
@@ -610,6 +618,8 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	CONF (ip.netmask);
 	CONF (ip.gateway);
 	CONF (ip.use_dhcp);
+	CONF (ip.input_queue_max);
+	CONF (ip.input_drop_policy);
 	/* storage */
 	for (i = 0; i < NUM_OF_STORAGE_KEYS; i++)
 		CONF1 ("storage.keys[%d]", i, cfg->storage.keys[i]);
@@ -651,6 +661,8 @@ setconfig (char *name, char *value, struct config_data *cfg)
 	CONF (vmm.conceal_hw_feedback);
 	CONF (vmm.allow_pt);
 	CONF (vmm.localapic_intercept);
+	CONF (vmm.paging_fault_around);
+	CONF (vmm.paging_premap_ram);
 	CONF (vmm.tty_mac_address);
 	CONF (vmm.tty_syslog.enable);
 	CONF (vmm.tty_syslog.src_ipaddr);
@@ -369,3 +369,11 @@ mm_as_translate (const struct mm_as *as, unsigned int *npages, u64 address)
 	address &= ~PAGESIZE_MASK;
 	return as->translate (as->data, npages, address);
 }
+
+u32
+mm_as_generation (const struct mm_as *as)
+{
+	if (as->generation)
+		return as->generation (as->data);
+	return 0;
+}
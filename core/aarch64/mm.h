@@ -46,7 +46,4 @@ struct mm_arch_proc_desc;
 #define MAPMEM_PLAT_TAG		MAPMEM_PLAT (5)
 #define MAPMEM_PLAT_nGnRE	MAPMEM_PLAT (6)
 
-u64 mm_as_translate (const struct mm_as *as, unsigned int *npages,
-		     u64 address);
-
 #endif
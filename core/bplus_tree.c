@@ -223,43 +223,30 @@ bplus_tree_search_get_neighbors (struct bplus_tree *tree, u64 key,
 		}
 	}
 
-	l_i = i - 1;
-	r_i = found ? i + 1 : i;
-	if (i == 0) {
+	/* Neighbors can be in the adjacent leaves regardless of whether
+	 * the key is found or not */
+	l_leaf = leaf_node;
+	l_i = i;
+	if (!l_i) {
 		l_leaf = leaf_node->prev_leaf;
-		if (left_neighbor_key)
-			*left_neighbor_key = l_leaf ?
-				l_leaf->keys[l_leaf->cur_n_kv - 1] :
-				BPLUS_NODE_INVALID_KEY;
-		if (left_neighbor_val)
-			*left_neighbor_val = l_leaf ?
-				l_leaf->vals[l_leaf->cur_n_kv - 1] :
-				NULL;
-		if (right_neighbor_key)
-			*right_neighbor_key = keys[r_i];
-		if (right_neighbor_val)
-			*right_neighbor_val = vals[r_i];
-	} else if ((found && i + 1 == cur_n_kv) || (!found && i == cur_n_kv)) {
+		l_i = l_leaf ? l_leaf->cur_n_kv : 0;
+	}
+	r_leaf = leaf_node;
+	r_i = found ? i + 1 : i;
+	if (r_i == cur_n_kv) {
 		r_leaf = leaf_node->next_leaf;
-		if (left_neighbor_key)
-			*left_neighbor_key = keys[l_i];
-		if (left_neighbor_val)
-			*left_neighbor_val = vals[l_i];
-		if (right_neighbor_key)
-			*right_neighbor_key = r_leaf ? r_leaf->keys[0] :
-						       BPLUS_NODE_INVALID_KEY;
-		if (right_neighbor_val)
-			*right_neighbor_val = r_leaf ? r_leaf->vals[0] : NULL;
-	} else {
-		if (left_neighbor_key)
-			*left_neighbor_key = keys[l_i];
-		if (left_neighbor_val)
-			*left_neighbor_val = vals[l_i];
-		if (right_neighbor_key)
-			*right_neighbor_key = keys[r_i];
-		if (right_neighbor_val)
-			*right_neighbor_val = vals[r_i];
+		r_i = 0;
 	}
+	if (left_neighbor_key)
+		*left_neighbor_key = l_leaf ? l_leaf->keys[l_i - 1] :
+			BPLUS_NODE_INVALID_KEY;
+	if (left_neighbor_val)
+		*left_neighbor_val = l_leaf ? l_leaf->vals[l_i - 1] : NULL;
+	if (right_neighbor_key)
+		*right_neighbor_key = r_leaf ? r_leaf->keys[r_i] :
+			BPLUS_NODE_INVALID_KEY;
+	if (right_neighbor_val)
+		*right_neighbor_val = r_leaf ? r_leaf->vals[r_i] : NULL;
 
 	return found;
 }
@@ -483,7 +470,11 @@ bplus_tree_add (struct bplus_tree *tree, u64 key, void *value)
 		bplus_node_split (tree, leaf_node, &new_leaf_node,
 				  &key_for_parent);
 
-		/* Link them together [leaf_node] <-> [new_leaf_node] */
+		/* Link them together [leaf_node] <-> [new_leaf_node] <->
+		 * [next leaf] */
+		new_leaf_node->next_leaf = leaf_node->next_leaf;
+		if (new_leaf_node->next_leaf)
+			new_leaf_node->next_leaf->prev_leaf = new_leaf_node;
 		leaf_node->next_leaf = new_leaf_node;
 		new_leaf_node->prev_leaf = leaf_node;
 
@@ -30,8 +30,10 @@
 
 #include <arch/mm.h>
 #include <arch/vmm_mem.h>
+#include <arch/currentcpu.h>
 #include <constants.h>
 #include <core/assert.h>
+#include <core/currentcpu.h>
 #include <core/initfunc.h>
 #include <core/list.h>
 #include <core/mm.h>
@@ -45,6 +47,7 @@
 #include "mm.h"
 #include "phys.h"
 #include "uefi.h"
+#include "vmmcall_status.h"
 
 #define NUM_OF_PAGES		(VMMSIZE_ALL >> PAGESIZE_SHIFT)
 #define NUM_OF_ALLOCSIZE	13
@@ -55,6 +58,14 @@
 #define FIND_NEXT_BIT(bitmap)	(~(bitmap) & ((bitmap) + 1))
 #define BIT_TO_INDEX(bit)	(__builtin_ffs ((bit)) - 1)
 #define NUM_OF_PANICMEM_PAGES	256
+#define MM_PCPU_MAX		64
+#define MAGAZINE_SIZE		16
+#define MAGAZINE_BATCH		(MAGAZINE_SIZE / 2)
+#define MAG_PAGE		0
+#define MAG_SMALL(n)		(1 + (n))
+#define MAG_TINY(n)		(MAG_SMALL (NUM_OF_SMALL_ALLOCSIZE) + (n))
+#define NUM_OF_MAGAZINES	MAG_TINY (NUM_OF_TINY_ALLOCSIZE)
+#define MAGAZINE_POISON		0x4545524647414D21ULL /* "!MAGFREE" */
 
 enum page_type {
 	PAGE_TYPE_FREE,
@@ -63,6 +74,7 @@ enum page_type {
 	PAGE_TYPE_ALLOCATED_CONT,
 	PAGE_TYPE_ALLOCATED_SMALL,
 	PAGE_TYPE_RESERVED,
+	PAGE_TYPE_CACHED,
 };
 
 struct page {
@@ -102,6 +114,18 @@ struct mempool {
 	spinlock_t lock;
 };
 
+struct magazine {
+	int n;
+	void *obj[MAGAZINE_SIZE];
+};
+
+struct mm_pcpu {
+	spinlock_t lock;
+	u64 nalloc, nfree;
+	u64 nrefill, ndrain;
+	struct magazine mag[NUM_OF_MAGAZINES];
+};
+
 static spinlock_t mm_lock;
 static spinlock_t mm_small_lock;
 static spinlock_t mm_tiny_lock;
@@ -110,8 +134,12 @@ static LIST1_DEFINE_HEAD (struct page, small_freelist[NUM_OF_SMALL_ALLOCSIZE]);
 static LIST1_DEFINE_HEAD (struct tiny_allocdata,
 			  tiny_freelist[NUM_OF_TINY_ALLOCSIZE]);
 static struct page pagestruct[NUM_OF_PAGES];
+static struct mm_pcpu mm_pcpu[MM_PCPU_MAX];
 static int panicmem_start_page;
 
+static bool mm_cache_drain_all (void);
+static struct page *mm_page_alloc_cached (int n);
+
 void SECTION_ENTRY_TEXT
 uefi_init_get_vmmsize (u32 *vmmsize, u32 *align)
 {
@@ -196,7 +224,9 @@ mm_page_alloc (int n)
 	p = mm_page_alloc_sub (n);
 	if (!p) {
 		spinlock_unlock (&mm_lock);
-		panic ("%s(%d): Out of memory", __func__, n);
+		if (!mm_cache_drain_all ())
+			panic ("%s(%d): Out of memory", __func__, n);
+		return mm_page_alloc (n);
 	}
 	/* p->type must be set before unlock, because the
 	 * mm_page_free() function may merge blocks if the type is
@@ -237,7 +267,9 @@ not_found:
 	p = mm_page_alloc_sub (n + 1);
 	if (!p) {
 		spinlock_unlock (&mm_lock);
-		panic ("%s(%d,%d): Out of memory", __func__, n, m);
+		if (!mm_cache_drain_all ())
+			panic ("%s(%d,%d): Out of memory", __func__, n, m);
+		return mm_page_alloc_cont (n, m);
 	}
 	q = mm_page_free_2ndhalf (p);
 found:
@@ -334,6 +366,8 @@ num_of_available_pages (void)
 		r += n * (mm_page_get_allocsize (i) >> PAGESIZE_SHIFT);
 	}
 	spinlock_unlock (&mm_lock);
+	for (i = 0; i < MM_PCPU_MAX; i++)
+		r += mm_pcpu[i].mag[MAG_PAGE].n;
 	return r;
 }
 
@@ -352,6 +386,8 @@ mm_init_global (void)
 		LIST1_HEAD_INIT (small_freelist[i]);
 	for (i = 0; i < NUM_OF_TINY_ALLOCSIZE; i++)
 		LIST1_HEAD_INIT (tiny_freelist[i]);
+	for (i = 0; i < MM_PCPU_MAX; i++)
+		spinlock_init (&mm_pcpu[i].lock);
 	for (i = 0; i < NUM_OF_PAGES; i++) {
 		pagestruct[i].type = PAGE_TYPE_RESERVED;
 		pagestruct[i].allocsize = 0;
@@ -433,7 +469,7 @@ alloc_pages (void **virt, u64 *phys, int n)
 	return -1;
 found:
 	if (j < 0)
-		p = mm_page_alloc (i);
+		p = mm_page_alloc_cached (i);
 	else
 		p = mm_page_alloc_cont (i, j);
 	if (virt)
@@ -459,39 +495,65 @@ get_small_allocsize (unsigned int len)
 	return -1;
 }
 
+/* Called with mm_small_lock held.  Returns 0 if no page in the
+ * freelist has a free block. */
 static virt_t
-small_alloc (int small_allocsize)
+small_alloc_locked (int small_allocsize)
 {
-	ASSERT (small_allocsize >= 0);
-	ASSERT (small_allocsize < NUM_OF_SMALL_ALLOCSIZE);
 	int nbits = PAGESIZE / SMALL_ALLOCSIZE (small_allocsize);
 	u32 full = (2U << (nbits - 1)) - 1;
 	u32 n;
 	struct page *p;
-	spinlock_lock (&mm_small_lock);
 	LIST1_FOREACH (small_freelist[small_allocsize], p) {
 		n = FIND_NEXT_BIT (p->small_bitmap);
 		p->small_bitmap |= n;
 		if (p->small_bitmap == full)
 			LIST1_DEL (small_freelist[small_allocsize], p);
-		goto ok;
+		int i = BIT_TO_INDEX (n);
+		ASSERT (i >= 0);
+		ASSERT (i < nbits);
+		return page_to_virt (p) + SMALL_ALLOCSIZE (small_allocsize) * i;
 	}
-	spinlock_unlock (&mm_small_lock);
-	p = mm_page_alloc (0);
+	return 0;
+}
+
+static struct page *
+small_new_page (int small_allocsize)
+{
+	struct page *p = mm_page_alloc_cached (0);
 	ASSERT (p);
 	ASSERT (p->type == PAGE_TYPE_ALLOCATED);
 	p->type = PAGE_TYPE_ALLOCATED_SMALL;
-	n = 1;
 	p->small_allocsize = small_allocsize;
-	p->small_bitmap = n;
+	p->small_bitmap = 0;
+	return p;
+}
+
+static void
+small_alloc_batch (int small_allocsize, void **objs, int num)
+{
+	ASSERT (small_allocsize >= 0);
+	ASSERT (small_allocsize < NUM_OF_SMALL_ALLOCSIZE);
 	spinlock_lock (&mm_small_lock);
-	LIST1_PUSH (small_freelist[small_allocsize], p);
-ok:
+	for (int i = 0; i < num; i++) {
+		virt_t v;
+		while (!(v = small_alloc_locked (small_allocsize))) {
+			spinlock_unlock (&mm_small_lock);
+			struct page *p = small_new_page (small_allocsize);
+			spinlock_lock (&mm_small_lock);
+			LIST1_PUSH (small_freelist[small_allocsize], p);
+		}
+		objs[i] = (void *)v;
+	}
 	spinlock_unlock (&mm_small_lock);
-	int i = BIT_TO_INDEX (n);
-	ASSERT (i >= 0);
-	ASSERT (i < nbits);
-	return page_to_virt (p) + SMALL_ALLOCSIZE (small_allocsize) * i;
+}
+
+static virt_t
+small_alloc (int small_allocsize)
+{
+	void *r;
+	small_alloc_batch (small_allocsize, &r, 1);
+	return (virt_t)r;
 }
 
 static unsigned int
@@ -504,8 +566,10 @@ small_getlen (struct page *p)
 	return SMALL_ALLOCSIZE (small_allocsize);
 }
 
-static void
-small_free (struct page *p, u32 page_offset)
+/* Called with mm_small_lock held.  Returns 1 if the page becomes
+ * empty, or -1 if the block is not allocated. */
+static int
+small_free_locked (struct page *p, u32 page_offset)
 {
 	ASSERT (p->type == PAGE_TYPE_ALLOCATED_SMALL);
 	int small_allocsize = p->small_allocsize;
@@ -517,22 +581,51 @@ small_free (struct page *p, u32 page_offset)
 	int i = page_offset / SMALL_ALLOCSIZE (small_allocsize);
 	ASSERT (i < nbits);
 	u32 n = 1 << i;
-	spinlock_lock (&mm_small_lock);
 	if (p->small_bitmap == full)
 		LIST1_PUSH (small_freelist[small_allocsize], p);
 	u32 new_small_bitmap = p->small_bitmap ^ n;
 	p->small_bitmap = new_small_bitmap;
 	if (!new_small_bitmap)
 		LIST1_DEL (small_freelist[small_allocsize], p);
-	spinlock_unlock (&mm_small_lock);
 	if (new_small_bitmap & n)
+		return -1;
+	return !new_small_bitmap;
+}
+
+static void
+small_free_batch (void **objs, int num)
+{
+	struct page *empty[MAGAZINE_SIZE];
+	int nempty = 0;
+	bool doublefree = false;
+
+	ASSERT (num <= MAGAZINE_SIZE);
+	spinlock_lock (&mm_small_lock);
+	for (int i = 0; i < num; i++) {
+		virt_t v = (virt_t)objs[i];
+		struct page *p = virt_to_page (v);
+		int r = small_free_locked (p, v & PAGESIZE_MASK);
+		if (r < 0)
+			doublefree = true;
+		else if (r > 0)
+			empty[nempty++] = p;
+	}
+	spinlock_unlock (&mm_small_lock);
+	if (doublefree)
 		panic ("%s: double free", __func__);
-	if (!new_small_bitmap) {
-		p->type = PAGE_TYPE_ALLOCATED;
-		mm_page_free (p);
+	for (int i = 0; i < nempty; i++) {
+		empty[i]->type = PAGE_TYPE_ALLOCATED;
+		mm_page_free (empty[i]);
 	}
 }
 
+static void
+small_free (struct page *p, u32 page_offset)
+{
+	void *v = (void *)(page_to_virt (p) + page_offset);
+	small_free_batch (&v, 1);
+}
+
 static int
 get_tiny_allocsize (unsigned int len)
 {
@@ -542,39 +635,59 @@ get_tiny_allocsize (unsigned int len)
 	return -1;
 }
 
+/* Called with mm_tiny_lock held.  Returns 0 if no block in the
+ * freelist has a free slot. */
 static virt_t
-tiny_alloc (int tiny_allocsize)
+tiny_alloc_locked (int tiny_allocsize)
 {
-	ASSERT (tiny_allocsize >= 0);
-	ASSERT (tiny_allocsize < NUM_OF_TINY_ALLOCSIZE);
 	int nbits = 32;
 	u32 n;
 	struct tiny_allocdata *p;
-	ASSERT (sizeof *p <= 2 * TINY_ALLOCSIZE (0));
-	ASSERT (sizeof *p <= TINY_ALLOCSIZE (1));
-	u32 empty_bitmap = tiny_allocsize ? 1 : 3;
-	spinlock_lock (&mm_tiny_lock);
 	LIST1_FOREACH (tiny_freelist[tiny_allocsize], p) {
 		n = FIND_NEXT_BIT (p->tiny_bitmap);
 		p->tiny_bitmap |= n;
 		if (!~p->tiny_bitmap)
 			LIST1_DEL (tiny_freelist[tiny_allocsize], p);
-		goto ok;
+		int i = BIT_TO_INDEX (n);
+		ASSERT (i > 0);
+		ASSERT (i < nbits);
+		return (virt_t)p + TINY_ALLOCSIZE (tiny_allocsize) * i;
 	}
-	spinlock_unlock (&mm_tiny_lock);
+	return 0;
+}
+
+static struct tiny_allocdata *
+tiny_new_block (int tiny_allocsize)
+{
+	int nbits = 32;
+	struct tiny_allocdata *p;
+	ASSERT (sizeof *p <= 2 * TINY_ALLOCSIZE (0));
+	ASSERT (sizeof *p <= TINY_ALLOCSIZE (1));
 	int plen = TINY_ALLOCSIZE (tiny_allocsize) * nbits;
 	p = (void *)small_alloc (get_small_allocsize (plen));
-	n = FIND_NEXT_BIT (empty_bitmap);
 	p->tiny_allocsize = tiny_allocsize;
-	p->tiny_bitmap = empty_bitmap | n;
+	p->tiny_bitmap = tiny_allocsize ? 1 : 3;
+	return p;
+}
+
+static void
+tiny_alloc_batch (int tiny_allocsize, void **objs, int num)
+{
+	ASSERT (tiny_allocsize >= 0);
+	ASSERT (tiny_allocsize < NUM_OF_TINY_ALLOCSIZE);
 	spinlock_lock (&mm_tiny_lock);
-	LIST1_PUSH (tiny_freelist[tiny_allocsize], p);
-ok:
+	for (int i = 0; i < num; i++) {
+		virt_t v;
+		while (!(v = tiny_alloc_locked (tiny_allocsize))) {
+			spinlock_unlock (&mm_tiny_lock);
+			struct tiny_allocdata *p;
+			p = tiny_new_block (tiny_allocsize);
+			spinlock_lock (&mm_tiny_lock);
+			LIST1_PUSH (tiny_freelist[tiny_allocsize], p);
+		}
+		objs[i] = (void *)v;
+	}
 	spinlock_unlock (&mm_tiny_lock);
-	int i = BIT_TO_INDEX (n);
-	ASSERT (i > 0);
-	ASSERT (i < nbits);
-	return (virt_t)p + TINY_ALLOCSIZE (tiny_allocsize) * i;
 }
 
 static unsigned int
@@ -587,8 +700,10 @@ tiny_getlen (virt_t start_of_block)
 	return TINY_ALLOCSIZE (tiny_allocsize);
 }
 
-static void
-tiny_free (struct page *page, virt_t start_of_block, u32 block_offset)
+/* Called with mm_tiny_lock held.  Returns 1 if the block becomes
+ * empty, or -1 if the slot is not allocated. */
+static int
+tiny_free_locked (virt_t start_of_block, u32 block_offset)
 {
 	struct tiny_allocdata *p = (void *)start_of_block;
 	int tiny_allocsize = p->tiny_allocsize;
@@ -603,18 +718,278 @@ tiny_free (struct page *page, virt_t start_of_block, u32 block_offset)
 	ASSERT (sizeof *p <= TINY_ALLOCSIZE (1));
 	u32 empty_bitmap = tiny_allocsize ? 1 : 3;
 	ASSERT (!(empty_bitmap & n));
-	spinlock_lock (&mm_tiny_lock);
 	if (!~p->tiny_bitmap)
 		LIST1_PUSH (tiny_freelist[tiny_allocsize], p);
 	u32 new_tiny_bitmap = p->tiny_bitmap ^ n;
 	p->tiny_bitmap = new_tiny_bitmap;
 	if (new_tiny_bitmap == empty_bitmap)
 		LIST1_DEL (tiny_freelist[tiny_allocsize], p);
-	spinlock_unlock (&mm_tiny_lock);
 	if (new_tiny_bitmap & n)
+		return -1;
+	return new_tiny_bitmap == empty_bitmap;
+}
+
+static virt_t
+tiny_start_of_block (virt_t v, u32 *block_offset)
+{
+	struct page *p = virt_to_page (v);
+	ASSERT (p->type == PAGE_TYPE_ALLOCATED_SMALL);
+	*block_offset = (v & PAGESIZE_MASK) %
+		SMALL_ALLOCSIZE (p->small_allocsize);
+	return v - *block_offset;
+}
+
+static void
+tiny_free_batch (void **objs, int num)
+{
+	virt_t empty[MAGAZINE_SIZE];
+	int nempty = 0;
+	bool doublefree = false;
+
+	ASSERT (num <= MAGAZINE_SIZE);
+	spinlock_lock (&mm_tiny_lock);
+	for (int i = 0; i < num; i++) {
+		u32 block_offset;
+		virt_t start_of_block = tiny_start_of_block ((virt_t)objs[i],
+							     &block_offset);
+		int r = tiny_free_locked (start_of_block, block_offset);
+		if (r < 0)
+			doublefree = true;
+		else if (r > 0)
+			empty[nempty++] = start_of_block;
+	}
+	spinlock_unlock (&mm_tiny_lock);
+	if (doublefree)
 		panic ("%s: double free", __func__);
-	if (new_tiny_bitmap == empty_bitmap)
-		small_free (page, start_of_block & PAGESIZE_MASK);
+	for (int i = 0; i < nempty; i++)
+		small_free (virt_to_page (empty[i]),
+			    empty[i] & PAGESIZE_MASK);
+}
+
+static void
+mm_page_alloc_batch (void **objs, int num)
+{
+	struct page *p;
+	bool bad = false;
+	int i;
+
+	spinlock_lock (&mm_lock);
+	for (i = 0; i < num && (p = mm_page_alloc_sub (0)); i++) {
+		if (p->type != PAGE_TYPE_FREE)
+			bad = true;
+		p->type = PAGE_TYPE_CACHED;
+		objs[i] = p;
+	}
+	spinlock_unlock (&mm_lock);
+	ASSERT (!bad);
+	for (; i < num; i++) {
+		p = mm_page_alloc (0);
+		p->type = PAGE_TYPE_CACHED;
+		objs[i] = p;
+	}
+}
+
+static void
+mm_page_free_batch (void **objs, int num)
+{
+	char *fail = NULL;
+
+	spinlock_lock (&mm_lock);
+	for (int i = 0; i < num && !fail; i++) {
+		struct page *p = objs[i];
+		ASSERT (p->type == PAGE_TYPE_CACHED);
+		p->type = PAGE_TYPE_ALLOCATED;
+		fail = mm_page_free_sub (p);
+	}
+	spinlock_unlock (&mm_lock);
+	if (fail)
+		panic ("%s: %s", __func__, fail);
+}
+
+/* Per-CPU magazine caches in front of the global freelists.  A
+ * magazine is refilled from or drained to the global freelist by
+ * MAGAZINE_BATCH objects at once, so that the global locks are taken
+ * once per batch.  A magazine is usually used by its processor only,
+ * so the per-CPU lock is rarely contended.  The per-CPU lock is held
+ * only while accessing the magazines, never while calling the global
+ * allocator.  Small and tiny objects in a magazine have
+ * MAGAZINE_POISON in their first word, so that a double free is
+ * detected without scanning the magazines in most cases. */
+
+static void
+mm_cache_get_global (int c, void **objs, int num)
+{
+	if (c == MAG_PAGE)
+		mm_page_alloc_batch (objs, num);
+	else if (c < MAG_TINY (0))
+		small_alloc_batch (c - MAG_SMALL (0), objs, num);
+	else
+		tiny_alloc_batch (c - MAG_TINY (0), objs, num);
+}
+
+static void
+mm_cache_put_global (int c, void **objs, int num)
+{
+	if (c == MAG_PAGE)
+		mm_page_free_batch (objs, num);
+	else if (c < MAG_TINY (0))
+		small_free_batch (objs, num);
+	else
+		tiny_free_batch (objs, num);
+}
+
+static struct mm_pcpu *
+mm_cache_get_pcpu (void)
+{
+	if (!currentcpu_available ())
+		return NULL;
+	int cpunum = currentcpu_get_id ();
+	if (cpunum < 0 || cpunum >= MM_PCPU_MAX)
+		return NULL;
+	return &mm_pcpu[cpunum];
+}
+
+/* Returns true if obj is in a magazine of any processor */
+static bool
+mm_cache_find (int c, void *obj)
+{
+	bool found = false;
+
+	for (int i = 0; i < MM_PCPU_MAX && !found; i++) {
+		struct mm_pcpu *pc = &mm_pcpu[i];
+		struct magazine *m = &pc->mag[c];
+		spinlock_lock (&pc->lock);
+		for (int j = 0; j < m->n; j++)
+			if (m->obj[j] == obj)
+				found = true;
+		spinlock_unlock (&pc->lock);
+	}
+	return found;
+}
+
+static void *
+mm_cache_unpoison (int c, void *obj)
+{
+	if (c != MAG_PAGE)
+		*(u64 *)obj = 0;
+	return obj;
+}
+
+static void *
+mm_cache_alloc (int c)
+{
+	struct mm_pcpu *pc = mm_cache_get_pcpu ();
+	void *objs[MAGAZINE_BATCH];
+	struct magazine *m;
+	void *r;
+
+	if (!pc) {
+		mm_cache_get_global (c, objs, 1);
+		return mm_cache_unpoison (c, objs[0]);
+	}
+	m = &pc->mag[c];
+	spinlock_lock (&pc->lock);
+	pc->nalloc++;
+	if (m->n > 0) {
+		r = m->obj[--m->n];
+		spinlock_unlock (&pc->lock);
+		return mm_cache_unpoison (c, r);
+	}
+	pc->nrefill++;
+	spinlock_unlock (&pc->lock);
+	mm_cache_get_global (c, objs, MAGAZINE_BATCH);
+	spinlock_lock (&pc->lock);
+	int i = MAGAZINE_BATCH;
+	while (i > 1 && m->n < MAGAZINE_SIZE)
+		m->obj[m->n++] = objs[--i];
+	spinlock_unlock (&pc->lock);
+	/* The magazine may be shared during AP initialization */
+	if (i > 1)
+		mm_cache_put_global (c, &objs[1], i - 1);
+	return mm_cache_unpoison (c, objs[0]);
+}
+
+static void
+mm_cache_free (int c, void *obj)
+{
+	struct mm_pcpu *pc = mm_cache_get_pcpu ();
+	void *objs[MAGAZINE_BATCH];
+	struct magazine *m;
+
+	if (!pc) {
+		mm_cache_put_global (c, &obj, 1);
+		return;
+	}
+	if (c != MAG_PAGE) {
+		if (*(u64 *)obj == MAGAZINE_POISON && mm_cache_find (c, obj))
+			panic ("%s: double free", __func__);
+		*(u64 *)obj = MAGAZINE_POISON;
+	}
+	m = &pc->mag[c];
+	spinlock_lock (&pc->lock);
+	pc->nfree++;
+	if (m->n < MAGAZINE_SIZE) {
+		m->obj[m->n++] = obj;
+		spinlock_unlock (&pc->lock);
+		return;
+	}
+	pc->ndrain++;
+	m->n -= MAGAZINE_BATCH;
+	memcpy (objs, &m->obj[m->n], sizeof objs);
+	m->obj[m->n++] = obj;
+	spinlock_unlock (&pc->lock);
+	mm_cache_put_global (c, objs, MAGAZINE_BATCH);
+}
+
+/* Return all the cached objects to the global freelists.  Called
+ * when the global freelist runs out. */
+static bool
+mm_cache_drain_all (void)
+{
+	void *objs[MAGAZINE_SIZE];
+	bool drained = false;
+
+	for (int i = 0; i < MM_PCPU_MAX; i++) {
+		struct mm_pcpu *pc = &mm_pcpu[i];
+		/* Pages last, since draining small blocks frees pages */
+		for (int c = NUM_OF_MAGAZINES - 1; c >= 0; c--) {
+			struct magazine *m = &pc->mag[c];
+			spinlock_lock (&pc->lock);
+			int n = m->n;
+			memcpy (objs, m->obj, n * sizeof objs[0]);
+			m->n = 0;
+			spinlock_unlock (&pc->lock);
+			if (n > 0) {
+				mm_cache_put_global (c, objs, n);
+				drained = true;
+			}
+		}
+	}
+	return drained;
+}
+
+static struct page *
+mm_page_alloc_cached (int n)
+{
+	if (n)
+		return mm_page_alloc (n);
+	struct page *p = mm_cache_alloc (MAG_PAGE);
+	ASSERT (p->type == PAGE_TYPE_CACHED);
+	p->type = PAGE_TYPE_ALLOCATED;
+	return p;
+}
+
+static void
+mm_page_free_cached (struct page *p)
+{
+	if (p->type == PAGE_TYPE_CACHED)
+		panic ("%s: double free", __func__);
+	if (p->type != PAGE_TYPE_ALLOCATED || p->allocsize) {
+		mm_page_free (p);
+		return;
+	}
+	p->type = PAGE_TYPE_CACHED;
+	mm_cache_free (MAG_PAGE, p);
 }
 
 /* allocate n bytes */
@@ -628,9 +1003,9 @@ alloc (uint len)
 	} else {
 		int tiny = !small ? get_tiny_allocsize (len) : -1;
 		if (tiny < 0)
-			r = (void *)small_alloc (small);
+			r = mm_cache_alloc (MAG_SMALL (small));
 		else
-			r = (void *)tiny_alloc (tiny);
+			r = mm_cache_alloc (MAG_TINY (tiny));
 	}
 	return r;
 }
@@ -663,12 +1038,14 @@ free (void *virt)
 		u32 page_offset = v & PAGESIZE_MASK;
 		u32 block_offset = page_offset %
 			SMALL_ALLOCSIZE (small_allocsize);
-		if (block_offset)
-			tiny_free (p, v - block_offset, block_offset);
-		else
-			small_free (p, page_offset);
+		if (block_offset) {
+			struct tiny_allocdata *d = (void *)(v - block_offset);
+			mm_cache_free (MAG_TINY (d->tiny_allocsize), virt);
+		} else {
+			mm_cache_free (MAG_SMALL (small_allocsize), virt);
+		}
 	} else {
-		mm_page_free (p);
+		mm_page_free_cached (p);
 	}
 }
 
@@ -760,14 +1137,14 @@ realloc (void *virt, uint len)
 void
 free_page (void *virt)
 {
-	mm_page_free (virt_to_page ((virt_t)virt));
+	mm_page_free_cached (virt_to_page ((virt_t)virt));
 }
 
 /* free pages addressed by physical address */
 void
 free_page_phys (phys_t phys)
 {
-	mm_page_free (phys_to_page (phys));
+	mm_page_free_cached (phys_to_page (phys));
 }
 
 /* Free reserved pages within the specified range */
@@ -952,6 +1329,9 @@ mm_force_unlock (void)
 	spinlock_unlock (&mm_lock);
 	spinlock_unlock (&mm_small_lock);
 	spinlock_unlock (&mm_tiny_lock);
+	struct mm_pcpu *pc = mm_cache_get_pcpu ();
+	if (pc)
+		spinlock_unlock (&pc->lock);
 	mm_arch_force_unlock ();
 }
 
@@ -1176,4 +1556,31 @@ mapmem_as (const struct mm_as *as, u64 physaddr, uint len, int flags)
 	return mm_arch_mapmem_as (as, physaddr, len, flags);
 }
 
+static char *
+mm_status (void)
+{
+	static char buf[4096];
+	int len = 0;
+
+	len += snprintf (buf + len, sizeof buf - len, "Allocator:\n");
+	for (int i = 0; i < MM_PCPU_MAX && len < sizeof buf; i++) {
+		struct mm_pcpu *pc = &mm_pcpu[i];
+		if (!pc->nalloc && !pc->nfree)
+			continue;
+		len += snprintf (buf + len, sizeof buf - len,
+				 " CPU%d alloc: %llu free: %llu"
+				 " refill: %llu drain: %llu\n", i,
+				 pc->nalloc, pc->nfree, pc->nrefill,
+				 pc->ndrain);
+	}
+	return buf;
+}
+
+static void
+mm_init_status (void)
+{
+	register_status_callback (mm_status);
+}
+
 INITFUNC ("global2", mm_init_global);
+INITFUNC ("paral01", mm_init_status);
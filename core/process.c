@@ -30,6 +30,7 @@
 #include <arch/currentcpu.h>
 #include <arch/process.h>
 #include <arch/vmm_mem.h>
+#include <builtin.h>
 #include <constants.h>
 #include <core/assert.h>
 #include <core/initfunc.h>
@@ -40,12 +41,14 @@
 #include <core/process.h>
 #include <core/spinlock.h>
 #include <core/string.h>
+#include <core/time.h>
 #include <core/types.h>
 #include "elf.h"
 #include "mm.h"
 #include "msg.h"
 #include "process.h"
 #include "process_builtin.h"
+#include "vmmcall_status.h"
 
 #define NUM_OF_SYSCALLS 32
 #define NAMELEN 16
@@ -56,17 +59,25 @@ struct msgdsc_data {
 	int gen;
 	int dsc;
 	void *func;
+	u64 ncalls;		/* calls of func */
+	u64 time_total;		/* total call time in microseconds */
+	u64 time_max;
 };
 
+/* process_lock protects the process table and the descriptors.
+   lock protects the address space of the process and the stack
+   settings so that calls into a process on different processors
+   need not serialize on process_lock. */
 struct process_data {
 	bool valid;
 	struct mm_arch_proc_desc *mm_proc_desc;
 	int gen;
-	int running;
+	int running;		/* calls in progress */
 	struct msgdsc_data msgdsc[NUM_OF_MSGDSC];
 	bool exitflag;
 	bool setlimit;
 	int stacksize;
+	spinlock_t lock;
 };
 
 struct ro_segment_vec {
@@ -139,6 +150,9 @@ clearmsgdsc (struct msgdsc_data msgdsc[NUM_OF_MSGDSC])
 		msgdsc[i].gen = 0;
 		msgdsc[i].dsc = 0;
 		msgdsc[i].func = NULL;
+		msgdsc[i].ncalls = 0;
+		msgdsc[i].time_total = 0;
+		msgdsc[i].time_max = 0;
 	}
 }
 
@@ -345,6 +359,7 @@ process_init_global (void)
 	for (i = 0; i < NUM_OF_PID; i++) {
 		process[i].valid = false;
 		process[i].gen = 1;
+		spinlock_init (&process[i].lock);
 	}
 	process[0].valid = true;
 	clearmsgdsc (process[0].msgdsc);
@@ -494,7 +509,7 @@ cleanup (int pid, struct mm_arch_proc_desc *mm_proc_desc_callee,
 
 /* pid, func=pointer to the function of the process,
    sp=stack pointer of the process */
-/* process_lock must be locked */
+/* process[pid].running must be counted by the caller */
 static int
 call_msgfunc0 (int pid, void *func, ulong sp, void *arg, int len,
 	       ulong buf, int bufcnt)
@@ -503,21 +518,43 @@ call_msgfunc0 (int pid, void *func, ulong sp, void *arg, int len,
 
 	ASSERT (pid >= 0);
 	ASSERT (pid < NUM_OF_PID);
-	ASSERT (process[pid].valid);
+	ASSERT (process[pid].running > 0);
 	if (pid == 0) {
 		panic ("call_msgfunc0 can't call kernel");
 	}
 	oldpid = currentcpu_get_pid ();
 	currentcpu_set_pid (pid);
-	process[pid].running++;
-	spinlock_unlock (&process_lock);
 	ret = process_arch_exec (func, sp, arg, len, buf, bufcnt);
-	spinlock_lock (&process_lock);
-	process[pid].running--;
 	currentcpu_set_pid (oldpid);
 	return ret;
 }
 
+/* Drop the reference counted in process[pid].running and free the
+   process if it has exited */
+/* Page table must be the process's one */
+static void
+process_release (int pid, struct mm_arch_proc_desc *mm_proc_desc_callee,
+		 struct mm_arch_proc_desc *mm_proc_desc_caller)
+{
+	spinlock_lock (&process_lock);
+	ASSERT (process[pid].running > 0);
+	process[pid].running--;
+	if (process[pid].running == 0 && process[pid].exitflag)
+		cleanup (pid, mm_proc_desc_callee, mm_proc_desc_caller);
+	spinlock_unlock (&process_lock);
+	mm_process_switch (mm_proc_desc_caller);
+}
+
+static void
+msgdsc_account (struct msgdsc_data *d, u64 time)
+{
+	u64 max = d->time_max;
+
+	atomic_fetch_add64 (&d->ncalls, 1);
+	atomic_fetch_add64 (&d->time_total, time);
+	while (time > max && !atomic_cmpxchg64 (&d->time_max, &max, time));
+}
+
 /* pid, gen, desc, arg=arguments, len=length of the arguments (bytes) */
 static int
 call_msgfunc1 (int pid, int gen, int desc, void *arg, int len,
@@ -528,37 +565,48 @@ call_msgfunc1 (int pid, int gen, int desc, void *arg, int len,
 	int r = -1;
 	struct msgbuf buf_user[MAXNUM_OF_MSGBUF];
 	int (*func) (int, int, struct msgbuf *, int);
+	struct msgdsc_data *d;
+	void *msgfunc;
 	int i;
 	long tmp;
 	int stacksize;
+	u64 start;
 
 	if (currentcpu_vmm_stack_full ()) {
 		printf ("msg: not enough stack space available for VMM\n");
 		return r;
 	}
-	spinlock_lock (&process_lock);
 	ASSERT (pid >= 0);
 	ASSERT (pid < NUM_OF_PID);
-	if (!process[pid].valid)
-		goto ret;
 	ASSERT (desc >= 0);
 	ASSERT (desc < NUM_OF_MSGDSC);
+	start = get_time ();
+	spinlock_lock (&process_lock);
+	if (!process[pid].valid)
+		goto ret;
 	if (process[pid].gen != gen)	
 		goto ret;
-	if (process[pid].msgdsc[desc].func == NULL)
+	d = &process[pid].msgdsc[desc];
+	if (d->func == NULL)
 		goto ret;
 	if (pid == 0) {
 		ASSERT (len == sizeof (long) * 2);
-		func = (int (*)(int, int, struct msgbuf *, int))
-			process[pid].msgdsc[desc].func;
+		func = (int (*)(int, int, struct msgbuf *, int))d->func;
 		spinlock_unlock (&process_lock);
 		r = func (((long *)arg)[0], ((long *)arg)[1], buf, bufcnt);
+		msgdsc_account (d, get_time () - start);
 		return r;
 	}
 	if (bufcnt > MAXNUM_OF_MSGBUF)
 		goto ret;
+	/* The reference keeps the process alive without process_lock
+	   held.  Mapping is done with the process's own lock only. */
+	process[pid].running++;
+	msgfunc = d->func;
 	mm_proc_desc_callee = process[pid].mm_proc_desc;
+	spinlock_unlock (&process_lock);
 	mm_proc_desc_caller = mm_process_switch (mm_proc_desc_callee);
+	spinlock_lock (&process[pid].lock);
 	for (i = 0; i < bufcnt; i++) {
 		if (buf[i].premap_handle) {
 			tmp = (long)buf[i].base - buf[i].premap_handle;
@@ -584,13 +632,15 @@ call_msgfunc1 (int pid, int gen, int desc, void *arg, int len,
 		printf ("cannot allocate stack for process\n");
 		goto mapfail;
 	}
+	spinlock_unlock (&process[pid].lock);
 	sp = sp2;
 	for (i = bufcnt; i-- > 0;) {
 		sp -= sizeof buf_user[i];
 		memcpy ((void *)sp, &buf_user[i], sizeof buf_user[i]);
 	}
-	r = call_msgfunc0 (pid, process[pid].msgdsc[desc].func, sp, arg, len,
+	r = call_msgfunc0 (pid, msgfunc, sp, arg, len,
 			   sp /* sp is currently pointing buf */, bufcnt);
+	spinlock_lock (&process[pid].lock);
 	mm_process_unmap_stack (mm_proc_desc_callee, sp2, stacksize);
 mapfail:
 	for (i = 0; i < bufcnt; i++) {
@@ -599,9 +649,10 @@ mapfail:
 		mm_process_unmap (mm_proc_desc_callee,
 				  (virt_t)buf_user[i].base, buf_user[i].len);
 	}
-	if (process[pid].running == 0 && process[pid].exitflag)
-		cleanup (pid, mm_proc_desc_callee, mm_proc_desc_caller);
-	mm_process_switch (mm_proc_desc_caller);
+	spinlock_unlock (&process[pid].lock);
+	msgdsc_account (d, get_time () - start);
+	process_release (pid, mm_proc_desc_callee, mm_proc_desc_caller);
+	return r;
 ret:
 	spinlock_unlock (&process_lock);
 	return r;
@@ -1038,8 +1089,8 @@ sys_setlimit (ulong ip, ulong sp, ulong num, ulong arg0, ulong arg1)
 	virt_t tmp;
 	struct mm_arch_proc_desc *mm_proc_desc;
 
-	spinlock_lock (&process_lock);
 	pid = currentcpu_get_pid ();
+	spinlock_lock (&process[pid].lock);
 	if (process[pid].setlimit)
 		goto ret;
 	if (arg0 < PAGESIZE)
@@ -1052,13 +1103,13 @@ sys_setlimit (ulong ip, ulong sp, ulong num, ulong arg0, ulong arg1)
 		goto ret;
 	r = mm_process_unmap_stack (mm_proc_desc, tmp, arg1);
 	if (r) {
-		spinlock_unlock (&process_lock);
+		spinlock_unlock (&process[pid].lock);
 		panic ("unmap stack failed");
 	}
 	process[pid].setlimit = true;
 	process[pid].stacksize = arg0;
 ret:
-	spinlock_unlock (&process_lock);
+	spinlock_unlock (&process[pid].lock);
 	return (ulong)r;
 }
 
@@ -1082,14 +1133,20 @@ msgpremapbuf (int desc, struct msgbuf *buf)
 		goto ret;
 	if (process[topid].gen != togen)	
 		goto ret;
+	process[topid].running++;
 	mm_proc_desc_callee = process[topid].mm_proc_desc;
+	spinlock_unlock (&process_lock);
 	mm_proc_desc_caller = mm_process_switch (mm_proc_desc_callee);
+	spinlock_lock (&process[topid].lock);
 	base_user = mm_process_map_shared (mm_proc_desc_callee,
 					   mm_proc_desc_caller, buf->base,
 					   buf->len, !!buf->rw, false);
-	mm_process_switch (mm_proc_desc_caller);
+	spinlock_unlock (&process[topid].lock);
+	process_release (topid, mm_proc_desc_callee, mm_proc_desc_caller);
+	goto out;
 ret:
 	spinlock_unlock (&process_lock);
+out:
 	if (base_user)
 		return (long)buf->base - (long)base_user;
 	else
@@ -1122,4 +1179,39 @@ process_get_syscall_func (uint num)
 	return NULL;
 }
 
+static char *
+process_status (void)
+{
+	static char buf[4096];
+	int len = 0;
+	struct msgdsc_data *d;
+	u64 ncalls;
+
+	len += snprintf (buf + len, sizeof buf - len, "Message calls:\n");
+	for (int pid = 0; pid < NUM_OF_PID; pid++) {
+		if (!process[pid].valid)
+			continue;
+		for (int i = 0; i < NUM_OF_MSGDSC; i++) {
+			d = &process[pid].msgdsc[i];
+			ncalls = d->ncalls;
+			if (!ncalls || len >= sizeof buf)
+				continue;
+			len += snprintf (buf + len, sizeof buf - len,
+					 " pid %d desc %d calls: %llu"
+					 " avg: %llu us max: %llu us\n",
+					 pid, i, ncalls,
+					 d->time_total / ncalls,
+					 d->time_max);
+		}
+	}
+	return buf;
+}
+
+static void
+process_init_status (void)
+{
+	register_status_callback (process_status);
+}
+
 INITFUNC ("global3", process_init_global);
+INITFUNC ("paral01", process_init_status);
@@ -42,9 +42,11 @@
 #include <core/spinlock.h>
 #include <core/string.h>
 #include <core/thread.h>
+#include <core/timer.h>
 #include "mm.h"
 
 #define MAXNUM_OF_THREADS	256
+#define NUM_OF_RUNQUEUES	64
 #define CPUNUM_ANY		-1
 #ifdef THREAD_1CPU
 #define LOCK_DEFINE(l) spinlock_t l
@@ -69,8 +71,9 @@ struct thread_data {
 	LIST1_DEFINE (struct thread_data);
 	struct thread_context *context;
 	tid_t tid;
-	enum thread_state state;
+	u32 state;		/* enum thread_state */
 	int cpunum;
+	int rqnum;		/* run queue the thread last ran from */
 	bool boot;
 	void *stack;
 	int pid;
@@ -78,11 +81,24 @@ struct thread_data {
 	struct mm_arch_proc_desc *process_switch;
 };
 
+/* Each processor has its own run queue.  The lock of the current run
+ * queue is held during a thread switch and is released by switched()
+ * in the new thread.  A thread is added only to the run queue it last
+ * ran from, so a thread in a run queue always has its context saved.
+ * A processor with no runnable thread in its run queue steals a
+ * CPUNUM_ANY thread from another run queue. */
+struct thread_runqueue {
+	LOCK_DEFINE (lock);
+	LIST1_DEFINE_HEAD (struct thread_data, runnable);
+	u32 nany;		/* number of CPUNUM_ANY threads */
+	struct thread_data *exited;
+};
+
 static struct thread_data td[MAXNUM_OF_THREADS];
 static LIST1_DEFINE_HEAD (struct thread_data, td_free);
-static LIST1_DEFINE_HEAD (struct thread_data, td_runnable);
-static LOCK_DEFINE (thread_lock);
-static void *old_stack;
+static LOCK_DEFINE (td_free_lock);
+static struct thread_runqueue runqueue[NUM_OF_RUNQUEUES];
+static u32 num_of_runqueues;
 static bool thread_cpu0only;
 
 static void
@@ -91,6 +107,7 @@ thread_data_init (struct thread_data *d, struct thread_context *c, void *stack,
 {
 	d->context = c;
 	d->cpunum = cpunum;
+	d->rqnum = 0;
 	d->boot = false;
 	d->stack = stack;
 	d->pid = 0;
@@ -117,10 +134,86 @@ thread_gettid (void)
 	return currentcpu_get_tid ();
 }
 
+static int
+thread_get_rqnum (void)
+{
+	if (!currentcpu_available ())
+		return 0;
+	return currentcpu_get_id () % NUM_OF_RUNQUEUES;
+}
+
 static void
 switched (void)
 {
-	LOCK_UNLOCK (&thread_lock);
+	struct thread_runqueue *rq = &runqueue[thread_get_rqnum ()];
+	struct thread_data *exited = rq->exited;
+
+	rq->exited = NULL;
+	LOCK_UNLOCK (&rq->lock);
+	if (exited) {
+		/* The exited thread is no longer running on its stack */
+		if (exited->stack)
+			free (exited->stack);
+		LOCK_LOCK (&td_free_lock);
+		LIST1_ADD (td_free, exited);
+		LOCK_UNLOCK (&td_free_lock);
+	}
+}
+
+/* Called with rq->lock held */
+static void
+runqueue_add (struct thread_runqueue *rq, struct thread_data *d)
+{
+	LIST1_ADD (rq->runnable, d);
+	if (d->cpunum == CPUNUM_ANY)
+		rq->nany++;
+}
+
+/* Called with rq->lock held */
+static struct thread_data *
+runqueue_get (struct thread_runqueue *rq, int cpuany, int cpucur)
+{
+	struct thread_data *d;
+
+	LIST1_FOREACH (rq->runnable, d) {
+		if (d->cpunum == cpuany || d->cpunum == cpucur) {
+			LIST1_DEL (rq->runnable, d);
+			if (d->cpunum == CPUNUM_ANY)
+				rq->nany--;
+			return d;
+		}
+	}
+	return NULL;
+}
+
+static void
+thread_enqueue (struct thread_data *d)
+{
+	struct thread_runqueue *rq = &runqueue[d->rqnum];
+
+	LOCK_LOCK (&rq->lock);
+	runqueue_add (rq, d);
+	LOCK_UNLOCK (&rq->lock);
+}
+
+static struct thread_data *
+thread_steal (int rqnum)
+{
+	struct thread_runqueue *rq;
+	struct thread_data *d;
+	int i, n = num_of_runqueues;
+
+	for (i = 1; i < n; i++) {
+		rq = &runqueue[(rqnum + i) % n];
+		if (!*(volatile u32 *)&rq->nany)
+			continue;
+		LOCK_LOCK (&rq->lock);
+		d = runqueue_get (rq, CPUNUM_ANY, CPUNUM_ANY);
+		LOCK_UNLOCK (&rq->lock);
+		if (d)
+			return d;
+	}
+	return NULL;
 }
 
 static bool
@@ -144,44 +237,53 @@ schedule_skip (bool start)
 void
 schedule (void)
 {
+	struct thread_runqueue *rq;
 	struct thread_data *d;
 	tid_t oldtid, newtid;
 	int cpuany = CPUNUM_ANY;
-	int cpucur;
+	int cpucur, rqnum;
+	u32 state;
 
+	timer_check_deadline ();
 	if (schedule_skip (true))
 		return;
 	cpucur = currentcpu_get_id ();
-	LOCK_LOCK (&thread_lock);
-	if (old_stack) {
-		free (old_stack);
-		old_stack = NULL;
-	}
+	rqnum = cpucur % NUM_OF_RUNQUEUES;
+	rq = &runqueue[rqnum];
 	if (thread_cpu0only && cpucur)
 		cpuany = cpucur;
-	LIST1_FOREACH (td_runnable, d) {
-		if (d->cpunum == cpuany || d->cpunum == cpucur)
-			goto found;
+	LOCK_LOCK (&rq->lock);
+	d = runqueue_get (rq, cpuany, cpucur);
+	if (!d && cpuany == CPUNUM_ANY && num_of_runqueues > 1) {
+		LOCK_UNLOCK (&rq->lock);
+		d = thread_steal (rqnum);
+		LOCK_LOCK (&rq->lock);
 	}
-	LOCK_UNLOCK (&thread_lock);
-	schedule_skip (false);
-	return;
-found:
-	LIST1_DEL (td_runnable, d);
+	if (!d) {
+		LOCK_UNLOCK (&rq->lock);
+		schedule_skip (false);
+		return;
+	}
+	d->rqnum = rqnum;
 	oldtid = currentcpu_get_tid ();
 	newtid = d->tid;
 	currentcpu_set_tid (newtid);
 	thread_data_save_and_load (&td[oldtid], d);
 	switch (td[oldtid].state) {
 	case THREAD_EXIT:
-		old_stack = td[oldtid].stack;
-		LIST1_ADD (td_free, &td[oldtid]);
-		break;
-	case THREAD_RUN:
-		LIST1_ADD (td_runnable, &td[oldtid]);
+		/* Freed by switched() after the switch */
+		rq->exited = &td[oldtid];
 		break;
 	case THREAD_WILL_STOP:
-		td[oldtid].state = THREAD_STOP;
+		/* thread_wakeup() may have changed the state to
+		 * THREAD_RUN.  It adds the thread to this run queue
+		 * after the switch if the state is THREAD_STOP. */
+		state = THREAD_WILL_STOP;
+		if (atomic_cmpxchg32 (&td[oldtid].state, &state, THREAD_STOP))
+			break;
+		/* Fall through */
+	case THREAD_RUN:
+		runqueue_add (rq, &td[oldtid]);
 		break;
 	case THREAD_STOP:
 	default:
@@ -208,13 +310,14 @@ thread_new0 (struct thread_context *c, void *stack)
 	struct thread_data *d;
 	tid_t r;
 
-	LOCK_LOCK (&thread_lock);
+	LOCK_LOCK (&td_free_lock);
 	d = LIST1_POP (td_free);
+	LOCK_UNLOCK (&td_free_lock);
 	ASSERT (d);
 	thread_data_init (d, c, stack, CPUNUM_ANY);
-	LIST1_ADD (td_runnable, d);
+	d->rqnum = thread_get_rqnum ();
 	r = d->tid;
-	LOCK_UNLOCK (&thread_lock);
+	thread_enqueue (d);
 	return r;
 }
 
@@ -233,13 +336,7 @@ thread_new (void (*func) (void *), void *arg, int stacksize)
 static enum thread_state
 thread_set_state (tid_t tid, enum thread_state state)
 {
-	enum thread_state oldstate;
-
-	LOCK_LOCK (&thread_lock);
-	oldstate = td[tid].state;
-	td[tid].state = state;
-	LOCK_UNLOCK (&thread_lock);
-	return oldstate;
+	return atomic_xchg32 (&td[tid].state, state);
 }
 
 void
@@ -252,9 +349,7 @@ thread_wakeup (tid_t tid)
 	case THREAD_WILL_STOP:
 		break;
 	case THREAD_STOP:
-		LOCK_LOCK (&thread_lock);
-		LIST1_ADD (td_runnable, &td[tid]);
-		LOCK_UNLOCK (&thread_lock);
+		thread_enqueue (&td[tid]);
 		break;
 	case THREAD_EXIT:
 	default:
@@ -310,9 +405,7 @@ thread_exit (void)
 void
 thread_set_cpu0only (bool enable)
 {
-	LOCK_LOCK (&thread_lock);
 	thread_cpu0only = enable;
-	LOCK_UNLOCK (&thread_lock);
 }
 
 static int
@@ -357,9 +450,14 @@ thread_init_global (void)
 	int i;
 
 	LIST1_HEAD_INIT (td_free);
-	LIST1_HEAD_INIT (td_runnable);
-	LOCK_INIT (&thread_lock);
-	old_stack = NULL;
+	LOCK_INIT (&td_free_lock);
+	for (i = 0; i < NUM_OF_RUNQUEUES; i++) {
+		LOCK_INIT (&runqueue[i].lock);
+		LIST1_HEAD_INIT (runqueue[i].runnable);
+		runqueue[i].nany = 0;
+		runqueue[i].exited = NULL;
+	}
+	num_of_runqueues = 1;
 	for (i = 0; i < MAXNUM_OF_THREADS; i++) {
 		td[i].tid = i;
 		td[i].state = THREAD_EXIT;
@@ -371,14 +469,19 @@ static void
 thread_init_pcpu (void)
 {
 	struct thread_data *d;
+	u32 n, rqnum = thread_get_rqnum ();
 
-	LOCK_LOCK (&thread_lock);
+	LOCK_LOCK (&td_free_lock);
 	d = LIST1_POP (td_free);
+	LOCK_UNLOCK (&td_free_lock);
 	ASSERT (d);
 	thread_data_init (d, NULL, NULL, currentcpu_get_id ());
 	d->boot = true;
+	d->rqnum = rqnum;
 	currentcpu_set_tid (d->tid);
-	LOCK_UNLOCK (&thread_lock);
+	n = num_of_runqueues;
+	while (n <= rqnum && !atomic_cmpxchg32 (&num_of_runqueues, &n,
+						rqnum + 1));
 }
 
 static void
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2026 Igel Co., Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Worker pool for splitting a job across processors.  One worker
+ * thread is created per processor.  Workers are stopped while there is
+ * no job and are woken up by thread_pool_run().  Since threads are
+ * scheduled on VM exits, a worker runs on whichever processor exits
+ * next.  The caller works on the job too and does not call schedule()
+ * while waiting, so thread_pool_run() may be called with locks held.
+ */
+
+#include <builtin.h>
+#include <core.h>
+#include <core/thread.h>
+
+#define THREAD_POOL_MAX_WORKERS	16
+
+struct thread_pool_job {
+	void (*func) (void *arg, int index);
+	void *arg;
+	u32 n;
+	u32 next;		/* next index to run */
+	u32 users;		/* number of workers referring the job */
+};
+
+static struct thread_pool_job *pool_job;
+static spinlock_t pool_lock;
+static tid_t pool_idle[THREAD_POOL_MAX_WORKERS];
+static int pool_nidle;
+static u32 pool_nworkers;
+
+static void
+thread_pool_do_job (struct thread_pool_job *job)
+{
+	u32 i;
+
+	while ((i = atomic_fetch_add32 (&job->next, 1)) < job->n)
+		job->func (job->arg, i);
+}
+
+static void
+thread_pool_worker (void *arg)
+{
+	struct thread_pool_job *job;
+
+	for (;;) {
+		spinlock_lock (&pool_lock);
+		job = pool_job;
+		if (!job || job->next >= job->n) {
+			pool_idle[pool_nidle++] = thread_gettid ();
+			thread_will_stop ();
+			spinlock_unlock (&pool_lock);
+			schedule ();
+			continue;
+		}
+		atomic_fetch_add32 (&job->users, 1);
+		spinlock_unlock (&pool_lock);
+		thread_pool_do_job (job);
+		/* The job must not be accessed after this */
+		atomic_fetch_add32 (&job->users, -1);
+	}
+}
+
+/* Call func (arg, index) for each 0 <= index < n and return after all
+ * the calls have finished.  The calls may run in parallel on other
+ * processors.  If another job is running, all the calls are done on
+ * the current processor. */
+void
+thread_pool_run (void (*func) (void *arg, int index), void *arg, int n)
+{
+	struct thread_pool_job job;
+	int i;
+
+	job.func = func;
+	job.arg = arg;
+	job.n = n;
+	job.next = 0;
+	job.users = 0;
+	spinlock_lock (&pool_lock);
+	if (pool_job || !pool_nidle || n < 2) {
+		spinlock_unlock (&pool_lock);
+		for (i = 0; i < n; i++)
+			func (arg, i);
+		return;
+	}
+	pool_job = &job;
+	while (pool_nidle > 0)
+		thread_wakeup (pool_idle[--pool_nidle]);
+	spinlock_unlock (&pool_lock);
+	thread_pool_do_job (&job);
+	spinlock_lock (&pool_lock);
+	pool_job = NULL;
+	spinlock_unlock (&pool_lock);
+	while (*(volatile u32 *)&job.users)
+		cpu_relax ();
+}
+
+static void
+thread_pool_init_global (void)
+{
+	spinlock_init (&pool_lock);
+	pool_job = NULL;
+	pool_nidle = 0;
+	pool_nworkers = 0;
+}
+
+static void
+thread_pool_init_pcpu (void)
+{
+	if (atomic_fetch_add32 (&pool_nworkers, 1) < THREAD_POOL_MAX_WORKERS)
+		thread_new (thread_pool_worker, NULL, VMM_STACKSIZE);
+}
+
+INITFUNC ("global3", thread_pool_init_global);
+INITFUNC ("pcpu1", thread_pool_init_pcpu);
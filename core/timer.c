@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <builtin.h>
 #include <core/initfunc.h>
 #include <core/list.h>
 #include <core/mm.h>
@@ -37,24 +38,195 @@
 #include <core/types.h>
 #include "constants.h"
 
-#define MAX_TIMER 128
+/* Active timers are kept in a hierarchical timing wheel.  Level l has
+ * TIMER_WHEEL_SIZE slots of TIMER_WHEEL_SIZE^l ticks each.  A timer is
+ * put in the lowest level that covers its expiry, and timers in a
+ * higher level slot are moved to lower levels when the wheel reaches
+ * the slot.  Insertion and cancellation are O(1), and the bitmaps let
+ * the wheel skip empty slots.  The expiry is rounded up to a tick, so
+ * a callback is never called early. */
+#define TIMER_TICK_SHIFT	4	/* 16 microseconds */
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS	6
+#define TIMER_ALLOC_NUM		64
+#define TIMER_NO_DEADLINE	(~0ULL)
 
 static spinlock_t timer_lock;
 
+struct timer_slot {
+	LIST1_DEFINE_HEAD (struct timer_data, list);
+};
+
 struct timer_data {
 	LIST1_DEFINE (struct timer_data);
 	bool enable;
-	u64 settime;
-	u64 interval;
+	int level;		/* -1 if expired */
+	u64 expire;		/* in ticks */
+	struct timer_slot *slot;
 	void (*callback) (void *handle, void *data);
 	void *data;
 };
 
-static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_on);
-static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_off);
+struct timer_wheel_level {
+	u64 bitmap;		/* non-empty slots */
+	struct timer_slot slot[TIMER_WHEEL_SIZE];
+};
+
+static struct timer_wheel_level timer_wheel[TIMER_WHEEL_LEVELS];
+static u64 timer_wheel_time;	/* next tick to process */
+static uint timer_wheel_num;	/* number of timers in the wheel */
+static struct timer_slot timer_expired;
 static LIST1_DEFINE_HEAD (struct timer_data, list1_timer_free);
-static void timer_thread (void *thread_data);
+static u64 timer_deadline;	/* next event in microseconds */
+static tid_t timer_tid;
 static bool timer_thread_run = false;
+static u32 timer_thread_sleeping;
+static void timer_thread (void *thread_data);
+
+static u64
+rotr64 (u64 x, int n)
+{
+	return n ? (x >> n) | (x << (64 - n)) : x;
+}
+
+static void
+timer_wheel_add (struct timer_data *p)
+{
+	u64 e = p->expire;
+	u64 t = timer_wheel_time;
+	int l, shift, index;
+
+	if (e < t)
+		e = t;
+	for (l = 0; l < TIMER_WHEEL_LEVELS - 1; l++)
+		if ((e >> (l * TIMER_WHEEL_BITS)) -
+		    (t >> (l * TIMER_WHEEL_BITS)) < TIMER_WHEEL_SIZE)
+			break;
+	shift = l * TIMER_WHEEL_BITS;
+	/* Timers beyond the top level wait in its last slot */
+	if ((e >> shift) - (t >> shift) >= TIMER_WHEEL_SIZE)
+		e = ((t >> shift) + TIMER_WHEEL_MASK) << shift;
+	index = (e >> shift) & TIMER_WHEEL_MASK;
+	p->level = l;
+	p->slot = &timer_wheel[l].slot[index];
+	LIST1_ADD (p->slot->list, p);
+	timer_wheel[l].bitmap |= 1ULL << index;
+	timer_wheel_num++;
+}
+
+static void
+timer_unlink (struct timer_data *p)
+{
+	int l = p->level;
+
+	LIST1_DEL (p->slot->list, p);
+	if (l < 0)
+		return;
+	if (!p->slot->list.next)
+		timer_wheel[l].bitmap &= ~(1ULL << (p->slot -
+						     timer_wheel[l].slot));
+	timer_wheel_num--;
+}
+
+/* Returns the first tick at or after t at which a timer expires or a
+ * slot is moved to lower levels */
+static u64
+timer_wheel_next (u64 t)
+{
+	u64 next = TIMER_NO_DEADLINE;
+	int l, shift;
+
+	for (l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		if (!timer_wheel[l].bitmap)
+			continue;
+		shift = l * TIMER_WHEEL_BITS;
+		u64 b = t >> shift;
+		u64 r = rotr64 (timer_wheel[l].bitmap, b & TIMER_WHEEL_MASK);
+		u64 event = (b + __builtin_ctzll (r)) << shift;
+		if (next > event)
+			next = event;
+	}
+	return next;
+}
+
+static void
+timer_wheel_cascade (int l, int index)
+{
+	struct timer_slot *slot = &timer_wheel[l].slot[index];
+	struct timer_data *p;
+
+	timer_wheel[l].bitmap &= ~(1ULL << index);
+	while ((p = LIST1_POP (slot->list))) {
+		timer_wheel_num--;
+		timer_wheel_add (p);
+	}
+}
+
+/* Move timers expiring at or before the tick now to timer_expired */
+static void
+timer_wheel_run (u64 now)
+{
+	struct timer_slot *slot;
+	struct timer_data *p;
+	u64 t, next;
+	int l, index;
+
+	while (timer_wheel_num && timer_wheel_time <= now) {
+		t = timer_wheel_time;
+		for (l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+			if (t & ((1ULL << (l * TIMER_WHEEL_BITS)) - 1))
+				continue;
+			index = (t >> (l * TIMER_WHEEL_BITS)) &
+				TIMER_WHEEL_MASK;
+			if (timer_wheel[l].bitmap & (1ULL << index))
+				timer_wheel_cascade (l, index);
+		}
+		index = t & TIMER_WHEEL_MASK;
+		slot = &timer_wheel[0].slot[index];
+		timer_wheel[0].bitmap &= ~(1ULL << index);
+		while ((p = LIST1_POP (slot->list))) {
+			timer_wheel_num--;
+			p->level = -1;
+			p->slot = &timer_expired;
+			LIST1_ADD (timer_expired.list, p);
+		}
+		next = timer_wheel_next (t + 1);
+		timer_wheel_time = next <= now ? next : now + 1;
+	}
+	if (!timer_wheel_num && timer_wheel_time <= now)
+		timer_wheel_time = now + 1;
+}
+
+static void
+timer_update_deadline (void)
+{
+	u64 next;
+
+	if (timer_expired.list.next)
+		next = 0;
+	else if (!timer_wheel_num)
+		next = TIMER_NO_DEADLINE;
+	else
+		next = timer_wheel_next (timer_wheel_time) << TIMER_TICK_SHIFT;
+	timer_deadline = next;
+}
+
+/* Called with timer_lock held.  The chunk is allocated without the
+ * lock and pushed to the free list with the lock held again. */
+static void
+timer_alloc_free (void)
+{
+	struct timer_data *p;
+	int i;
+
+	spinlock_unlock (&timer_lock);
+	p = alloc (TIMER_ALLOC_NUM * sizeof (struct timer_data));
+	spinlock_lock (&timer_lock);
+	for (i = 0; i < TIMER_ALLOC_NUM; i++)
+		LIST1_PUSH (list1_timer_free, &p[i]);
+}
 
 void *
 timer_new (void (*callback) (void *handle, void *data), void *data)
@@ -62,13 +234,11 @@ timer_new (void (*callback) (void *handle, void *data), void *data)
 	struct timer_data *p;
 
 	spinlock_lock (&timer_lock);
-	p = LIST1_POP (list1_timer_free);
-	if (p == NULL)
-		return NULL;
+	while ((p = LIST1_POP (list1_timer_free)) == NULL)
+		timer_alloc_free ();
 	p->enable = false;
 	p->callback = callback;
 	p->data = data;
-	LIST1_ADD (list1_timer_off, p);
 	spinlock_unlock (&timer_lock);
 	return p;
 }
@@ -76,29 +246,24 @@ timer_new (void (*callback) (void *handle, void *data), void *data)
 void
 timer_set (void *handle, u64 interval_usec)
 {
-	struct timer_data *p, *d;
+	struct timer_data *p;
 	u64 time;
 
 	spinlock_lock (&timer_lock);
 	time = get_time ();
 	p = handle;
-	if (!p->enable) {
-		LIST1_DEL (list1_timer_off, p);
-		p->enable = true;
-	} else {
-		LIST1_DEL (list1_timer_on, p);
-	}
-	p->settime = time;
-	p->interval = interval_usec;
-	LIST1_FOREACH (list1_timer_on, d)
-		if (d->interval > (time - d->settime) &&
-		    d->interval - (time - d->settime) > interval_usec)
-			break;
-	LIST1_INSERT (list1_timer_on, d, p);
+	if (p->enable)
+		timer_unlink (p);
+	p->enable = true;
+	if (!timer_wheel_num)
+		timer_wheel_time = time >> TIMER_TICK_SHIFT;
+	p->expire = (time + interval_usec + (1 << TIMER_TICK_SHIFT) - 1) >>
+		TIMER_TICK_SHIFT;
+	timer_wheel_add (p);
+	timer_update_deadline ();
 	if (!timer_thread_run) {
-		thread_new (timer_thread, NULL, VMM_STACKSIZE);
+		timer_tid = thread_new (timer_thread, NULL, VMM_STACKSIZE);
 		timer_thread_run = true;
-		/* FIXME: Stop thread when no timers are active. */
 	}
 	spinlock_unlock (&timer_lock);
 }
@@ -111,36 +276,55 @@ timer_free (void *handle)
 	spinlock_lock (&timer_lock);
 	p = handle;
 	if (p->enable)
-		LIST1_DEL (list1_timer_on, p);
-	else
-		LIST1_DEL (list1_timer_off, p);
+		timer_unlink (p);
 	p->enable = false;
 	LIST1_ADD (list1_timer_free, p);
 	spinlock_unlock (&timer_lock);
 }
 
+/* Called at the beginning of schedule() on every processor.  Wakes up
+ * the timer thread when the earliest deadline has passed.  The time is
+ * read only while the thread is stopped and a timer is armed. */
+void
+timer_check_deadline (void)
+{
+	u64 deadline;
+
+	if (!atomic_load_acquire32 (&timer_thread_sleeping))
+		return;
+	deadline = *(volatile u64 *)&timer_deadline;
+	if (deadline == TIMER_NO_DEADLINE || get_time () < deadline)
+		return;
+	if (atomic_xchg32 (&timer_thread_sleeping, 0))
+		thread_wakeup (timer_tid);
+}
+
+/* The thread stops until timer_check_deadline() sees that the earliest
+ * deadline has passed, so it does not run at all between timers. */
 static void
 timer_thread (void *thread_data)
 {
 	struct timer_data *p;
-	u64 time;
 	void (*callback) (void *handle, void *data);
 	void *data;
 
 	for (;;) {
 		spinlock_lock (&timer_lock);
-		LIST1_FOREACH (list1_timer_on, p) {
-			/* p->enable must be true */
-			time = get_time ();
-			if ((time - p->settime) >= p->interval)
-				goto found;
-			break;
-		}
+		timer_wheel_run (get_time () >> TIMER_TICK_SHIFT);
+		p = LIST1_POP (timer_expired.list);
+		timer_update_deadline ();
+		if (p)
+			goto found;
+		/* timer_deadline is written before the flag.  A
+		 * timer_set() after this lowers timer_deadline, which
+		 * timer_check_deadline() reads after the flag. */
+		thread_will_stop ();
+		atomic_xchg32 (&timer_thread_sleeping, 1);
 		spinlock_unlock (&timer_lock);
 		schedule ();
 		continue;
 	found:
-		LIST1_DEL (list1_timer_on, p);
+		/* p->enable must be true */
 		p->enable = false;
 		/* Copy callback and data to avoid race condition with
 		 * timer_free() and timer_new() after unlock which is
@@ -148,7 +332,6 @@ timer_thread (void *thread_data)
 		 * callback. */
 		callback = p->callback;
 		data = p->data;
-		LIST1_ADD (list1_timer_off, p);
 		spinlock_unlock (&timer_lock);
 		callback (p, data);
 	}
@@ -157,15 +340,20 @@ timer_thread (void *thread_data)
 static void
 timer_init_global (void)
 {
-	struct timer_data *p;
-	int i;
+	int i, j;
 
-	LIST1_HEAD_INIT (list1_timer_on);
-	LIST1_HEAD_INIT (list1_timer_off);
 	LIST1_HEAD_INIT (list1_timer_free);
-	p = alloc (MAX_TIMER * sizeof (struct timer_data));
-	for (i = 0; i < MAX_TIMER; i++)
-		LIST1_PUSH (list1_timer_free, &p[i]);
+	LIST1_HEAD_INIT (timer_expired.list);
+	for (i = 0; i < TIMER_WHEEL_LEVELS; i++) {
+		timer_wheel[i].bitmap = 0;
+		for (j = 0; j < TIMER_WHEEL_SIZE; j++)
+			LIST1_HEAD_INIT (timer_wheel[i].slot[j].list);
+	}
+	timer_wheel_time = 0;
+	timer_wheel_num = 0;
+	timer_deadline = TIMER_NO_DEADLINE;
+	timer_thread_sleeping = 0;
+	timer_alloc_free ();
 	spinlock_init (&timer_lock);
 }
 
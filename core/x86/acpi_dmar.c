@@ -28,6 +28,7 @@
  */
 
 #include <arch/vmm_mem.h>
+#include <builtin.h>
 #include <constants.h>
 #include <core/acpi.h>
 #include <core/assert.h>
@@ -57,6 +58,10 @@
 #define DMAR_GLOBAL_STATUS_TES_BIT (1 << 31)
 #define DMAR_GLOBAL_STATUS_IRES_BIT (1 << 25)
 #define CAP_REG_SLLPS_21_BIT	0x400000000ULL
+#define DMAR_IOTLB_SIZE		256 /* must be a power of 2 */
+#define DMAR_CCMD_REG		0x28
+#define DMAR_IQT_REG		0x88
+#define DMAR_IOTLB_REG		0x8 /* offset from IVA register */
 
 struct remapping_structures_header {
 	u16 type;
@@ -111,14 +116,29 @@ struct drhd_devlist {
 	u8 path[];
 } __attribute__ ((packed));
 
+/* An IOTLB entry is updated under the lock and read without the lock.
+ * seq is odd while the entry is being updated.  The entry is valid
+ * only if gen matches the generation of the IOTLB, which is
+ * incremented to invalidate all the entries. */
+struct dmar_iotlb_entry {
+	u32 seq;
+	u32 gen;
+	u64 tag;
+	u64 pte;
+};
+
 struct dmar_drhd_reg_data {
 	void *mmio;
+	void *iotlb_mmio;
 	struct dmar_drhd_reg *reg;
 	u64 base;
 	u16 segment;
 	struct drhd_devlist *devlist;
 	spinlock_t lock;
 	bool cached;
+	u32 iotlb_gen;
+	struct dmar_iotlb_entry *iotlb;
+	u64 iotlb_reg_off;
 	struct {
 		struct {
 			u64 entry[512];
@@ -558,12 +578,119 @@ end:
 	return ret;
 }
 
+/* Invalidate all the IOTLB entries.  This is called with d->lock held
+ * when the guest writes a register which changes or invalidates the
+ * translation, before the write reaches the hardware.  When the
+ * generation wraps around, the entries are cleared so that an entry
+ * filled in the previous round never matches the generation again.
+ * Entries are filled only with the current generation under d->lock,
+ * so no entry of the previous round is filled after the clear. */
+static void
+dmar_iotlb_flush_locked (struct dmar_drhd_reg_data *d)
+{
+	struct dmar_iotlb_entry *e;
+	int i;
+
+	if (atomic_fetch_add32 (&d->iotlb_gen, 1) != ~0U)
+		return;
+	for (i = 0; i < DMAR_IOTLB_SIZE; i++) {
+		e = &d->iotlb[i];
+		atomic_store_release32 (&e->seq, e->seq + 1);
+		atomic_fence ();
+		e->pte = 0;
+		atomic_store_release32 (&e->seq, e->seq + 1);
+	}
+}
+
+static void
+dmar_iotlb_flush (struct dmar_drhd_reg_data *d)
+{
+	spinlock_lock (&d->lock);
+	dmar_iotlb_flush_locked (d);
+	spinlock_unlock (&d->lock);
+}
+
+static struct dmar_iotlb_entry *
+dmar_iotlb_entry (struct dmar_drhd_reg_data *d, u64 tag)
+{
+	return &d->iotlb[(tag ^ tag >> 9 ^ tag >> 48 << 3) &
+			 (DMAR_IOTLB_SIZE - 1)];
+}
+
+static bool
+dmar_iotlb_lookup (struct dmar_drhd_reg_data *d, u64 tag, u32 gen, u64 *pte)
+{
+	struct dmar_iotlb_entry *e = dmar_iotlb_entry (d, tag);
+	u32 seq, egen;
+	u64 etag, epte;
+
+	seq = atomic_load_acquire32 (&e->seq);
+	if (seq & 1)
+		return false;
+	egen = *(volatile u32 *)&e->gen;
+	etag = *(volatile u64 *)&e->tag;
+	epte = *(volatile u64 *)&e->pte;
+	atomic_fence_acquire ();
+	if (*(volatile u32 *)&e->seq != seq)
+		return false;
+	if (egen != gen || etag != tag || !epte)
+		return false;
+	*pte = epte;
+	return true;
+}
+
+static void
+dmar_iotlb_fill (struct dmar_drhd_reg_data *d, u64 tag, u32 gen, u64 pte)
+{
+	struct dmar_iotlb_entry *e = dmar_iotlb_entry (d, tag);
+
+	spinlock_lock (&d->lock);
+	if (atomic_load_acquire32 (&d->iotlb_gen) != gen) {
+		spinlock_unlock (&d->lock);
+		return;
+	}
+	atomic_store_release32 (&e->seq, e->seq + 1);
+	atomic_fence ();
+	e->gen = gen;
+	e->tag = tag;
+	e->pte = pte;
+	atomic_store_release32 (&e->seq, e->seq + 1);
+	spinlock_unlock (&d->lock);
+}
+
 u64
 acpi_dmar_translate (struct dmar_drhd_reg_data *d, u8 bus, u8 dev, u8 func,
 		     u64 address)
 {
-	return do_acpi_dmar_translate (d, bus, dev, func, address,
-				       dmar_lookup);
+	u64 tag, ret;
+	u32 gen;
+
+	/* The tag is the source-id and the page number.  Addresses
+	 * which do not fit in the tag are not cached. */
+	if (address >> 60)
+		return do_acpi_dmar_translate (d, bus, dev, func, address,
+					       dmar_lookup);
+	tag = (u64)(bus << 8 | dev << 3 | func) << 48 |
+		address >> PAGESIZE_SHIFT;
+	/* Read the generation before the table walk so that an entry
+	 * filled by a walk racing with an invalidation is not used. */
+	gen = atomic_load_acquire32 (&d->iotlb_gen);
+	if (dmar_iotlb_lookup (d, tag, gen, &ret))
+		return ret;
+	ret = do_acpi_dmar_translate (d, bus, dev, func, address,
+				      dmar_lookup);
+	/* Not-present entries are not cached since the guest does not
+	 * have to invalidate them after making them present. */
+	if (ret)
+		dmar_iotlb_fill (d, tag, gen, ret);
+	return ret;
+}
+
+/* Incremented whenever the guest may have changed the translation */
+u32
+acpi_dmar_generation (struct dmar_drhd_reg_data *d)
+{
+	return atomic_load_acquire32 (&d->iotlb_gen);
 }
 
 u64
@@ -653,7 +780,10 @@ acpi_dmar_done_pci_device (void)
 		for (i = 0; i < vp.drhd_num; i++) {
 			dmar_pass_free_devlist (vp.reg[i].devlist);
 			mmio_unregister (vp.reg[i].mmio);
+			if (vp.reg[i].iotlb_mmio)
+				mmio_unregister (vp.reg[i].iotlb_mmio);
 			unmapmem (vp.reg[i].reg, sizeof *vp.reg[i].reg);
+			free (vp.reg[i].iotlb);
 		}
 		free (vp.reg);
 		vp.reg = NULL;
@@ -872,10 +1002,19 @@ drhd_reghandler (void *data, phys_t gphys, bool wr, void *buf, uint len, u32 f)
 				 * Address Register, etc. */
 		spinlock_lock (&d->lock);
 		d->cached = false;
+		dmar_iotlb_flush_locked (d);
 		memcpy ((void *)d->reg + off, buf, len);
 		spinlock_unlock (&d->lock);
 		return 1;
 	}
+	/* Snoop the Context Command Register and the Invalidation Queue
+	 * Tail Register.  Any context-cache invalidation or queued
+	 * invalidation invalidates the whole IOTLB. */
+	if (wr && ((off < DMAR_CCMD_REG + 8 && off + len > DMAR_CCMD_REG) ||
+		   (off < DMAR_IQT_REG + 8 && off + len > DMAR_IQT_REG) ||
+		   (off < d->iotlb_reg_off + DMAR_IOTLB_REG + 8 &&
+		    off + len > d->iotlb_reg_off + DMAR_IOTLB_REG)))
+		dmar_iotlb_flush (d);
 	/* For Capability Register and Extended Capability Register read */
 	if (!wr && off < 0x18 && off + len > 0x8) {
 		u64 tmp;
@@ -899,6 +1038,20 @@ drhd_reghandler (void *data, phys_t gphys, bool wr, void *buf, uint len, u32 f)
 	return 0;
 }
 
+/* Handler for the IOTLB registers located by the IOTLB Register Offset
+ * field of the Extended Capability Register */
+static int
+drhd_iotlb_reghandler (void *data, phys_t gphys, bool wr, void *buf,
+		       uint len, u32 f)
+{
+	struct dmar_drhd_reg_data *d = data;
+	u64 off = gphys - d->base - d->iotlb_reg_off;
+
+	if (wr && off < DMAR_IOTLB_REG + 8 && off + len > DMAR_IOTLB_REG)
+		dmar_iotlb_flush (d);
+	return 0;
+}
+
 static struct drhd_devlist *
 dmar_pass_create_devlist_all (void)
 {
@@ -970,9 +1123,24 @@ drhd_mmio_register (void *data, void *entry)
 		vp.reg[*num].cache.slpt[i] = NULL;
 		vp.reg[*num].cache.slptptr[i] = ~0;
 	}
+	vp.reg[*num].iotlb_gen = 1;
+	vp.reg[*num].iotlb = alloc (sizeof *vp.reg[*num].iotlb *
+				    DMAR_IOTLB_SIZE);
+	memset (vp.reg[*num].iotlb, 0,
+		sizeof *vp.reg[*num].iotlb * DMAR_IOTLB_SIZE);
+	/* IOTLB Register Offset in 16-byte units */
+	vp.reg[*num].iotlb_reg_off =
+		(vp.reg[*num].reg->extended_capability_register >> 8 &
+		 0x3FF) * 16;
 	vp.reg[*num].mmio = mmio_register (q->register_base_address,
 					   sizeof *vp.reg[*num].reg,
 					   drhd_reghandler, &vp.reg[*num]);
+	vp.reg[*num].iotlb_mmio = NULL;
+	if (vp.reg[*num].iotlb_reg_off >= sizeof *vp.reg[*num].reg)
+		vp.reg[*num].iotlb_mmio =
+			mmio_register (q->register_base_address +
+				       vp.reg[*num].iotlb_reg_off, 16,
+				       drhd_iotlb_reghandler, &vp.reg[*num]);
 	vp.reg[*num].segment = q->segment_number;
 	vp.reg[*num].devlist = q->flags & 1 ? /* INCLUDE_PCI_ALL */
 		dmar_pass_create_devlist_all () :
@@ -695,6 +695,185 @@ set_gmtrr_fix (ulong msr_num, u64 value)
 	return false;
 }
 
+/* Types of fixed-range MTRRs and of MTRRs with a non-contiguous mask
+ * are looked up by get_mtrr_type() */
+#define GMTRR_MAP_SLOW		0xFF
+
+static void
+gmtrr_map_add (struct cache_gmtrr_map *m, u64 addr)
+{
+	unsigned int i;
+
+	for (i = m->n; i > 0 && m->start[i - 1] > addr; i--)
+		m->start[i] = m->start[i - 1];
+	if (i > 0 && m->start[i - 1] == addr) {
+		for (; i < m->n; i++)
+			m->start[i] = m->start[i + 1];
+		return;
+	}
+	m->start[i] = addr;
+	m->n++;
+}
+
+/* PHYSMASK bits at and above MAXPHYADDR */
+static u64 gmtrr_physmask_upper;
+
+/* Return the size of the range matched by a variable MTRR mask, or 0
+ * if the mask is not contiguous.  Masks have only the bits below
+ * MAXPHYADDR set, so the bits in upper are regarded as set. */
+static u64
+gmtrr_mask_size (u64 mask, u64 upper)
+{
+	u64 low;
+
+	mask = (mask | upper) & MSR_IA32_MTRR_PHYSMASK0_PHYSMASK_MASK;
+	low = mask & -mask;
+	if ((mask | (low - 1)) != (MSR_IA32_MTRR_PHYSMASK0_PHYSMASK_MASK |
+				   PAGESIZE_MASK))
+		return 0;
+	return low;
+}
+
+static void
+gmtrr_mask_size_check (void)
+{
+	/* 1GiB at 39-bit and 46-bit MAXPHYADDR */
+	ASSERT (gmtrr_mask_size (0x7FC0000800ULL, ~0ULL << 39) ==
+		0x40000000);
+	ASSERT (gmtrr_mask_size (0x3FFFC0000800ULL, ~0ULL << 46) ==
+		0x40000000);
+	/* 256MiB at 36-bit MAXPHYADDR */
+	ASSERT (gmtrr_mask_size (0xFF0000800ULL, ~0ULL << 36) ==
+		0x10000000);
+	/* Non-contiguous */
+	ASSERT (!gmtrr_mask_size (0x7FBFF00800ULL, ~0ULL << 39));
+	ASSERT (!gmtrr_mask_size (0x3FC0000800ULL, ~0ULL << 39));
+}
+
+static void
+gmtrr_init_physmask_upper (void)
+{
+	u32 a, b, c, d;
+	unsigned int nbits = 36;
+
+	asm_cpuid (CPUID_EXT_0, 0, &a, &b, &c, &d);
+	if (a >= CPUID_EXT_8) {
+		asm_cpuid (CPUID_EXT_8, 0, &a, &b, &c, &d);
+		nbits = a & CPUID_EXT_8_EAX_PHYSADDRSIZE_MASK;
+		if (nbits < 32)
+			nbits = 32;
+		if (nbits > 52)
+			nbits = 52;
+	}
+	gmtrr_physmask_upper = ~0ULL << nbits;
+	gmtrr_mask_size_check ();
+}
+
+/* Compile the guest MTRRs into intervals of the same memory type.
+ * Called whenever one of the registers is changed. */
+static void
+gmtrr_map_update (void)
+{
+	struct cache_regs *c = &current->cache.g;
+	struct cache_gmtrr_map *m = &current->cache.map;
+	unsigned int i, j;
+	u64 mask, base, size, top_mem2;
+	u8 type;
+
+	m->valid = false;
+	m->n = 0;
+	gmtrr_map_add (m, 0);
+	if (!(c->mtrr_def_type & MSR_IA32_MTRR_DEF_TYPE_E_BIT)) {
+		/* mtrr_type_equal() returns false while disabled */
+		m->type[0] = GMTRR_MAP_SLOW;
+		m->valid = true;
+		return;
+	}
+	if (c->mtrr_def_type & MSR_IA32_MTRR_DEF_TYPE_FE_BIT)
+		gmtrr_map_add (m, 0x100000);
+	for (i = 0; i < GMTRR_VCNT; i++) {
+		mask = c->mtrr_physmask[i];
+		if (!(mask & MSR_IA32_MTRR_PHYSMASK0_V_BIT))
+			continue;
+		mask &= MSR_IA32_MTRR_PHYSMASK0_PHYSMASK_MASK;
+		base = c->mtrr_physbase[i] & mask;
+		if (!mask)
+			continue; /* Matches everything */
+		size = gmtrr_mask_size (mask, gmtrr_physmask_upper);
+		if (!size)
+			return;	/* Non-contiguous mask */
+		gmtrr_map_add (m, base);
+		gmtrr_map_add (m, base + size);
+	}
+	if (c->syscfg & MSR_AMD_SYSCFG_TOM2FORCEMEMTYPEWB_BIT) {
+		top_mem2 = c->top_mem2 & MSR_AMD_TOP_MEM2_ADDR_MASK;
+		if (top_mem2 > 0x100000000ULL) {
+			gmtrr_map_add (m, 0x100000000ULL);
+			gmtrr_map_add (m, top_mem2);
+		}
+	}
+	/* Every interval has a single type now.  Merge adjacent
+	 * intervals of the same type. */
+	for (i = 0, j = 0; i < m->n; i++) {
+		if ((c->mtrr_def_type & MSR_IA32_MTRR_DEF_TYPE_FE_BIT) &&
+		    m->start[i] <= 0xFFFFF)
+			type = GMTRR_MAP_SLOW;
+		else
+			type = get_mtrr_type (m->start[i], c, false);
+		if (j > 0 && m->type[j - 1] == type)
+			continue;
+		m->start[j] = m->start[i];
+		m->type[j++] = type;
+	}
+	m->n = j;
+	m->valid = true;
+}
+
+static unsigned int
+gmtrr_map_search (struct cache_gmtrr_map *m, u64 gphys)
+{
+	unsigned int lo, hi, mid;
+
+	lo = 0;
+	hi = m->n;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (m->start[mid] <= gphys)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static u8
+gmtrr_map_type (u64 gphys, bool pass_mtrrfix)
+{
+	struct cache_gmtrr_map *m = &current->cache.map;
+	u8 type;
+
+	if (m->valid) {
+		type = m->type[gmtrr_map_search (m, gphys)];
+		if (type != GMTRR_MAP_SLOW)
+			return type;
+	}
+	return get_mtrr_type (gphys, &current->cache.g, pass_mtrrfix);
+}
+
+static bool
+gmtrr_map_type_equal (u64 gphys, u64 mask)
+{
+	struct cache_gmtrr_map *m = &current->cache.map;
+	unsigned int i;
+
+	if (!m->valid)
+		return mtrr_type_equal (gphys, &current->cache.g, false, mask);
+	i = gmtrr_map_search (m, gphys);
+	if (m->type[i] == GMTRR_MAP_SLOW)
+		return false;
+	return i + 1 == m->n || m->start[i + 1] > (gphys | mask);
+}
+
 static u8
 get_type (u64 gphys, u32 gattr)
 {
@@ -752,8 +931,7 @@ get_type (u64 gphys, u32 gattr)
 	gpat_type = current->cache.g.pat_data[pat_index];
 	if (gpat_type == CACHE_TYPE_UC || gpat_type == CACHE_TYPE_WC)
 		return gpat_type; /* Fast path */
-	gmtrr_type = get_mtrr_type (gphys, &current->cache.g,
-				    current->cache.pass_mtrrfix);
+	gmtrr_type = gmtrr_map_type (gphys, current->cache.pass_mtrrfix);
 	ASSERT (gpat_type < 8 && gmtrr_type < 8);
 	return pat_mtrr_matrix[gpat_type][gmtrr_type];
 }
@@ -782,20 +960,20 @@ cache_get_attr (u64 gphys, u32 gattr)
 u8
 cache_get_gmtrr_type (u64 gphys)
 {
-	return get_mtrr_type (gphys, &current->cache.g, false);
+	return gmtrr_map_type (gphys, false);
 }
 
 bool
 cache_gmtrr_type_equal (u64 gphys, u64 mask)
 {
-	return mtrr_type_equal (gphys, &current->cache.g, false, mask);
+	return gmtrr_map_type_equal (gphys, mask);
 }
 
 u32
 cache_get_gmtrr_attr (u64 gphys)
 {
-	return attr_from_type (get_mtrr_type (gphys, &current->cache.g,
-					      current->cache.pass_mtrrfix));
+	return attr_from_type (gmtrr_map_type (gphys,
+					       current->cache.pass_mtrrfix));
 }
 
 u64
@@ -830,17 +1008,23 @@ cache_get_gmtrr (ulong msr_num, u64 *value)
 bool
 cache_set_gmtrr (ulong msr_num, u64 value)
 {
+	bool ret;
+
 	if (!currentcpu->cache.pat) /* MTRRs are emulated by PAT. */
 		return true;	/* Make a #GP if MTRRs are not supported */
 	if (msr_num == MSR_IA32_MTRR_DEF_TYPE)
-		return set_gmtrr_def_type (value);
-	if (msr_num >= MSR_IA32_MTRR_PHYSBASE0 &&
-	    msr_num < MSR_IA32_MTRR_FIX64K_00000)
-		return set_gmtrr_range (msr_num, value);
-	if (msr_num >= MSR_IA32_MTRR_FIX64K_00000 &&
-	    msr_num <= MSR_IA32_MTRR_FIX4K_F8000)
-		return set_gmtrr_fix (msr_num, value);
-	return true;
+		ret = set_gmtrr_def_type (value);
+	else if (msr_num >= MSR_IA32_MTRR_PHYSBASE0 &&
+		 msr_num < MSR_IA32_MTRR_FIX64K_00000)
+		ret = set_gmtrr_range (msr_num, value);
+	else if (msr_num >= MSR_IA32_MTRR_FIX64K_00000 &&
+		 msr_num <= MSR_IA32_MTRR_FIX4K_F8000)
+		ret = set_gmtrr_fix (msr_num, value);
+	else
+		ret = true;
+	if (!ret)
+		gmtrr_map_update ();
+	return ret;
 }
 
 static void
@@ -888,9 +1072,11 @@ cache_set_gmsr_amd (ulong msr_num, u64 value)
 			asm_wrmsr64 (MSR_AMD_SYSCFG,
 				     currentcpu->cache.h.syscfg);
 		}
+		gmtrr_map_update ();
 		return false;
 	case MSR_AMD_TOP_MEM2:
 		current->cache.g.top_mem2 = value;
+		gmtrr_map_update ();
 		return false;
 	}
 	return true;
@@ -899,12 +1085,15 @@ cache_set_gmsr_amd (ulong msr_num, u64 value)
 static void
 cache_init_vcpu (void)
 {
+	if (!gmtrr_physmask_upper)
+		gmtrr_init_physmask_upper ();
 	if (currentcpu->cache.pat) {
 		set_gpat (pat_default);
 		set_gmtrr_def_type (0);
 		current->cache.g.syscfg = 0;
 	}
 	current->cache.pass_mtrrfix = false;
+	gmtrr_map_update ();
 }
 
 static void
@@ -950,6 +1139,7 @@ cache_init_pass (void)
 	current->cache.g.syscfg = currentcpu->cache.h.syscfg;
 	if (current->cache.g.syscfg & MSR_AMD_SYSCFG_MTRRTOM2EN_BIT)
 		current->cache.g.top_mem2 = currentcpu->cache.h.top_mem2;
+	gmtrr_map_update ();
 }
 #endif				     /* CPU_MMU_SPT_DISABLE */
 
@@ -34,6 +34,7 @@
 
 #define MTRR_VCNT_MAX		10
 #define NUM_MTRR_FIX		11
+#define GMTRR_MAP_MAX		(MTRR_VCNT_MAX * 2 + 4)
 
 struct cache_regs {
 	u8 pat_data[8];
@@ -54,9 +55,20 @@ struct cache_pcpu_data {
 	struct cache_regs h;
 };
 
+/* Guest MTRR types compiled into sorted intervals.  Interval i
+ * covers start[i] to start[i + 1] - 1 and the last one covers the
+ * rest of the address space. */
+struct cache_gmtrr_map {
+	bool valid;
+	unsigned int n;
+	u64 start[GMTRR_MAP_MAX];
+	u8 type[GMTRR_MAP_MAX];
+};
+
 struct cache_data {
 	struct cache_regs g;
 	bool pass_mtrrfix;
+	struct cache_gmtrr_map map;
 };
 
 void update_mtrr_and_pat (void);
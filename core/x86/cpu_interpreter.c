@@ -27,8 +27,11 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <core/initfunc.h>
+#include <core/mm.h>
 #include <core/panic.h>
 #include <core/printf.h>	/* DEBUG */
+#include <core/string.h>
 #include "../comphappy.h"
 #include "asm.h"
 #include "constants.h"
@@ -269,6 +272,9 @@ struct op {
 	u64 imm;
 	enum reg modrm_brm, modrm_rreg;
 	enum sreg modrm_seg;
+	enum reg modrm_base, modrm_index; /* modrm_addr is */
+	u8 modrm_scale;		/* (index << scale) + base + disp */
+	u64 modrm_disp;
 	u64 modrm_addr;
 	enum cpumode mode;
 	enum addrtype addrtype;
@@ -281,6 +287,7 @@ struct op {
 	bool modrm_ripflag;
 	const u8 *fetched_bytes;
 	u8 fetched_bytes_len;
+	u8 bytes[15];		/* instruction bytes read so far */
 };
 
 struct modrm_info {
@@ -313,6 +320,34 @@ struct idata {
 	enum idata_function func : 16;
 };
 
+/* Decoded instructions are cached per vcpu.  Device drivers access
+ * MMIO with the same few instructions, so the decode is skipped if the
+ * instruction bytes at the same address are unchanged. */
+#define ICACHE_NUM	16
+
+enum icache_kind {
+	ICACHE_IDATA,
+	ICACHE_MOVZX_RM8_TO_R,
+	ICACHE_MOVZX_RM16_TO_R,
+	ICACHE_MOVSB,
+	ICACHE_MOVS,
+	ICACHE_STOSB,
+	ICACHE_STOS,
+};
+
+struct icache_entry {
+	bool valid;
+	ulong ip, cr3;
+	unsigned int mode;
+	enum icache_kind kind;
+	struct idata idat;
+	struct op op;
+};
+
+struct cpu_interpreter_cache {
+	struct icache_entry entry[ICACHE_NUM];
+};
+
 static struct modrm_info modrmmatrix16[3][8] = { /* [mod][rm] */
 	/* displen, reg1, reg2, defseg, sibflag, ripflag */
 	{
@@ -835,12 +870,12 @@ read_next_b (struct op *op, u8 *data)
 {
 	if (op->ip_off >= 15)
 		return VMMERR_INSTRUCTION_TOO_LONG;
-	if (op->ip_off < op->fetched_bytes_len) {
-		*data = op->fetched_bytes[op->ip_off++];
-		return VMMERR_SUCCESS;
-	}
-	return cpu_seg_read_b (SREG_CS, op->ip + op->ip_off++,
-			       data);
+	if (op->ip_off < op->fetched_bytes_len)
+		*data = op->fetched_bytes[op->ip_off];
+	else
+		RIE (cpu_seg_read_b (SREG_CS, op->ip + op->ip_off, data));
+	op->bytes[op->ip_off++] = *data;
+	return VMMERR_SUCCESS;
 }
 
 static ulong
@@ -970,6 +1005,13 @@ read_modrm_b (struct op *op)
 	return VMMERR_SUCCESS;
 }
 
+static void
+modrm_calc (struct op *op)
+{
+	op->modrm_addr = (get_reg (op, op->modrm_index) << op->modrm_scale) +
+		get_reg (op, op->modrm_base) + op->modrm_disp;
+}
+
 static enum vmmerr
 get_modrm (struct op *op)
 {
@@ -978,7 +1020,6 @@ get_modrm (struct op *op)
 	struct sibscale_info *ss;
 	int displen;
 	enum sreg defseg;
-	u64 addr;
 	i8 tmp1;
 	i16 tmp2;
 
@@ -999,10 +1040,13 @@ get_modrm (struct op *op)
 		ss = &sib_scale[op->prefix.rex.b.x][op->sib.index];
 		displen = sb->displen;
 		defseg = sb->defseg;
-		addr = (get_reg (op, ss->reg) << op->sib.scale)
-			+ get_reg (op, sb->reg);
+		op->modrm_base = sb->reg;
+		op->modrm_index = ss->reg;
+		op->modrm_scale = op->sib.scale;
 	} else {
-		addr = get_reg (op, m->reg1) + get_reg (op, m->reg2);
+		op->modrm_base = m->reg1;
+		op->modrm_index = m->reg2;
+		op->modrm_scale = 0;
 	}
 	switch (displen) {
 	case 1:
@@ -1019,8 +1063,8 @@ get_modrm (struct op *op)
 	default:
 		op->disp = 0;
 	}
-	addr += op->disp;
-	op->modrm_addr = addr;
+	op->modrm_disp = op->disp;
+	modrm_calc (op);
 	op->modrm_ripflag = (op->longmode && m->ripflag);
 	if (op->prefix.seg != SREG_DEFAULT)
 		op->modrm_seg = op->prefix.seg;
@@ -1041,6 +1085,10 @@ read_moffs (struct op *op)
 		READ_NEXT_L (op, &moffs);
 	else
 		READ_NEXT_Q (op, &moffs);
+	op->modrm_base = REG_NO;
+	op->modrm_index = REG_NO;
+	op->modrm_scale = 0;
+	op->modrm_disp = moffs;
 	op->modrm_addr = moffs;
 	op->modrm_ripflag = false;
 	if (op->prefix.seg != SREG_DEFAULT)
@@ -2524,6 +2572,107 @@ grp_special:
 	return VMMERR_SUCCESS;
 }
 
+static enum vmmerr
+icache_exec (struct op *op, enum icache_kind kind, struct idata *idat)
+{
+	switch (kind) {
+	case ICACHE_IDATA:
+		return opcode_idata (op, *idat);
+	case ICACHE_MOVZX_RM8_TO_R:
+		return opcode_movzx_rm8_to_r (op);
+	case ICACHE_MOVZX_RM16_TO_R:
+		return opcode_movzx_rm16_to_r (op);
+	case ICACHE_MOVSB:
+		return opcode_movsb (op);
+	case ICACHE_MOVS:
+		return opcode_movs (op);
+	case ICACHE_STOSB:
+		return opcode_stosb (op);
+	case ICACHE_STOS:
+		return opcode_stos (op);
+	}
+	return VMMERR_UNSUPPORTED_OPCODE;
+}
+
+/* Store the decoded instruction to the entry and execute it */
+static enum vmmerr
+icache_run (struct icache_entry *e, struct op *op, enum icache_kind kind,
+	    struct idata *idat)
+{
+	if (e) {
+		e->kind = kind;
+		if (idat)
+			e->idat = *idat;
+		e->op = *op;
+		e->valid = true;
+	}
+	return icache_exec (op, kind, idat);
+}
+
+static bool
+icache_match (struct op *op, struct icache_entry *e)
+{
+	uint len, off;
+	u8 buf[16];
+
+	len = e->op.ip_off;
+	if (op->fetched_bytes_len >= len)
+		return !memcmp (op->fetched_bytes, e->op.bytes, len);
+	for (off = 0; len - off >= 8; off += 8)
+		if (cpu_seg_read_q (SREG_CS, op->ip + off, (u64 *)&buf[off]))
+			return false;
+	if (len - off >= 4) {
+		if (cpu_seg_read_l (SREG_CS, op->ip + off, (u32 *)&buf[off]))
+			return false;
+		off += 4;
+	}
+	if (len - off >= 2) {
+		if (cpu_seg_read_w (SREG_CS, op->ip + off, (u16 *)&buf[off]))
+			return false;
+		off += 2;
+	}
+	if (len - off >= 1) {
+		if (cpu_seg_read_b (SREG_CS, op->ip + off, &buf[off]))
+			return false;
+	}
+	return !memcmp (buf, e->op.bytes, len);
+}
+
+/* Return the entry for the instruction at op->ip.  If the entry has
+ * the decoded instruction, restore it to op and set *hit. */
+static struct icache_entry *
+icache_lookup (struct op *op, unsigned int mode, bool *hit)
+{
+	struct cpu_interpreter_cache *c;
+	struct icache_entry *e;
+	ulong cr3;
+	const u8 *fetched_bytes;
+	u8 fetched_bytes_len;
+
+	*hit = false;
+	c = current->interp.cache;
+	if (!c)
+		return NULL;
+	current->vmctl.read_control_reg (CONTROL_REG_CR3, &cr3);
+	e = &c->entry[(op->ip ^ (op->ip >> 4)) % ICACHE_NUM];
+	if (e->valid && e->ip == op->ip && e->cr3 == cr3 &&
+	    e->mode == mode && icache_match (op, e)) {
+		fetched_bytes = op->fetched_bytes;
+		fetched_bytes_len = op->fetched_bytes_len;
+		*op = e->op;
+		op->fetched_bytes = fetched_bytes;
+		op->fetched_bytes_len = fetched_bytes_len;
+		modrm_calc (op);
+		*hit = true;
+		return e;
+	}
+	e->valid = false;
+	e->ip = op->ip;
+	e->cr3 = cr3;
+	e->mode = mode;
+	return e;
+}
+
 enum vmmerr
 cpu_interpreter (void)
 {
@@ -2533,10 +2682,13 @@ cpu_interpreter (void)
 	struct idata idat;
 	ulong cr0;
 	u64 efer;
+	struct icache_entry *e;
+	bool hit;
 
 	op = &op1;
 	current->vmctl.read_control_reg (CONTROL_REG_CR0, &cr0);
 	current->vmctl.read_msr (MSR_IA32_EFER, &efer);
+	current->vmctl.read_sreg_acr (SREG_CS, &acr);
 	if (cr0 & CR0_PE_BIT)
 		op->mode = CPUMODE_PROTECTED;
 	else
@@ -2547,6 +2699,16 @@ cpu_interpreter (void)
 	op->fetched_bytes = NULL;
 	op->fetched_bytes_len = current->
 		vmctl.get_instruction_bytes_buffer (&op->fetched_bytes);
+	e = icache_lookup (op, (op->mode == CPUMODE_PROTECTED ? 1 : 0) |
+			   ((efer & MSR_IA32_EFER_LMA_BIT) ? 2 : 0) |
+			   ((acr & ACCESS_RIGHTS_L_BIT) ? 4 : 0) |
+			   ((acr & ACCESS_RIGHTS_D_B_BIT) ? 8 : 0), &hit);
+	if (hit)
+		return icache_exec (op, e->kind, &e->idat);
+	op->modrm_base = REG_NO;
+	op->modrm_index = REG_NO;
+	op->modrm_scale = 0;
+	op->modrm_disp = 0;
 	READ_NEXT_B (op, &code);
 	clear_prefix (&op->prefix);
 	for (;;) {
@@ -2591,7 +2753,6 @@ cpu_interpreter (void)
 		READ_NEXT_B (op, &code);
 	}
 parse_opcode:
-	current->vmctl.read_sreg_acr (SREG_CS, &acr);
 	if ((efer & MSR_IA32_EFER_LMA_BIT) && (acr & ACCESS_RIGHTS_L_BIT)) {
 		op->longmode = true;
 		if (code >= PREFIX_REX_MIN && code <= PREFIX_REX_MAX) {
@@ -2702,13 +2863,13 @@ parse_opcode:
 	case OPCODE_RETF:
 		return opcode_retf (op);
 	case OPCODE_MOVSB:
-		return opcode_movsb (op);
+		return icache_run (e, op, ICACHE_MOVSB, NULL);
 	case OPCODE_MOVS:
-		return opcode_movs (op);
+		return icache_run (e, op, ICACHE_MOVS, NULL);
 	case OPCODE_STOSB:
-		return opcode_stosb (op);
+		return icache_run (e, op, ICACHE_STOSB, NULL);
 	case OPCODE_STOS:
-		return opcode_stos (op);
+		return icache_run (e, op, ICACHE_STOS, NULL);
 	}
 	idat = idata[code];
 grp_special:
@@ -2716,7 +2877,7 @@ grp_special:
 	case I_MODRM:
 		READ_MODRM_B (op);
 		GET_MODRM (op);
-		return opcode_idata (op, idat);
+		return icache_run (e, op, ICACHE_IDATA, &idat);
 	case I_MIMM1:
 		READ_MODRM_B (op);
 		GET_MODRM (op);
@@ -2727,7 +2888,7 @@ grp_special:
 		READ_NEXT_B (op, &op->imm);
 		if (idat.len == 2 && (op->imm & 0x80))
 			op->imm |= 0xFFFFFFFFFFFFFF00ULL;
-		return opcode_idata (op, idat);
+		return icache_run (e, op, ICACHE_IDATA, &idat);
 	case I_MIMM2:
 		READ_MODRM_B (op);
 		GET_MODRM (op);
@@ -2741,10 +2902,10 @@ grp_special:
 			READ_NEXT_L (op, &op->imm);
 		if (op->optype == OPTYPE_64BIT && (op->imm & 0x80000000))
 			op->imm |= 0xFFFFFFFF00000000ULL;
-		return opcode_idata (op, idat);
+		return icache_run (e, op, ICACHE_IDATA, &idat);
 	case I_MOFFS:
 		RIE (read_moffs (op));
-		return opcode_idata (op, idat);
+		return icache_run (e, op, ICACHE_IDATA, &idat);
 	case I_MGRP3:
 		READ_MODRM_B (op);
 		GET_MODRM (op);
@@ -2760,7 +2921,7 @@ grp_special:
 			goto grp_imme2;
 		break;
 	case I_NOMOR:
-		return opcode_idata (op, idat);
+		return icache_run (e, op, ICACHE_IDATA, &idat);
 	case I_ZERO:
 	default:
 		break;
@@ -2800,11 +2961,11 @@ parse_opcode_0x0f:
 	case OPCODE_0x0F_MOVZX_RM8_TO_R:
 		READ_MODRM_B (op);
 		GET_MODRM (op);
-		return opcode_movzx_rm8_to_r (op);
+		return icache_run (e, op, ICACHE_MOVZX_RM8_TO_R, NULL);
 	case OPCODE_0x0F_MOVZX_RM16_TO_R:
 		READ_MODRM_B (op);
 		GET_MODRM (op);
-		return opcode_movzx_rm16_to_r (op);
+		return icache_run (e, op, ICACHE_MOVZX_RM16_TO_R, NULL);
 	}
 	if (op->longmode)
 		panic ("64bit instructions begin with 0x0F not supported");
@@ -2869,3 +3030,15 @@ parse_opcode_0x8f:
 	op->ip_off += 16;
 	return VMMERR_UNSUPPORTED_OPCODE;
 }
+
+static void
+cpu_interpreter_init_vcpu (void)
+{
+	struct cpu_interpreter_cache *c;
+
+	c = alloc (sizeof *c);
+	memset (c, 0, sizeof *c);
+	current->interp.cache = c;
+}
+
+INITFUNC ("vcpu0", cpu_interpreter_init_vcpu);
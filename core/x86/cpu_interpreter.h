@@ -43,6 +43,10 @@ enum optype {
 	OPTYPE_64BIT,
 };
 
+struct cpu_interpreter_data {
+	struct cpu_interpreter_cache *cache;
+};
+
 enum vmmerr cpu_interpreter (void);
 
 #endif
@@ -558,6 +558,14 @@ mm_as_msi_to_icr (const struct mm_as *as, u32 maddr, u32 mupper, u16 mdata)
 	return msi_to_icr (maddr, mupper, mdata);
 }
 
+u32
+mm_as_generation (const struct mm_as *as)
+{
+	if (as->generation)
+		return as->generation (as->data);
+	return 0;
+}
+
 /**********************************************************************/
 /*** accessing memory ***/
 
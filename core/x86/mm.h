@@ -36,10 +36,6 @@
 #define MAPMEM_PCD			MAPMEM_PLAT (4)
 #define MAPMEM_PAT			MAPMEM_PLAT (7)
 
-struct mm_as;
-
 void mm_flush_wb_cache (void);
-u64 mm_as_translate (const struct mm_as *handle, unsigned int *npages,
-		     u64 address);
 
 #endif
@@ -29,6 +29,7 @@
 
 #include <constants.h>
 #include <core/assert.h>
+#include <core/bplus_tree.h>
 #include <core/initfunc.h>
 #include <core/mm.h>
 #include <core/mmio.h>
@@ -81,6 +82,78 @@ rangecheck (struct mmio_handle *h, phys_t gphys, uint len, phys_t *gphys2,
 	return 1;
 }
 
+static bool
+mmio_covers (struct mmio_handle *h, phys_t gphys)
+{
+	return h->gphys <= gphys && gphys - h->gphys < h->len;
+}
+
+/* Return the first registered handle overlapping gphys-end range.
+ * Handles in the tree never overlap each other, so a handle covering
+ * gphys is the first one.  The last handle found is remembered per
+ * vcpu because accesses to the same region usually come in a row. */
+static struct mmio_handle *
+mmio_find (phys_t gphys, phys_t end)
+{
+	struct mmio_data *m = &current->vcpu0->mmio;
+	struct mmio_handle *h, *lh, *rh;
+	u64 lkey, rkey;
+
+	h = current->mmio.last;
+	if (h && current->mmio.last_gen == m->gen && !h->unregistered &&
+	    mmio_covers (h, gphys))
+		return h;
+	if (bplus_tree_search_get_neighbors (m->tree, gphys, (void **)&h,
+					     &lkey, (void **)&lh, &rkey,
+					     (void **)&rh))
+		lh = h;
+	else if (lkey == BPLUS_NODE_INVALID_KEY)
+		lh = NULL;
+	if (lh && !lh->unregistered && mmio_covers (lh, gphys)) {
+		h = lh;
+		goto found;
+	}
+	while (rkey != BPLUS_NODE_INVALID_KEY && rkey <= end) {
+		if (!rh->unregistered) {
+			h = rh;
+			goto found;
+		}
+		bplus_tree_search_get_neighbors (m->tree, rkey, NULL, NULL,
+						 NULL, &rkey, (void **)&rh);
+	}
+	return NULL;
+found:
+	current->mmio.last = h;
+	current->mmio.last_gen = m->gen;
+	return h;
+}
+
+static void
+mmio_tree_add (struct mmio_handle *p)
+{
+	struct mmio_data *m = &current->vcpu0->mmio;
+	enum bplus_err err;
+
+	err = bplus_tree_add (m->tree, p->gphys, p);
+	if (err != BPLUS_ERR_OK)
+		panic ("%s: bplus_tree_add 0x%llX failed %u", __func__,
+		       p->gphys, err);
+	m->gen++;
+}
+
+static void
+mmio_tree_del (struct mmio_handle *p)
+{
+	struct mmio_data *m = &current->vcpu0->mmio;
+	void *val;
+
+	/* The handle may have been removed from the tree already if
+	 * the range was registered again after unregistration */
+	if (bplus_tree_search (m->tree, p->gphys, &val) && val == p)
+		bplus_tree_del (m->tree, p->gphys, NULL);
+	m->gen++;
+}
+
 static void
 mmio_gphys_access (phys_t gphysaddr, bool wr, void *buf, uint len, u32 flags)
 {
@@ -101,9 +174,8 @@ mmio_gphys_access (phys_t gphysaddr, bool wr, void *buf, uint len, u32 flags)
 static int
 do_mmio_access_memory (phys_t gphysaddr, bool wr, void *buf, uint len, u32 f)
 {
-	struct mmio_list *p;
 	struct mmio_handle *h;
-	int i, j, r;
+	int r;
 	phys_t gphys2;
 	uint len2, tmp;
 	u8 *q;
@@ -119,57 +191,36 @@ do_mmio_access_memory (phys_t gphysaddr, bool wr, void *buf, uint len, u32 f)
 	} unlocked_handler = unlocked_handler; /* Make gcc happy */
 
 	unlocked_handler.found = false;
-	if (gphysaddr <= 0xFFFFFFFFULL)
-		i = gphysaddr >> 28;
-	else
-		i = 16;
-	if (gphysaddr + len - 1 <= 0xFFFFFFFFULL)
-		j = (gphysaddr + len - 1) >> 28;
-	else
-		j = 16;
 	q = buf;
 	r = 0;
-	if (!len)
-		goto out;
-	for (; i <= j; i++) {
-		LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-			h = p->handle;
-			if (h->gphys >= gphysaddr + len)
-				goto out;
-			if (rangecheck (h, gphysaddr, len, &gphys2, &len2)) {
-				r = 1;
-				tmp = gphys2 - gphysaddr;
-				mmio_gphys_access (gphysaddr, wr, q, tmp, f);
-				gphysaddr += tmp;
-				q += tmp;
-				len -= tmp;
-				if (h->unlocked_handler) {
-					if (unlocked_handler.found)
-						panic ("mmio_access_memory:"
-						       " two unlocked handlers"
-						       " in one access");
-					unlocked_handler.handler = h->handler;
-					unlocked_handler.data = h->data;
-					unlocked_handler.gphys = gphysaddr;
-					unlocked_handler.wr = wr;
-					unlocked_handler.buf = q;
-					unlocked_handler.len = len2;
-					unlocked_handler.flags = f;
-					unlocked_handler.found = true;
-				} else if (!h->handler (h->data, gphysaddr, wr,
-							q, len2, f)) {
-					mmio_gphys_access (gphysaddr, wr, q,
-							   len2, f);
-				}
-				gphysaddr += len2;
-				q += len2;
-				len -= len2;
-				if (!len)
-					goto out;
-			}
+	while (len && (h = mmio_find (gphysaddr, gphysaddr + len - 1)) &&
+	       rangecheck (h, gphysaddr, len, &gphys2, &len2)) {
+		r = 1;
+		tmp = gphys2 - gphysaddr;
+		mmio_gphys_access (gphysaddr, wr, q, tmp, f);
+		gphysaddr += tmp;
+		q += tmp;
+		len -= tmp;
+		if (h->unlocked_handler) {
+			if (unlocked_handler.found)
+				panic ("mmio_access_memory:"
+				       " two unlocked handlers"
+				       " in one access");
+			unlocked_handler.handler = h->handler;
+			unlocked_handler.data = h->data;
+			unlocked_handler.gphys = gphysaddr;
+			unlocked_handler.wr = wr;
+			unlocked_handler.buf = q;
+			unlocked_handler.len = len2;
+			unlocked_handler.flags = f;
+			unlocked_handler.found = true;
+		} else if (!h->handler (h->data, gphysaddr, wr, q, len2, f)) {
+			mmio_gphys_access (gphysaddr, wr, q, len2, f);
 		}
+		gphysaddr += len2;
+		q += len2;
+		len -= len2;
 	}
-out:
 	if (r)
 		mmio_gphys_access (gphysaddr, wr, q, len, f);
 	if (unlocked_handler.found) {
@@ -211,85 +262,16 @@ int
 mmio_access_page (phys_t gphysaddr, bool emulation)
 {
 	enum vmmerr e;
-	struct mmio_list *p;
-	struct mmio_handle *h;
-	int i;
 
 	gphysaddr &= ~PAGESIZE_MASK;
-	if (gphysaddr <= 0xFFFFFFFFULL)
-		i = gphysaddr >> 28;
-	else
-		i = 16;
-	LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-		h = p->handle;
-		if (h->gphys >= gphysaddr + PAGESIZE)
-			break;
-		if (rangecheck (h, gphysaddr, PAGESIZE, NULL, NULL)) {
-			if (!emulation)
-				return 1;
-			e = cpu_interpreter ();
-			if (e == VMMERR_SUCCESS)
-				return 1;
-			panic ("Fatal error: MMIO access error %d", e);
-		}
-	}
-	return 0;
-}
-
-static void
-add (int i, void *handle)
-{
-	struct mmio_list *p, *d;
-	struct mmio_handle *h;
-	phys_t gphys;
-
-	h = handle;
-	gphys = h->gphys;
-	LIST1_FOREACH (current->vcpu0->mmio.mmio[i], d) {
-		h = d->handle;
-		if (h->gphys > gphys)
-			break;
-	}
-	p = alloc (sizeof *p);
-	ASSERT (p);
-	p->handle = handle;
-	LIST1_INSERT (current->vcpu0->mmio.mmio[i], d, p);
-}
-
-static void
-del (int i, void *handle)
-{
-	struct mmio_list *p;
-
-	LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-		if (p->handle == handle)
-			goto found;
-	}
-	return;
-found:
-	LIST1_DEL (current->vcpu0->mmio.mmio[i], p);
-	free (p);
-}
-
-static void
-scan (phys_t gphys, uint len, void (*func) (int i, void *data), void *data)
-{
-	int i, s, e;
-	phys_t end;
-
-	end = gphys + len - 1;
-	end |= 0x0FFFFFFFULL;
-	gphys &= ~0x0FFFFFFFULL;
-	if (gphys <= 0xFFFFFFFFULL)
-		s = gphys >> 28;
-	else
-		s = 16;
-	if (end <= 0xFFFFFFFFULL)
-		e = end >> 28;
-	else
-		e = 16;
-	for (i = s; i <= e; i++)
-		func (i, data);
+	if (!mmio_find (gphysaddr, gphysaddr | PAGESIZE_MASK))
+		return 0;
+	if (!emulation)
+		return 1;
+	e = cpu_interpreter ();
+	if (e == VMMERR_SUCCESS)
+		return 1;
+	panic ("Fatal error: MMIO access error %d", e);
 }
 
 static void *
@@ -303,6 +285,12 @@ mmio_register_internal (phys_t gphys, uint len, mmio_handler_t handler,
 		if (rangecheck (p, gphys, len, NULL, NULL))
 			goto fail;
 	}
+	/* Handles unregistered but not freed yet may overlap */
+	LIST1_FOREACH (current->vcpu0->mmio.handle, p) {
+		if (p->unregistered && p->gphys <= gphys + len - 1 &&
+		    gphys <= p->gphys + p->len - 1)
+			mmio_tree_del (p);
+	}
 	if (mmioclr_clear_gmap (gphys, gphys + len - 1)) {
 		printf ("%s: mmioclr_clear_gmap(0x%llX, 0x%llX) failed\n"
 			, __func__, gphys, gphys + len - 1);
@@ -317,7 +305,7 @@ mmio_register_internal (phys_t gphys, uint len, mmio_handler_t handler,
 	p->unregistered = false;
 	p->unlocked_handler = unlocked_handler;
 	LIST1_ADD (current->vcpu0->mmio.handle, p);
-	scan (gphys, len, add, p);
+	mmio_tree_add (p);
 ret:
 	rw_spinlock_unlock_ex (&current->vcpu0->mmio.rwlock);
 	return p;
@@ -351,7 +339,7 @@ mmio_unregister (void *handle)
 		return;
 	}
 	LIST1_DEL (current->vcpu0->mmio.handle, p);
-	scan (p->gphys, p->len, del, p);
+	mmio_tree_del (p);
 	free (p);
 	rw_spinlock_unlock_ex (&current->vcpu0->mmio.rwlock);
 }
@@ -376,7 +364,7 @@ mmio_unlock (void)
 		LIST1_FOREACH (current->vcpu0->mmio.handle, p) {
 			if (p->unregistered) {
 				LIST1_DEL (current->vcpu0->mmio.handle, p);
-				scan (p->gphys, p->len, del, p);
+				mmio_tree_del (p);
 				free (p);
 			}
 		}
@@ -389,30 +377,14 @@ mmio_unlock (void)
 phys_t
 mmio_range (phys_t gphysaddr, uint len)
 {
-	struct mmio_list *p;
 	struct mmio_handle *h;
-	int i, j;
 
 	if (!len)
 		return 0;
-	if (gphysaddr <= 0xFFFFFFFFULL)
-		i = gphysaddr >> 28;
-	else
-		i = 16;
-	if (gphysaddr + len - 1 <= 0xFFFFFFFFULL)
-		j = (gphysaddr + len - 1) >> 28;
-	else
-		j = 16;
-	for (; i <= j; i++) {
-		LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-			h = p->handle;
-			if (h->gphys >= gphysaddr + len)
-				return 0;
-			if (rangecheck (h, gphysaddr, len, NULL, NULL))
-				return h->gphys + h->len;
-		}
-	}
-	return 0;
+	h = mmio_find (gphysaddr, gphysaddr + len - 1);
+	if (!h)
+		return 0;
+	return h->gphys + h->len;
 }
 
 /* "pagesizes" must be sorted in ascending order.
@@ -421,55 +393,22 @@ mmio_range (phys_t gphysaddr, uint len)
 int
 mmio_range_each_page_size (phys_t gphys, const u64 *pagesizes, int array_len)
 {
-	struct mmio_list *p;
-	struct mmio_handle *h;
-	int i, j;
-	phys_t gphys_aligned, gphys_aligned_end;
+	phys_t gphys_aligned;
+	int k;
 
+	/* The regions are nested.  Most regions do not overlap with
+	 * any MMIO, so check the largest one first. */
 	gphys_aligned = gphys & ~(pagesizes[array_len - 1] - 1);
-	gphys_aligned_end = gphys_aligned + pagesizes[array_len - 1];
-	if (gphys_aligned <= 0xFFFFFFFFULL)
-		i = gphys_aligned >> 28;
-	else
-		i = 16;
-	if (gphys_aligned_end - 1 <= 0xFFFFFFFFULL)
-		j = (gphys_aligned_end - 1) >> 28;
-	else
-		j = 16;
-	for (; i <= j; i++) {
-	mmio_search_again:
-		LIST1_FOREACH (current->vcpu0->mmio.mmio[i], p) {
-			h = p->handle;
-			if (h->gphys >= gphys_aligned_end)
-				return array_len;
-			for (int k = 0; k < array_len; k++) {
-				gphys_aligned = gphys & ~(pagesizes[k] - 1);
-				if (!rangecheck (h, gphys_aligned,
-						 pagesizes[k], NULL, NULL))
-					continue;
-				array_len = k;
-				if (!k)
-					return array_len;
-				gphys_aligned = gphys &
-					~(pagesizes[k - 1] - 1);
-				gphys_aligned_end = gphys_aligned +
-					pagesizes[k - 1];
-				int new_i = gphys_aligned <= 0xFFFFFFFFULL ?
-					gphys_aligned >> 28 : 16;
-				j = gphys_aligned_end - 1 <= 0xFFFFFFFFULL ?
-					(gphys_aligned_end - 1) >> 28 : 16;
-				if (i < new_i) {
-					i = new_i;
-					goto mmio_search_again;
-				}
-				if (j < i)
-					return array_len;
-				else
-					break;
-			}
-		}
+	if (!mmio_find (gphys_aligned,
+			gphys_aligned + pagesizes[array_len - 1] - 1))
+		return array_len;
+	for (k = 0; k < array_len - 1; k++) {
+		gphys_aligned = gphys & ~(pagesizes[k] - 1);
+		if (mmio_find (gphys_aligned,
+			       gphys_aligned + pagesizes[k] - 1))
+			break;
 	}
-	return array_len;
+	return k;
 }
 
 static int
@@ -519,14 +458,14 @@ mmio_debug (void)
 static void
 mmio_init (void)
 {
-	int i;
-
 	rw_spinlock_init (&current->mmio.rwlock);
+	current->mmio.tree = bplus_tree_4kv_alloc ();
 	LIST1_HEAD_INIT (current->mmio.handle);
-	for (i = 0; i < 17; i++)
-		LIST1_HEAD_INIT (current->mmio.mmio[i]);
 	current->mmio.unregister_flag = false;
 	current->mmio.lock_count = 0;
+	current->mmio.gen = 0;
+	current->mmio.last = NULL;
+	current->mmio.last_gen = 0;
 }
 
 INITFUNC ("vcpu0", mmio_init);
@@ -44,17 +44,15 @@ struct mmio_handle {
 	bool unlocked_handler;
 };
 
-struct mmio_list {
-	LIST1_DEFINE (struct mmio_list);
-	void *handle;
-};
-
 struct mmio_data {
-	LIST1_DEFINE_HEAD (struct mmio_list, mmio[17]);
+	struct bplus_tree *tree;	/* handles keyed by gphys */
 	LIST1_DEFINE_HEAD (struct mmio_handle, handle);
 	rw_spinlock_t rwlock;
 	bool unregister_flag;
 	unsigned int lock_count;
+	u32 gen;			/* incremented when tree changes */
+	struct mmio_handle *last;	/* last handle found by this vcpu */
+	u32 last_gen;
 };
 
 int mmio_access_memory (phys_t gphysaddr, bool wr, void *buf, uint len,
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2026 Igel Co., Ltd.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. Neither the name of the University of Tsukuba nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The VMM runs with CR0.TS=1 and CR4.OSFXSR=0 so that an accidental
+ * use of the FPU or SSE is caught.  sse_begin() allows SSE instructions
+ * on the current processor until sse_end() restores the control
+ * registers.  The XMM registers still hold the guest state, so callers
+ * save the registers they use after sse_begin() and restore them
+ * before sse_end().  The code between them must not call schedule().
+ */
+
+#include <core/x86/sse.h>
+#include "asm.h"
+#include "constants.h"
+
+void
+sse_begin (struct sse_state *s)
+{
+	asm_rdcr0 (&s->cr0);
+	asm_rdcr4 (&s->cr4);
+	if (!(s->cr4 & CR4_OSFXSR_BIT))
+		asm_wrcr4 (s->cr4 | CR4_OSFXSR_BIT);
+	if (s->cr0 & (CR0_EM_BIT | CR0_TS_BIT))
+		asm_wrcr0 (s->cr0 & ~(CR0_EM_BIT | CR0_TS_BIT));
+}
+
+void
+sse_end (struct sse_state *s)
+{
+	if (s->cr0 & (CR0_EM_BIT | CR0_TS_BIT))
+		asm_wrcr0 (s->cr0);
+	if (!(s->cr4 & CR4_OSFXSR_BIT))
+		asm_wrcr4 (s->cr4);
+}
@@ -28,12 +28,14 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <core/config.h>
 #include <core/mm.h>
 #include <core/panic.h>
 #include <core/printf.h>
 #include <core/string.h>
 #include "../phys.h"
 #include "cache.h"
+#include "callrealmode.h"
 #include "constants.h"
 #include "current.h"
 #include "mmio.h"
@@ -46,12 +48,14 @@
 
 #define MAXNUM_OF_NPTBL 256
 #define DEFNUM_OF_NPTBL 16
+#define NP_FAULT_AROUND 16 /* entries, must be a power of 2 */
 
 static const u64 pagesizes[3] = { PAGESIZE, PAGESIZE2M, PAGESIZE1G };
 
 struct svm_np {
 	int cnt;
 	int avl_pagesizes_len;
+	bool premap;		/* map RAM at the first page fault */
 	void *ncr3tbl;
 	phys_t ncr3tbl_phys;
 	void *tbl[MAXNUM_OF_NPTBL];
@@ -88,6 +92,7 @@ svm_np_init (void)
 	np->cnt = 0;
 	np->cur.level = PMAP_LEVELS;
 	np->avl_pagesizes_len = vmm_mem_page1gb_available () ? 3 : 2;
+	np->premap = !!config.vmm.paging_premap_ram;
 	current->u.svm.np = np;
 	current->u.svm.vi.vmcb->n_cr3 = np->ncr3tbl_phys;
 	mmioclr_register (current, svm_np_mmioclr_callback);
@@ -246,15 +251,105 @@ svm_np_map_1gpage (struct svm_np *np, u64 gphys)
 	return false;
 }
 
+/* Map a 2MiB or 1GiB page at gphys unless it overlaps MMIO or its
+ * MTRR type is not uniform.  Returns 1 if mapped, 0 if not, or -1 if
+ * tables run out.  Note: mmio_lock() must be held. */
+static int
+svm_np_premap_large (struct svm_np *np, u64 gphys, int level)
+{
+	cur_move (np, gphys);
+	if (np->cur.level < level)
+		return 0;
+	if (np->cur.level == level && (*np->cur.entry[level] & PDE_P_BIT))
+		return 1;
+	if (mmio_range_each_page_size (gphys, pagesizes, level + 1) <= level)
+		return 0;
+	if (np->cnt + np->cur.level - level > MAXNUM_OF_NPTBL)
+		return -1;
+	if (level == 2)
+		return svm_np_map_1gpage (np, gphys) ? 0 : 1;
+	return svm_np_map_2mpage (np, gphys) ? 0 : 1;
+}
+
+/* Map all the available RAM with large pages.  Stops before tables
+ * run out since that clears everything. */
+static void
+svm_np_premap (struct svm_np *np)
+{
+	phys_t base = 0, start, gphys, end;
+	u64 len;
+	u32 type;
+	int r;
+
+	mmio_lock ();
+	while (vmm_mem_continuous_sysmem_type_region (base, &start, &len,
+						      &type)) {
+		base = start + len;
+		if (type != SYSMEMMAP_TYPE_AVAILABLE)
+			continue;
+		gphys = (start + PAGESIZE2M_MASK) & ~PAGESIZE2M_MASK;
+		end = (start + len) & ~PAGESIZE2M_MASK;
+		while (gphys < end) {
+			r = 0;
+			if (!(gphys & PAGESIZE1G_MASK) &&
+			    end - gphys >= PAGESIZE1G)
+				r = svm_np_premap_large (np, gphys, 2);
+			if (r > 0) {
+				gphys += PAGESIZE1G;
+				continue;
+			}
+			if (r < 0 || svm_np_premap_large (np, gphys, 1) < 0)
+				goto out;
+			gphys += PAGESIZE2M;
+		}
+	}
+out:
+	mmio_unlock ();
+}
+
+/* Map absent neighbours of gphys in the same table with the same page
+ * size.  Note: mmio_lock() must be held. */
+static void
+svm_np_fault_around (struct svm_np *np, u64 gphys, int level)
+{
+	u64 size = pagesizes[level];
+	u64 n = gphys & ~(size * NP_FAULT_AROUND - 1);
+	u64 end = n + size * NP_FAULT_AROUND;
+
+	gphys &= ~(size - 1);
+	for (; n < end; n += size) {
+		if (n == gphys)
+			continue;
+		cur_move (np, n);
+		if (np->cur.level != level ||
+		    (*np->cur.entry[level] & PDE_P_BIT))
+			continue;
+		if (mmio_range_each_page_size (n, pagesizes, level + 1) <=
+		    level)
+			continue;
+		if (level == 2)
+			svm_np_map_1gpage (np, n);
+		else if (level == 1)
+			svm_np_map_2mpage (np, n);
+		else
+			svm_np_map_page (np, false, n);
+	}
+}
+
 bool
 svm_np_pagefault (bool write, u64 gphys, bool emulation)
 {
 	enum vmmerr e;
 	struct svm_np *np;
 	int ps_array_len;
+	int level = -1;
 	bool ret = false;
 
 	np = current->u.svm.np;
+	if (np->premap) {
+		np->premap = false;
+		svm_np_premap (np);
+	}
 	cur_move (np, gphys);
 	ps_array_len = np->cur.level + 1 < np->avl_pagesizes_len ?
 		np->cur.level + 1 : np->avl_pagesizes_len;
@@ -263,15 +358,20 @@ svm_np_pagefault (bool write, u64 gphys, bool emulation)
 						  ps_array_len);
 	switch (ps_array_len) {
 	case 3:
-		if (!svm_np_map_1gpage (np, gphys))
+		if (!svm_np_map_1gpage (np, gphys)) {
+			level = 2;
 			break;
+		}
 		/* Fall through */
 	case 2:
-		if (!svm_np_map_2mpage (np, gphys))
+		if (!svm_np_map_2mpage (np, gphys)) {
+			level = 1;
 			break;
+		}
 		/* Fall through */
 	case 1:
 		svm_np_map_page (np, write, gphys);
+		level = 0;
 		break;
 	default:
 		ret = true;
@@ -281,6 +381,8 @@ svm_np_pagefault (bool write, u64 gphys, bool emulation)
 		if (e != VMMERR_SUCCESS)
 			panic ("Fatal error: MMIO access error %d", e);
 	}
+	if (level >= 0 && config.vmm.paging_fault_around)
+		svm_np_fault_around (np, gphys, level);
 	mmio_unlock ();
 	return ret;
 }
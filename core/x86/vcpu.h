@@ -34,6 +34,7 @@
 #include "asm.h"
 #include "acpi.h"
 #include "cache.h"
+#include "cpu_interpreter.h"
 #include "cpu_mmu_spt.h"
 #include "cpuid.h"
 #include "exint.h"
@@ -78,6 +79,7 @@ struct vcpu {
 	struct localapic_data localapic;
 	struct initipi_func initipi;
 	struct cache_data cache;
+	struct cpu_interpreter_data interp;
 };
 
 void vcpu_list_foreach (bool (*func) (struct vcpu *p, void *q), void *q);
@@ -99,7 +99,10 @@ struct vt {
 	ulong cr4_guesthost_mask;
 };
 
+struct vt_stat;
+
 struct vt_pcpu_data {
+	struct vt_stat *stat;	/* exit statistics (STATUS=y) */
 	u32 vmcs_revision_identifier;
 	void *vmxon_region_virt;
 	u64 vmxon_region_phys;
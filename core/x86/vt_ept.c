@@ -28,6 +28,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <builtin.h>
+#include <core/assert.h>
+#include <core/config.h>
+#include <core/initfunc.h>
 #include <core/mm.h>
 #include <core/panic.h>
 #include <core/printf.h>
@@ -35,7 +39,9 @@
 #include <stdint.h>
 #include "../mm.h"
 #include "../phys.h"
+#include "../vmmcall_status.h"
 #include "asm.h"
+#include "callrealmode.h"
 #include "constants.h"
 #include "convert.h"
 #include "current.h"
@@ -46,10 +52,16 @@
 #include "vt_main.h"
 #include "vt_paging.h"
 #include "vt_regs.h"
+#include "vmm_mem.h"
 #include "vmmerr.h"
 
 #define MAXNUM_OF_EPTBL	256
+#define LIMNUM_OF_EPTBL	4096
 #define DEFNUM_OF_EPTBL	16
+#define EPTBL_RAM_SHIFT	26	/* one table per 64MiB of RAM */
+#define EPTBL_RESERVE_PAGES	4096
+#define EPTBL_EVICT_BATCH	8
+#define EPT_FAULT_AROUND	16 /* entries, must be a power of 2 */
 #define EPTE_READ	0x1
 #define EPTE_READEXEC	0x5
 #define EPTE_WRITE	0x2
@@ -62,21 +74,163 @@
 
 static const u64 pagesizes[3] = { PAGESIZE, PAGESIZE2M, PAGESIZE1G };
 
+/* A paging-structure page.  The page storage of the page holds the
+ * index of the structure. */
+struct vt_ept_tbl {
+	void *virt;
+	phys_t phys;
+	u64 *parent;		/* entry pointing the table, NULL if free */
+	int parent_tbl;		/* -1 if parent is in ncr3tbl */
+	int nchild;		/* tables pointed from the table */
+	int next_free;
+	int level;		/* 0: entries map 4KiB pages */
+	u32 bitmap;		/* which part is used */
+	bool ref;
+};
+
+/* Tables are allocated on demand up to maxnumtbl.  If no more table
+ * is available, tables without children are evicted with the clock
+ * algorithm.  The whole EPT is cleared only if nothing can be
+ * evicted. */
 struct vt_ept {
-	int cnt;
+	int cnt;		/* allocated tables */
+	int tbl_len;
+	int free;
+	int nfree;
+	int hand;
 	int avl_pagesizes_len;
 	int maxnumtbl;
+	bool premap;		/* map RAM at the first violation */
 	void *ncr3tbl;
 	phys_t ncr3tbl_phys;
-	void *tbl[MAXNUM_OF_EPTBL];
-	phys_t tbl_phys[MAXNUM_OF_EPTBL];
+	struct vt_ept_tbl *tbl;
 	struct {
 		int level;
 		phys_t gphys;
 		u64 *entry[EPT_LEVELS];
+		int tbl[EPT_LEVELS]; /* table including entry */
 	} cur;
 };
 
+static struct {
+	u32 tables;
+	u64 evict;
+	u64 rebuild;
+} ept_stat;
+static int ept_ram_numtbl;
+
+/* Allocate a table page and add it to the free list. */
+static void
+ept_tbl_alloc (struct vt_ept *ept)
+{
+	struct vt_ept_tbl *t;
+	int i = ept->cnt;
+
+	if (i >= ept->tbl_len) {
+		ept->tbl_len *= 2;
+		if (ept->tbl_len > ept->maxnumtbl)
+			ept->tbl_len = ept->maxnumtbl;
+		ept->tbl = realloc (ept->tbl, sizeof *ept->tbl * ept->tbl_len);
+	}
+	t = &ept->tbl[i];
+	alloc_page (&t->virt, &t->phys);
+	*mm_get_page_storage (t->virt) = i;
+	t->parent = NULL;
+	t->nchild = 0;
+	t->bitmap = ~0;
+	t->ref = false;
+	t->next_free = ept->free;
+	ept->free = i;
+	ept->nfree++;
+	ept->cnt++;
+	atomic_fetch_add32 (&ept_stat.tables, 1);
+}
+
+static void
+ept_tbl_put (struct vt_ept *ept, int i)
+{
+	struct vt_ept_tbl *t = &ept->tbl[i];
+
+	t->parent = NULL;
+	t->nchild = 0;
+	t->next_free = ept->free;
+	ept->free = i;
+	ept->nfree++;
+}
+
+static int
+ept_tbl_get (struct vt_ept *ept)
+{
+	int i = ept->free;
+
+	ASSERT (i >= 0);
+	ept->free = ept->tbl[i].next_free;
+	ept->nfree--;
+	return i;
+}
+
+/* Make n tables available without evicting if possible.  Tables are
+ * allocated while enough memory is left for others. */
+static bool
+ept_tbl_reserve (struct vt_ept *ept, int n)
+{
+	while (ept->nfree < n) {
+		if (ept->cnt >= ept->maxnumtbl)
+			return false;
+		if (ept->cnt >= DEFNUM_OF_EPTBL &&
+		    num_of_available_pages () < EPTBL_RESERVE_PAGES)
+			return false;
+		ept_tbl_alloc (ept);
+	}
+	return true;
+}
+
+static void invept (struct vt_ept *ept);
+
+/* Evict up to EPTBL_EVICT_BATCH tables which have no child tables.  A
+ * table which is referenced since the last visit gets a second
+ * chance.  The table exclude is the one cur_fill() is going to
+ * update.  Returns false if nothing is evicted. */
+static bool
+ept_tbl_evict (struct vt_ept *ept, int exclude)
+{
+	struct vt_ept_tbl *t;
+	int i, n = 0, scan = ept->cnt * 2;
+
+	while (scan-- > 0 && n < EPTBL_EVICT_BATCH) {
+		i = ept->hand;
+		if (++ept->hand >= ept->cnt)
+			ept->hand = 0;
+		t = &ept->tbl[i];
+		if (!t->parent || t->nchild || i == exclude)
+			continue;
+		if (t->ref) {
+			t->ref = false;
+			continue;
+		}
+		*t->parent = 0;
+		if (t->parent_tbl >= 0)
+			ept->tbl[t->parent_tbl].nchild--;
+		ept_tbl_put (ept, i);
+		n++;
+	}
+	if (!n)
+		return false;
+	invept (ept);
+	atomic_fetch_add64 (&ept_stat.evict, n);
+	return true;
+}
+
+/* Free all the tables.  They are cleared when they are used again. */
+static void
+ept_tbl_reset (struct vt_ept *ept)
+{
+	ept->free = -1;
+	ept->nfree = 0;
+	for (int i = ept->cnt; i-- > 0;)
+		ept_tbl_put (ept, i);
+}
+
 static bool vt_ept_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end);
 
 static bool
@@ -107,34 +261,47 @@ ept1gb_available (void)
 	return !!(ept_vpid_cap & MSR_IA32_VMX_EPT_VPID_CAP_1GPAGE_BIT);
 }
 
-struct vt_ept *
-vt_ept_new (int maxnumtbl)
+/* maxnumtbl is the upper limit of tables allocated on demand */
+static struct vt_ept *
+ept_new (int maxnumtbl)
 {
 	struct vt_ept *ept;
 	int i;
 
-	if (maxnumtbl < 8)
-		maxnumtbl = 8;
-	if (maxnumtbl > MAXNUM_OF_EPTBL)
-		maxnumtbl = MAXNUM_OF_EPTBL;
 	ept = alloc (sizeof *ept);
 	alloc_page (&ept->ncr3tbl, &ept->ncr3tbl_phys);
 	memset (ept->ncr3tbl, 0, PAGESIZE);
 	*mm_get_page_storage (ept->ncr3tbl) = 0;
-	for (i = 0; i < MAXNUM_OF_EPTBL; i++)
-		ept->tbl[i] = NULL;
-	for (i = 0; i < DEFNUM_OF_EPTBL && i < maxnumtbl; i++) {
-		alloc_page (&ept->tbl[i], &ept->tbl_phys[i]);
-		*mm_get_page_storage (ept->tbl[i]) = ~0;
-	}
+	ept->tbl_len = DEFNUM_OF_EPTBL < maxnumtbl ? DEFNUM_OF_EPTBL :
+		maxnumtbl;
+	ept->tbl = alloc (sizeof *ept->tbl * ept->tbl_len);
 	ept->cnt = 0;
+	ept->free = -1;
+	ept->nfree = 0;
+	ept->hand = 0;
+	ept->maxnumtbl = maxnumtbl;
+	for (i = 0; i < ept->tbl_len; i++)
+		ept_tbl_alloc (ept);
 	ept->cur.level = EPT_LEVELS;
+	ept->cur.tbl[EPT_LEVELS - 1] = -1;
 	ept->avl_pagesizes_len = ept1gb_available () ? 3 : 2;
-	ept->maxnumtbl = maxnumtbl;
+	ept->premap = false;
 	invept (ept);
 	return ept;
 }
 
+/* Used for EPTs other than the one of the guest, which is sized by
+ * the amount of RAM in vt_ept_init () */
+struct vt_ept *
+vt_ept_new (int maxnumtbl)
+{
+	if (maxnumtbl < 8)
+		maxnumtbl = 8;
+	if (maxnumtbl > MAXNUM_OF_EPTBL)
+		maxnumtbl = MAXNUM_OF_EPTBL;
+	return ept_new (maxnumtbl);
+}
+
 u64
 vt_ept_get_eptp (struct vt_ept *ept)
 {
@@ -142,11 +309,36 @@ vt_ept_get_eptp (struct vt_ept *ept)
 		VMCS_EPT_PAGEWALK_LENGTH_4;
 }
 
+/* The number of tables grows with the amount of RAM since more tables
+ * are needed for mapping with small pages around MMIO holes and MTRR
+ * boundaries. */
+static int
+ept_get_ram_numtbl (void)
+{
+	phys_t base = 0, start;
+	u64 len, ram = 0;
+	u32 type;
+
+	if (ept_ram_numtbl)
+		return ept_ram_numtbl;
+	while (vmm_mem_continuous_sysmem_type_region (base, &start, &len,
+						      &type)) {
+		if (type == SYSMEMMAP_TYPE_AVAILABLE)
+			ram += len;
+		base = start + len;
+	}
+	ram >>= EPTBL_RAM_SHIFT;
+	ept_ram_numtbl = ram < MAXNUM_OF_EPTBL ? MAXNUM_OF_EPTBL :
+		ram > LIMNUM_OF_EPTBL ? LIMNUM_OF_EPTBL : ram;
+	return ept_ram_numtbl;
+}
+
 void
 vt_ept_init (void)
 {
-	struct vt_ept *ept = vt_ept_new (MAXNUM_OF_EPTBL);
+	struct vt_ept *ept = ept_new (ept_get_ram_numtbl ());
 	asm_vmwrite64 (VMCS_EPT_POINTER, vt_ept_get_eptp (ept));
+	ept->premap = !!config.vmm.paging_premap_ram;
 	current->u.vt.ept = ept;
 	mmioclr_register (current, vt_ept_mmioclr_callback);
 }
@@ -154,8 +346,10 @@ vt_ept_init (void)
 void
 vt_ept_delete (struct vt_ept *ept)
 {
-	for (int i = 0; i < MAXNUM_OF_EPTBL && ept->tbl[i]; i++)
-		free (ept->tbl[i]);
+	for (int i = 0; i < ept->cnt; i++)
+		free (ept->tbl[i].virt);
+	atomic_fetch_add32 (&ept_stat.tables, -ept->cnt);
+	free (ept->tbl);
 	free (ept->ncr3tbl);
 	free (ept);
 }
@@ -164,6 +358,7 @@ static void
 cur_move (struct vt_ept *ept, u64 gphys)
 {
 	u64 mask, *p, e;
+	int i;
 
 	mask = 0xFFFFFFFFFFFFF000ULL;
 	if (ept->cur.level > 0)
@@ -191,33 +386,27 @@ cur_move (struct vt_ept *ept, u64 gphys)
 		e &= ~PAGESIZE_MASK;
 		e |= (gphys >> (9 * ept->cur.level)) & 0xFF8;
 		p = (u64 *)phys_to_virt (e);
+		i = *mm_get_page_storage (p);
+		ept->tbl[i].ref = true;
 		ept->cur.level--;
 		ept->cur.entry[ept->cur.level] = p;
-	}
-}
-
-static void
-ept_tbl_alloc (struct vt_ept *ept, int i)
-{
-	if (!ept->tbl[i]) {
-		alloc_page (&ept->tbl[i], &ept->tbl_phys[i]);
-		*mm_get_page_storage (ept->tbl[i]) = ~0;
+		ept->cur.tbl[ept->cur.level] = i;
 	}
 }
 
 /* Store information which part is used. */
 static void
-set_bitmap_for_ept_entry (u64 *p)
+set_bitmap_for_ept_entry (struct vt_ept_tbl *t, u64 *p)
 {
-	*mm_get_page_storage (p) |= 1 << (((intptr_t)p & PAGESIZE_MASK) >> 7);
+	t->bitmap |= 1 << (((intptr_t)p & PAGESIZE_MASK) >> 7);
 }
 
 static void
-clear_ept_based_on_bitmap (void *p)
+clear_ept_based_on_bitmap (struct vt_ept_tbl *t)
 {
-	u32 *s = mm_get_page_storage (p);
+	void *p = t->virt;
 	u32 off = 0;
-	u32 bitmap = *s;
+	u32 bitmap = t->bitmap;
 	for (;;) {
 		int bits0 = __builtin_ffs (bitmap) - 1;
 		if (bits0 < 0)
@@ -232,7 +421,7 @@ clear_ept_based_on_bitmap (void *p)
 		bitmap >>= len;
 		off += len;
 	}
-	*s = 0;
+	t->bitmap = 0;
 }
 
 static void
@@ -259,29 +448,43 @@ clear_ncr3tbl (struct vt_ept *ept)
 static u64 *
 cur_fill (struct vt_ept *ept, u64 gphys, int level)
 {
-	int l;
+	int l, i, parent;
+	struct vt_ept_tbl *t;
 	u64 *p;
 
-	if (ept->cnt + ept->cur.level - level > MAXNUM_OF_EPTBL) {
+	l = ept->cur.level;
+	while (!ept_tbl_reserve (ept, l - level)) {
+		if (ept_tbl_evict (ept, ept->cur.tbl[l]))
+			continue;
 		clear_ncr3tbl (ept);
-		ept->cnt = 0;
+		ept_tbl_reset (ept);
 		invept (ept);
+		atomic_fetch_add64 (&ept_stat.rebuild, 1);
 		ept->cur.level = EPT_LEVELS - 1;
+		l = ept->cur.level;
 	}
-	l = ept->cur.level;
+	parent = ept->cur.tbl[l];
 	for (p = ept->cur.entry[l]; l > level; l--) {
-		ept_tbl_alloc (ept, ept->cnt);
-		if (l < EPT_LEVELS - 1)
-			set_bitmap_for_ept_entry (p);
-		else
+		i = ept_tbl_get (ept);
+		t = &ept->tbl[i];
+		if (parent >= 0) {
+			set_bitmap_for_ept_entry (&ept->tbl[parent], p);
+			ept->tbl[parent].nchild++;
+		} else {
 			update_ept_pml4e_used (p);
-		*p = ept->tbl_phys[ept->cnt] | EPTE_READEXEC | EPTE_WRITE;
-		p = ept->tbl[ept->cnt++];
-		clear_ept_based_on_bitmap (p);
+		}
+		*p = t->phys | EPTE_READEXEC | EPTE_WRITE;
+		t->parent = p;
+		t->parent_tbl = parent;
+		t->level = l - 1;
+		t->ref = true;
+		clear_ept_based_on_bitmap (t);
+		p = t->virt;
 		p += (gphys >> (9 * l + 3)) & 0x1FF;
+		parent = i;
 	}
-	if (level < EPT_LEVELS - 1)
-		set_bitmap_for_ept_entry (p);
+	if (parent >= 0)
+		set_bitmap_for_ept_entry (&ept->tbl[parent], p);
 	else
 		update_ept_pml4e_used (p);
 	return p;
@@ -359,15 +562,108 @@ vt_ept_map_1gpage (struct vt_ept *ept, u64 gphys)
 	return false;
 }
 
+/* Map a 2MiB or 1GiB page at gphys unless it overlaps MMIO or its
+ * MTRR type is not uniform.  Returns 1 if mapped, 0 if not, or -1 if
+ * tables are not available without eviction.  Note: mmio_lock() must
+ * be held. */
+static int
+vt_ept_premap_large (struct vt_ept *ept, u64 gphys, int level)
+{
+	cur_move (ept, gphys);
+	if (ept->cur.level < level)
+		return 0;
+	if (ept->cur.level == level &&
+	    (*ept->cur.entry[level] & EPTE_PRESENT_MASK))
+		return 1;
+	if (mmio_range_each_page_size (gphys, pagesizes, level + 1) <= level)
+		return 0;
+	if (!ept_tbl_reserve (ept, ept->cur.level - level))
+		return -1;
+	if (level == 2)
+		return vt_ept_map_1gpage (ept, gphys) ? 0 : 1;
+	return vt_ept_map_2mpage (ept, gphys) ? 0 : 1;
+}
+
+/* Map all the available RAM with large pages.  Stops when tables run
+ * out, to leave them for faults. */
+static void
+vt_ept_premap (struct vt_ept *ept)
+{
+	phys_t base = 0, start, gphys, end;
+	u64 len;
+	u32 type;
+	int r;
+
+	mmio_lock ();
+	while (vmm_mem_continuous_sysmem_type_region (base, &start, &len,
+						      &type)) {
+		base = start + len;
+		if (type != SYSMEMMAP_TYPE_AVAILABLE)
+			continue;
+		gphys = (start + PAGESIZE2M_MASK) & ~PAGESIZE2M_MASK;
+		end = (start + len) & ~PAGESIZE2M_MASK;
+		while (gphys < end) {
+			r = 0;
+			if (!(gphys & PAGESIZE1G_MASK) &&
+			    end - gphys >= PAGESIZE1G)
+				r = vt_ept_premap_large (ept, gphys, 2);
+			if (r > 0) {
+				gphys += PAGESIZE1G;
+				continue;
+			}
+			if (r < 0 || vt_ept_premap_large (ept, gphys, 1) < 0)
+				goto out;
+			gphys += PAGESIZE2M;
+		}
+	}
+out:
+	mmio_unlock ();
+}
+
+/* Map absent neighbours of gphys in the same table with the same page
+ * size.  They are likely accessed soon.  Note: mmio_lock() must be
+ * held. */
+static void
+vt_ept_fault_around (struct vt_ept *ept, u64 gphys, int level)
+{
+	u64 size = pagesizes[level];
+	u64 n = gphys & ~(size * EPT_FAULT_AROUND - 1);
+	u64 end = n + size * EPT_FAULT_AROUND;
+
+	gphys &= ~(size - 1);
+	for (; n < end; n += size) {
+		if (n == gphys)
+			continue;
+		cur_move (ept, n);
+		if (ept->cur.level != level ||
+		    (*ept->cur.entry[level] & EPTE_PRESENT_MASK))
+			continue;
+		if (mmio_range_each_page_size (n, pagesizes, level + 1) <=
+		    level)
+			continue;
+		if (level == 2)
+			vt_ept_map_1gpage (ept, n);
+		else if (level == 1)
+			vt_ept_map_2mpage (ept, n);
+		else
+			vt_ept_map_page (ept, false, n);
+	}
+}
+
 bool
 vt_ept_violation (bool write, u64 gphys, bool emulation)
 {
 	enum vmmerr e;
 	struct vt_ept *ept;
 	int ps_array_len;
+	int level = -1;
 	bool ret = false;
 
 	ept = current->u.vt.ept;
+	if (ept->premap) {
+		ept->premap = false;
+		vt_ept_premap (ept);
+	}
 	cur_move (ept, gphys);
 	ps_array_len = ept->cur.level + 1 < ept->avl_pagesizes_len ?
 		ept->cur.level + 1 : ept->avl_pagesizes_len;
@@ -376,15 +672,20 @@ vt_ept_violation (bool write, u64 gphys, bool emulation)
 						  ps_array_len);
 	switch (ps_array_len) {
 	case 3:
-		if (!vt_ept_map_1gpage (ept, gphys))
+		if (!vt_ept_map_1gpage (ept, gphys)) {
+			level = 2;
 			break;
+		}
 		/* Fall through */
 	case 2:
-		if (!vt_ept_map_2mpage (ept, gphys))
+		if (!vt_ept_map_2mpage (ept, gphys)) {
+			level = 1;
 			break;
+		}
 		/* Fall through */
 	case 1:
 		vt_ept_map_page (ept, write, gphys);
+		level = 0;
 		break;
 	default:
 		ret = true;
@@ -394,6 +695,8 @@ vt_ept_violation (bool write, u64 gphys, bool emulation)
 		if (e != VMMERR_SUCCESS)
 			panic ("Fatal error: MMIO access error %d", e);
 	}
+	if (level >= 0 && config.vmm.paging_fault_around)
+		vt_ept_fault_around (ept, gphys, level);
 	mmio_unlock ();
 	return ret;
 }
@@ -528,7 +831,7 @@ void
 vt_ept_clear (struct vt_ept *ept)
 {
 	clear_ncr3tbl (ept);
-	ept->cnt = 0;
+	ept_tbl_reset (ept);
 	ept->cur.level = EPT_LEVELS;
 	invept (ept);
 }
@@ -549,10 +852,15 @@ vt_ept_extern_mapsearch (struct vcpu *p, phys_t start, phys_t end)
 	ept = p->u.vt.ept;
 	cnt = ept->cnt;
 	for (i = 0; i < cnt; i++) {
-		e = ept->tbl[i];
+		if (!ept->tbl[i].parent)
+			continue;
+		e = ept->tbl[i].virt;
 		for (j = 0; j < n; j++) {
 			if (!(e[j] & EPTE_READ))
 				continue;
+			/* Skip entries pointing tables */
+			if (ept->tbl[i].level > 0 && !(e[j] & EPTE_LARGE))
+				continue;
 			tmp1 = e[j] & mask;
 			tmp2 = tmp1 | 07777;
 			if (e[j] & EPTE_IGN_BIT11) {
@@ -594,3 +902,25 @@ vt_ept_map_1mb (void)
 		mmio_unlock ();
 	}
 }
+
+static char *
+vt_ept_status (void)
+{
+	static char buf[256];
+
+	snprintf (buf, sizeof buf,
+		  "EPT:\n"
+		  " tables: %u limit: %d\n"
+		  " evict: %llu rebuild: %llu\n",
+		  ept_stat.tables, ept_ram_numtbl, ept_stat.evict,
+		  ept_stat.rebuild);
+	return buf;
+}
+
+static void
+vt_ept_register_status_callback (void)
+{
+	register_status_callback (vt_ept_status);
+}
+
+INITFUNC ("paral01", vt_ept_register_status_callback);
@@ -32,6 +32,7 @@
 #include <core/exint_pass.h>
 #include <core/initfunc.h>
 #include <core/linkage.h>
+#include <core/mm.h>
 #include <core/panic.h>
 #include <core/printf.h>
 #include <core/string.h>
@@ -62,6 +63,11 @@
 #include "vt_vmcs.h"
 
 #define STAT_EXIT_REASON_MAX EXIT_REASON_XSETBV
+#define STAT_HIST_NUM 16	/* log2 buckets of TSC cycles */
+#define STAT_HIST_SHIFT 9	/* the first bucket is below 2^10 */
+#define STAT_KEY_NUM 32		/* I/O ports or MMIO pages per processor */
+#define STAT_KEY_TOTAL_NUM 64
+#define STAT_KEY_NONE (~0ULL)
 
 enum vt__status {
 	VT__VMENTRY_SUCCESS,
@@ -73,13 +79,29 @@ enum vt__status {
 static void make_gp_fault (u32 errcode);
 static void make_ud_fault (void);
 
-static u32 stat_intcnt = 0;
-static u32 stat_hwexcnt = 0;
-static u32 stat_swexcnt = 0;
-static u32 stat_pfcnt = 0;
-static u32 stat_iocnt = 0;
-static u32 stat_hltcnt = 0;
-static u32 stat_exit_reason[STAT_EXIT_REASON_MAX + 1];
+struct vt_stat_hist {
+	u64 count;
+	u64 cycles;
+	u32 hist[STAT_HIST_NUM];
+};
+
+struct vt_stat_key {
+	u64 key;
+	struct vt_stat_hist h;
+};
+
+/* Exit statistics are counted per processor without lock and summed
+ * up by vt_status().  The structure is larger than a page, so the
+ * counters of different processors never share a cache line. */
+struct vt_stat {
+	u64 intcnt, hwexcnt, swexcnt, pfcnt, iocnt, hltcnt;
+	u64 start;		/* TSC at the beginning of the exit */
+	u64 key;		/* I/O port or MMIO page of the exit */
+	struct vt_stat_hist reason[STAT_EXIT_REASON_MAX + 1];
+	struct vt_stat_key io[STAT_KEY_NUM];
+	struct vt_stat_key mmio[STAT_KEY_NUM];
+	struct vt_stat_hist io_other, mmio_other;
+};
 
 static void
 do_mov_cr (void)
@@ -298,7 +320,7 @@ do_exception (void)
 	if (vii.s.valid == INTR_INFO_VALID_VALID) {
 		switch (vii.s.type) {
 		case INTR_INFO_TYPE_HARD_EXCEPTION:
-			STATUS_UPDATE (asm_lock_incl (&stat_hwexcnt));
+			STATUS_UPDATE (currentcpu->vt.stat->hwexcnt++);
 			if (vii.s.vector == EXCEPTION_DB &&
 			    current->u.vt.vr.sw.enable)
 				break;
@@ -310,7 +332,7 @@ do_exception (void)
 				asm_vmread (VMCS_VMEXIT_INTR_ERRCODE, &err);
 				asm_vmread (VMCS_EXIT_QUALIFICATION, &cr2);
 				vt_paging_pagefault (err, cr2);
-				STATUS_UPDATE (asm_lock_incl (&stat_pfcnt));
+				STATUS_UPDATE (currentcpu->vt.stat->pfcnt++);
 			} else if (current->u.vt.vr.re) {
 				switch (vii.s.vector) {
 				case EXCEPTION_GP:
@@ -369,7 +391,7 @@ do_exception (void)
 			}
 			break;
 		case INTR_INFO_TYPE_SOFT_EXCEPTION:
-			STATUS_UPDATE (asm_lock_incl (&stat_swexcnt));
+			STATUS_UPDATE (currentcpu->vt.stat->swexcnt++);
 			current->u.vt.intr.vmcs_intr_info.v = vii.v;
 			asm_vmread (VMCS_VMEXIT_INSTRUCTION_LEN, &len);
 			current->u.vt.intr.vmcs_instruction_len = len;
@@ -1164,6 +1186,82 @@ do_vmresume (void)
 		vt_emul_vmresume ();
 }
 
+#ifdef VMMCALL_STATUS_ENABLE
+static u64
+vt_stat_rdtsc (void)
+{
+	u32 a, d;
+
+	asm_rdtsc (&a, &d);
+	return ((u64)d << 32) | a;
+}
+
+static void
+vt_stat_hist_add (struct vt_stat_hist *h, u64 cycles)
+{
+	int i;
+
+	i = cycles ? 63 - __builtin_clzll (cycles) - STAT_HIST_SHIFT : 0;
+	if (i < 0)
+		i = 0;
+	if (i >= STAT_HIST_NUM)
+		i = STAT_HIST_NUM - 1;
+	h->count++;
+	h->cycles += cycles;
+	h->hist[i]++;
+}
+
+static void
+vt_stat_key_add (struct vt_stat_key *k, struct vt_stat_hist *other, u64 key,
+		 u64 cycles)
+{
+	k = &k[(key ^ (key >> 5)) % STAT_KEY_NUM];
+	if (k->key == STAT_KEY_NONE)
+		k->key = key;
+	vt_stat_hist_add (k->key == key ? &k->h : other, cycles);
+}
+
+static void
+vt_stat_exit_begin (ulong reason)
+{
+	struct vt_stat *st = currentcpu->vt.stat;
+	ulong eq;
+	u64 gp;
+
+	/* Read the key now since a handler may switch the VMCS */
+	switch (reason) {
+	case EXIT_REASON_IO_INSTRUCTION:
+		asm_vmread (VMCS_EXIT_QUALIFICATION, &eq);
+		st->key = (eq >> 16) & 0xFFFF;
+		break;
+	case EXIT_REASON_EPT_VIOLATION:
+		asm_vmread64 (VMCS_GUEST_PHYSICAL_ADDRESS, &gp);
+		st->key = gp >> PAGESIZE_SHIFT;
+		break;
+	}
+	st->start = vt_stat_rdtsc ();
+}
+
+static void
+vt_stat_exit_end (ulong reason)
+{
+	struct vt_stat *st = currentcpu->vt.stat;
+	u64 cycles;
+
+	cycles = vt_stat_rdtsc () - st->start;
+	vt_stat_hist_add (&st->reason[reason > STAT_EXIT_REASON_MAX ?
+				      STAT_EXIT_REASON_MAX : reason], cycles);
+	switch (reason) {
+	case EXIT_REASON_IO_INSTRUCTION:
+		vt_stat_key_add (st->io, &st->io_other, st->key, cycles);
+		break;
+	case EXIT_REASON_EPT_VIOLATION:
+		vt_stat_key_add (st->mmio, &st->mmio_other, st->key, cycles);
+		break;
+	}
+}
+#endif
+
 static void
 vt__exit_reason (void)
 {
@@ -1172,6 +1270,7 @@ vt__exit_reason (void)
 	asm_vmread (VMCS_EXIT_REASON, &exit_reason);
 	if (exit_reason & EXIT_REASON_VMENTRY_FAILURE_BIT)
 		panic ("Fatal error: VM Entry failure.");
+	STATUS_UPDATE (vt_stat_exit_begin (exit_reason & EXIT_REASON_MASK));
 	switch (exit_reason & EXIT_REASON_MASK) {
 	case EXIT_REASON_MOV_CR:
 		do_mov_cr ();
@@ -1180,7 +1279,7 @@ vt__exit_reason (void)
 		do_cpuid ();
 		break;
 	case EXIT_REASON_IO_INSTRUCTION:
-		STATUS_UPDATE (asm_lock_incl (&stat_iocnt));
+		STATUS_UPDATE (currentcpu->vt.stat->iocnt++);
 		vt_io ();
 		break;
 	case EXIT_REASON_RDMSR:
@@ -1193,7 +1292,7 @@ vt__exit_reason (void)
 		do_exception ();
 		break;
 	case EXIT_REASON_EXTERNAL_INT:
-		STATUS_UPDATE (asm_lock_incl (&stat_intcnt));
+		STATUS_UPDATE (currentcpu->vt.stat->intcnt++);
 		do_external_int ();
 		break;
 	case EXIT_REASON_INTERRUPT_WINDOW:
@@ -1212,7 +1311,7 @@ vt__exit_reason (void)
 		do_startup_ipi ();
 		break;
 	case EXIT_REASON_HLT:
-		STATUS_UPDATE (asm_lock_incl (&stat_hltcnt));
+		STATUS_UPDATE (currentcpu->vt.stat->hltcnt++);
 		do_hlt ();
 		break;
 	case EXIT_REASON_TASK_SWITCH:
@@ -1265,11 +1364,7 @@ vt__exit_reason (void)
 		printexitreason (exit_reason);
 		panic ("Fatal error: handler not implemented.");
 	}
-	STATUS_UPDATE (asm_lock_incl
-		       (&stat_exit_reason
-			[(exit_reason & EXIT_REASON_MASK) >
-			 STAT_EXIT_REASON_MAX ? STAT_EXIT_REASON_MAX :
-			 (exit_reason & EXIT_REASON_MASK)]));
+	STATUS_UPDATE (vt_stat_exit_end (exit_reason & EXIT_REASON_MASK));
 }
 
 static void
@@ -1457,45 +1552,142 @@ vt_mainloop (void)
 	}
 }
 
+static void
+vt_stat_hist_sum (struct vt_stat_hist *d, struct vt_stat_hist *s)
+{
+	int i;
+
+	d->count += s->count;
+	d->cycles += s->cycles;
+	for (i = 0; i < STAT_HIST_NUM; i++)
+		d->hist[i] += s->hist[i];
+}
+
+static void
+vt_stat_key_sum (struct vt_stat_key *d, struct vt_stat_hist *d_other,
+		 struct vt_stat_key *s, struct vt_stat_hist *s_other)
+{
+	int i, j;
+
+	vt_stat_hist_sum (d_other, s_other);
+	for (i = 0; i < STAT_KEY_NUM; i++) {
+		if (s[i].key == STAT_KEY_NONE)
+			continue;
+		for (j = 0; j < STAT_KEY_TOTAL_NUM; j++) {
+			if (d[j].key == STAT_KEY_NONE)
+				d[j].key = s[i].key;
+			if (d[j].key == s[i].key)
+				break;
+		}
+		vt_stat_hist_sum (j < STAT_KEY_TOTAL_NUM ? &d[j].h : d_other,
+				  &s[i].h);
+	}
+}
+
+static struct {
+	struct vt_stat s;
+	struct vt_stat_key io[STAT_KEY_TOTAL_NUM];
+	struct vt_stat_key mmio[STAT_KEY_TOTAL_NUM];
+} vt_stat_total;
+
+static bool
+vt_stat_sum (struct pcpu *p, void *q)
+{
+	struct vt_stat *d = &vt_stat_total.s, *s = p->vt.stat;
+	int i;
+
+	if (!s)
+		return false;
+	d->intcnt += s->intcnt;
+	d->hwexcnt += s->hwexcnt;
+	d->swexcnt += s->swexcnt;
+	d->pfcnt += s->pfcnt;
+	d->iocnt += s->iocnt;
+	d->hltcnt += s->hltcnt;
+	for (i = 0; i <= STAT_EXIT_REASON_MAX; i++)
+		vt_stat_hist_sum (&d->reason[i], &s->reason[i]);
+	vt_stat_key_sum (vt_stat_total.io, &d->io_other, s->io, &s->io_other);
+	vt_stat_key_sum (vt_stat_total.mmio, &d->mmio_other, s->mmio,
+			 &s->mmio_other);
+	return false;
+}
+
+/* Append to buf at n and return the new length, which is at most
+ * len - 1 even if the output is truncated */
+static int
+vt_stat_append (char *buf, int len, int n, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	if (n >= len - 1)
+		return len - 1;
+	va_start (ap, fmt);
+	r = vsnprintf (buf + n, len - n, fmt, ap);
+	va_end (ap);
+	if (r < 0)
+		return n;
+	return r < len - 1 - n ? n + r : len - 1;
+}
+
+static int
+vt_stat_print_hist (char *buf, int len, int n, char *name, u64 key,
+		    struct vt_stat_hist *h)
+{
+	int i;
+
+	if (!h->count)
+		return n;
+	n = vt_stat_append (buf, len, n, " %s%llX: %llu avg %llu:", name,
+			    key, h->count, h->cycles / h->count);
+	for (i = 0; i < STAT_HIST_NUM; i++)
+		n = vt_stat_append (buf, len, n, " %u", h->hist[i]);
+	return vt_stat_append (buf, len, n, "\n");
+}
+
 static char *
 vt_status (void)
 {
-	static char buf[4096];
-	int i, n;
-
-	n = snprintf (buf, 4096, "Exit Reason:\n");
-	for (i = 0; i + 7 <= STAT_EXIT_REASON_MAX; i += 8) {
-		n += snprintf
-			(buf + n, 4096 - n,
-			 " %02X: %04X %04X %04X %04X %04X %04X %04X %04X\n",
-			 i, stat_exit_reason[i + 0] & 0xFFFF,
-			 stat_exit_reason[i + 1] & 0xFFFF,
-			 stat_exit_reason[i + 2] & 0xFFFF,
-			 stat_exit_reason[i + 3] & 0xFFFF,
-			 stat_exit_reason[i + 4] & 0xFFFF,
-			 stat_exit_reason[i + 5] & 0xFFFF,
-			 stat_exit_reason[i + 6] & 0xFFFF,
-			 stat_exit_reason[i + 7] & 0xFFFF);
-	}
-	if (i <= STAT_EXIT_REASON_MAX) {
-		n += snprintf (buf + n, 4096 - n, " %02X:", i);
-		for (; i < STAT_EXIT_REASON_MAX; i++)
-			n += snprintf (buf + n, 4096 - n, " %04X",
-				       stat_exit_reason[i] & 0xFFFF);
-		n += snprintf (buf + n, 4096 - n, " %04X\n",
-			       stat_exit_reason[i] & 0xFFFF);
+	static char buf[16384];
+	struct vt_stat *t = &vt_stat_total.s;
+	int i, n, len = sizeof buf;
+
+	memset (&vt_stat_total, 0, sizeof vt_stat_total);
+	for (i = 0; i < STAT_KEY_TOTAL_NUM; i++) {
+		vt_stat_total.io[i].key = STAT_KEY_NONE;
+		vt_stat_total.mmio[i].key = STAT_KEY_NONE;
 	}
-	snprintf (buf + n, 4096 - n,
-		  "Interrupts: %u\n"
-		  "Hardware exceptions: %u\n"
-		  " Page fault: %u\n"
-		  " Others: %u\n"
-		  "Software exception: %u\n"
-		  "Watched I/O: %u\n"
-		  "Halt: %u\n"
-		  , stat_intcnt, stat_hwexcnt, stat_pfcnt
-		  , stat_hwexcnt - stat_pfcnt, stat_swexcnt
-		  , stat_iocnt, stat_hltcnt);
+	pcpu_list_foreach (vt_stat_sum, NULL);
+	buf[0] = '\0';
+	n = vt_stat_append (buf, len, 0, "Exit Reason: count avg-cycles:"
+			    " histogram of 2^%d.. cycles\n",
+			    STAT_HIST_SHIFT + 1);
+	for (i = 0; i <= STAT_EXIT_REASON_MAX; i++)
+		n = vt_stat_print_hist (buf, len, n, "", i, &t->reason[i]);
+	n = vt_stat_append (buf, len, n, "I/O port:\n");
+	for (i = 0; i < STAT_KEY_TOTAL_NUM; i++)
+		n = vt_stat_print_hist (buf, len, n, "",
+					vt_stat_total.io[i].key,
+					&vt_stat_total.io[i].h);
+	n = vt_stat_print_hist (buf, len, n, "other", 0, &t->io_other);
+	n = vt_stat_append (buf, len, n, "EPT violation page:\n");
+	for (i = 0; i < STAT_KEY_TOTAL_NUM; i++)
+		n = vt_stat_print_hist (buf, len, n, "",
+					vt_stat_total.mmio[i].key <<
+					PAGESIZE_SHIFT,
+					&vt_stat_total.mmio[i].h);
+	n = vt_stat_print_hist (buf, len, n, "other", 0, &t->mmio_other);
+	vt_stat_append (buf, len, n,
+			"Interrupts: %llu\n"
+			"Hardware exceptions: %llu\n"
+			" Page fault: %llu\n"
+			" Others: %llu\n"
+			"Software exception: %llu\n"
+			"Watched I/O: %llu\n"
+			"Halt: %llu\n"
+			, t->intcnt, t->hwexcnt, t->pfcnt
+			, t->hwexcnt - t->pfcnt, t->swexcnt
+			, t->iocnt, t->hltcnt);
 	return buf;
 }
 
@@ -1515,4 +1707,27 @@ vt_start_vm (void)
 	vt_mainloop ();
 }
 
+static void
+vt_stat_init_pcpu (void)
+{
+#ifdef VMMCALL_STATUS_ENABLE
+	struct vt_stat *st;
+	int i;
+#endif
+
+	currentcpu->vt.stat = NULL;
+#ifdef VMMCALL_STATUS_ENABLE
+	if (currentcpu->fullvirtualize != FULLVIRTUALIZE_VT)
+		return;
+	st = alloc (sizeof *st);
+	memset (st, 0, sizeof *st);
+	for (i = 0; i < STAT_KEY_NUM; i++) {
+		st->io[i].key = STAT_KEY_NONE;
+		st->mmio[i].key = STAT_KEY_NONE;
+	}
+	currentcpu->vt.stat = st;
+#endif
+}
+
+INITFUNC ("pcpu3", vt_stat_init_pcpu);
 INITFUNC ("paral01", vt_register_status_callback);
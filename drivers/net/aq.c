@@ -1428,6 +1428,9 @@ aq_new (struct pci_device *dev)
 					  aq_intr_disable,
 					  aq_intr_enable,
 					  aq);
+	if (dev->driver_options[3] &&
+	    !pci_driver_option_get_bool (dev->driver_options[3], NULL))
+		virtio_net_set_event_idx (aq->virtio_net, false);
 	virtio_net_set_pci_device (aq->virtio_net, dev, &bar0, aq->r,
 				   aq_mmio_change, aq);
 
@@ -1487,7 +1490,7 @@ done:
 static struct pci_driver aq_driver = {
 	.name		= driver_name,
 	.longname	= driver_longname,
-	.driver_options	= "tty,net,virtio",
+	.driver_options	= "tty,net,virtio,eventidx",
 	.device		= "class_code=020000,id="
 			  "1d6a:07b1|"	/* Asus XG-C100C, Mac Mini 10Gbps */
 			  "1d6a:87b1",
@@ -1487,6 +1487,7 @@ bnx_new (struct pci_device *pci_device)
 	bool option_virtio = false;
 	bool option_multifunction = false;
 	bool option_hotplugpass = false;
+	bool option_eventidx = true;
 	struct nicfunc *virtio_net_func;
 	u32 cmd;
 	u8 cap, pcie_ver;
@@ -1514,6 +1515,9 @@ bnx_new (struct pci_device *pci_device)
 	if (pci_device->driver_options[4] &&
 	    pci_driver_option_get_bool (pci_device->driver_options[4], NULL))
 		option_hotplugpass = true;
+	if (pci_device->driver_options[5] &&
+	    !pci_driver_option_get_bool (pci_device->driver_options[5], NULL))
+		option_eventidx = false;
 	if (option_hotplugpass && bnx_hotplug) {
 		printi ("[%02x:%02x.%01x] Passthrough\n",
 			pci_device->address.bus_no,
@@ -1550,6 +1554,8 @@ bnx_new (struct pci_device *pci_device)
 						   bnx_intr_enable, bnx);
 		if (option_multifunction)
 			virtio_net_set_multifunction (bnx->virtio_net, 1);
+		if (!option_eventidx)
+			virtio_net_set_event_idx (bnx->virtio_net, false);
 	}
 	if (bnx->virtio_net) {
 		struct pci_bar_info bar;
@@ -1681,7 +1687,7 @@ bnx_reconnect (struct pci_device *pci_device)
 static struct pci_driver bnx_driver = {
 	.name		= driver_name,
 	.longname	= driver_longname,
-	.driver_options	= "tty,net,virtio,multifunction,hotplugpass",
+	.driver_options	= "tty,net,virtio,multifunction,hotplugpass,eventidx",
 	.device		= "class_code=020000,id="
 			  "14e4:165a|" /* BCM5722 */
 			  "14e4:1682|" /* Thunderbolt - BCM57762 */
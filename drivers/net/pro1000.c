@@ -29,6 +29,8 @@
 
 #include <arch/pci.h>
 #include <core.h>
+#include <core/arith.h>
+#include <core/currentcpu.h>
 #include <core/dres.h>
 #include <core/initfunc.h>
 #include <core/list.h>
@@ -54,6 +56,7 @@ static const char driver_longname[] = "Intel PRO/1000 driver";
 #define TBUF_SIZE	PAGESIZE
 #define RBUF_SIZE	PAGESIZE
 #define SENDVIRT_MAXSIZE 1514
+#define NUM_OF_QUEUES	2
 
 #define PRO1000_82571EB_0x105E	0x105E
 #define PRO1000_82571EB_0x105F	0x105F
@@ -137,9 +140,24 @@ static const char driver_longname[] = "Intel PRO/1000 driver";
 #define PRO1000_TARC_COUNT_DEFAULT	3
 #define PRO1000_TARC_ENABLE		BIT (10)
 
+#define PRO1000_RXCSUM	0x5000
+#define PRO1000_RXCSUM_PCSD	BIT (13)
+
 #define PRO1000_RFCTL	0x5008
 #define PRO1000_RFCTL_EXSTEN	BIT (15)
 
+#define PRO1000_MRQC	0x5818
+#define PRO1000_MRQC_RSS	0x1
+#define PRO1000_MRQC_IPV4_TCP	BIT (16)
+#define PRO1000_MRQC_IPV4	BIT (17)
+#define PRO1000_MRQC_IPV6	BIT (20)
+#define PRO1000_MRQC_IPV6_TCP	BIT (21)
+
+#define PRO1000_RETA(n)	(0x5C00 + ((n) * 4))
+#define PRO1000_RETA_NUM	32
+#define PRO1000_RSSRK(n)	(0x5C80 + ((n) * 4))
+#define PRO1000_RSSRK_NUM	10
+
 #define PRO1000_RAL	0x5400
 #define PRO1000_RAH	0x5404
 
@@ -255,6 +273,7 @@ struct rdesc_ext1 {
 
 struct desc_shadow {
 	bool initialized;
+	spinlock_t lock;	/* for rings owned by seized devices */
 	union {
 		u64 ll;
 		u32 l[2];
@@ -296,7 +315,8 @@ struct data2 {
 	uint dext0_mss, dext0_hdrlen, dext0_paylen, dext0_ip, dext0_tcp;
 	bool tse_first, tse_tcpfin, tse_tcppsh;
 	u16 tse_iplen, tse_ipchecksum, tse_tcpchecksum;
-	struct desc_shadow tdesc[2], rdesc[2];
+	struct desc_shadow tdesc[NUM_OF_QUEUES], rdesc[NUM_OF_QUEUES];
+	uint num_queues;	/* hardware queues used by a seized device */
 	struct data *d1;
 	struct netdata *nethandle;
 	bool initialized;
@@ -319,7 +339,7 @@ struct data2 {
 	unsigned int msi_intr;
 	bool msi_intr_pass;
 	spinlock_t msi_lock;
-	int msix_qvec[3];
+	int msix_qvec[VIRTIO_NET_N_QUEUES];
 };
 
 struct data {
@@ -419,7 +439,7 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 		  UINT *packet_sizes, bool print_ok)
 {
 	struct desc_shadow *s;
-	uint i, off2;
+	uint i, q, off2;
 	u32 h, t, nt;
 	struct tdesc *td;
 	const struct dres_reg *r;
@@ -429,13 +449,20 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 	if (!(d2->tctl & 2))	/* !EN: Transmit Enable */
 		return;
 	r = d2->d1[0].r;
-	s = &d2->tdesc[0];	    /* FIXME: 0 only */
-	off2 = PRO1000_TD_BASE (0); /* FIXME: 0 only */
+	/* The second queue of a device used by the guest is a shadow
+	 * of the guest's one.  A seized device has a queue for each
+	 * group of processors. */
+	q = 0;
+	if (d2->seize && d2->num_queues > 1)
+		q = currentcpu_get_id () % d2->num_queues;
+	s = &d2->tdesc[q];
+	off2 = PRO1000_TD_BASE (q);
+	spinlock_lock (&s->lock);
 	write_mydesc (s, d2, off2, true);
 	h = pro1000_reg_read32 (r, off2 + TDRD_H_OFFSET);
 	t = pro1000_reg_read32 (r, off2 + TDRD_T_OFFSET);
 	if (h >= NUM_OF_TDESC || t >= NUM_OF_TDESC)
-		return;
+		goto end;
 	for (i = 0; i < num_packets; i++) {
 		nt = t + 1;
 		if (nt >= NUM_OF_TDESC)
@@ -474,6 +501,8 @@ send_physnic_sub (struct data2 *d2, UINT num_packets, void **packets,
 	/* Link up indication */
 	if (pro1000_reg_read32 (r, PRO1000_STATUS) & PRO1000_STATUS_LU)
 		pro1000_reg_write32 (r, off2 + TDRD_T_OFFSET, t);
+end:
+	spinlock_unlock (&s->lock);
 }
 
 static void
@@ -500,7 +529,27 @@ static void
 poll_physnic (void *handle)
 {
 	struct data2 *d2 = handle;
+	struct desc_shadow *s;
+	uint i, q, start;
 
+	if (d2->seize) {
+		/* Each processor starts with its own queue so that
+		 * queues are processed in parallel.  Delivery from one
+		 * queue is serialized by its lock, while the receive
+		 * callback may be called for different queues at the
+		 * same time, as virtio_net does for its queues. */
+		start = currentcpu_get_id ();
+		for (i = 0; i < d2->num_queues; i++) {
+			q = (start + i) % d2->num_queues;
+			s = &d2->rdesc[q];
+			if (!s->initialized)
+				continue;
+			spinlock_lock (&s->lock);
+			receive_physnic (s, d2, PRO1000_RD_BASE (q));
+			spinlock_unlock (&s->lock);
+		}
+		return;
+	}
 	spinlock_lock (&d2->lock);
 	if (d2->rdesc[0].initialized)
 		receive_physnic (&d2->rdesc[0], d2, PRO1000_RD_BASE (0));
@@ -785,7 +834,6 @@ static void
 checksum (void *buff, uint len, uint css, uint cso, uint cse, u16 addval,
 	  bool udp)
 {
-	u16 ipchecksum (void *buf, u32 len);
 	u8 *p = buff;
 	u32 tmp;
 	u16 sum;
@@ -1419,6 +1467,32 @@ pro1000_enable_dma_and_memory (struct pci_device *pci_device)
 				  PCI_CONFIG_COMMAND);
 }
 
+/* Distribute received packets to the receive queues by RSS hash of
+ * IP addresses and TCP ports */
+static void
+pro1000_setup_rss (struct data2 *d2)
+{
+	static const u32 rss_key[PRO1000_RSSRK_NUM] = {
+		0xDA565A6D, 0xC20E5B25, 0x3D256741, 0xB08FA343, 0xCB2BCAD0,
+		0xB4307BAE, 0xA32DCB77, 0x0CF23080, 0x3BB7426A, 0xFA01ACBE,
+	};
+	const struct dres_reg *r = d2->d1[0].r;
+	int i;
+
+	for (i = 0; i < PRO1000_RSSRK_NUM; i++)
+		pro1000_reg_write32 (r, PRO1000_RSSRK (i), rss_key[i]);
+	/* Each register has four 8-bit entries and bit 7 of an entry
+	 * is the queue index.  Alternate queue 0 and 1. */
+	for (i = 0; i < PRO1000_RETA_NUM; i++)
+		pro1000_reg_write32 (r, PRO1000_RETA (i), 0x80008000);
+	pro1000_reg_write32 (r, PRO1000_RXCSUM,
+			     pro1000_reg_read32 (r, PRO1000_RXCSUM) |
+			     PRO1000_RXCSUM_PCSD);
+	pro1000_reg_write32 (r, PRO1000_MRQC, PRO1000_MRQC_RSS |
+			     PRO1000_MRQC_IPV4_TCP | PRO1000_MRQC_IPV4 |
+			     PRO1000_MRQC_IPV6 | PRO1000_MRQC_IPV6_TCP);
+}
+
 static void
 seize_pro1000 (struct data2 *d2)
 {
@@ -1488,23 +1562,39 @@ seize_pro1000 (struct data2 *d2)
 	/* Disable interrupts */
 	pro1000_reg_write32 (r, PRO1000_IMC, 0xFFFFFFFF);
 
+	/* 82571, 82572 and 82574 have two queues for each direction */
+	switch (d2->mac) {
+	case mac_82571:
+	case mac_82572:
+	case mac_82574:
+		d2->num_queues = NUM_OF_QUEUES;
+		break;
+	default:
+		d2->num_queues = 1;
+	}
+
 	/* Receive Initialization */
-	init_desc_receive (&d2->rdesc[0], d2, PRO1000_RD_BASE (0));
-	d2->rdesc[0].initialized = true;
+	for (i = 0; i < d2->num_queues; i++) {
+		init_desc_receive (&d2->rdesc[i], d2, PRO1000_RD_BASE (i));
+		d2->rdesc[i].initialized = true;
+	}
+	if (d2->num_queues > 1)
+		pro1000_setup_rss (d2);
 	v = PRO1000_RCTL_EN | PRO1000_RCTL_BAM | PRO1000_RCTL_BSIZE_4K |
 	    (d2->virtio_net ? PRO1000_RCTL_UPE : 0) | /* unicast promisc   */
 	    (d2->virtio_net ? PRO1000_RCTL_MPE : 0);  /* multicast promisc */
 	pro1000_reg_write32 (r, PRO1000_RCTL, v);
 
 	/* Transmit Initialization */
-	init_desc_transmit (&d2->tdesc[0], d2, PRO1000_TD_BASE (0));
+	for (i = 0; i < d2->num_queues; i++)
+		init_desc_transmit (&d2->tdesc[i], d2, PRO1000_TD_BASE (i));
 	switch (d2->mac) {
 	case mac_82571:
 	case mac_82572:
 		/*
 		 * TARC0/1 PRO1000_TARC_ENABLE is always on according to the
 		 * datasheet. In other words, multiple queue is always on
-		 * even though we use only TX0. Note that we should set bit 21
+		 * and both TX0 and TX1 are used. Note that we should set bit 21
 		 * when running at GbE speed for small packet performance.
 		 * However, we then need to implement link status change
 		 * handling for detecting possible speed change.
@@ -1527,7 +1617,8 @@ seize_pro1000 (struct data2 *d2)
 		v = PRO1000_TARC_COUNT_DEFAULT| PRO1000_TARC_ENABLE |
 		    BIT (26); /* Errata */
 		pro1000_reg_write32 (r, PRO1000_TARC (0), v);
-		/* Use default value for TARC1 */
+		v = PRO1000_TARC_COUNT_DEFAULT | PRO1000_TARC_ENABLE;
+		pro1000_reg_write32 (r, PRO1000_TARC (1), v);
 		break;
 	default:
 		/* Use default value, some models do not even have TARC */
@@ -1548,7 +1639,8 @@ seize_pro1000 (struct data2 *d2)
 	d2->tctl = v;
 	pro1000_reg_write32 (r, PRO1000_TCTL, v);
 
-	d2->tdesc[0].initialized = true;
+	for (i = 0; i < d2->num_queues; i++)
+		d2->tdesc[i].initialized = true;
 
 	/* This improve RX performance on some models */
 	pro1000_reg_write32 (r, PRO1000_ITR, ITR_DEFAULT);
@@ -1619,7 +1711,7 @@ pro1000_msix_vector_change (void *param, unsigned int queue, int vector)
 {
 	struct data2 *d2 = param;
 
-	if (queue < 3)
+	if (queue < VIRTIO_NET_N_QUEUES)
 		d2->msix_qvec[queue] = vector;
 	pro1000_msix_update (d2);
 }
@@ -1641,7 +1733,7 @@ pro1000_msix_generate (void *param, unsigned int queue)
 		spinlock_unlock (&d2->msi_lock);
 		return;
 	}
-	if (queue < 3)
+	if (queue < VIRTIO_NET_N_QUEUES && d2->msix_qvec[queue] >= 0)
 		m = d2->msix_tbl[d2->msix_qvec[queue]];
 	if (!(m.mask & 1))
 		pci_arch_msi_to_ipi (d2->pci_device->address,
@@ -1711,6 +1803,11 @@ vpn_pro1000_new (struct pci_device *pci_device, bool option_tty,
 	d2->buf = tmp;
 	d2->buf_premap = net_premap_recvbuf (d2->nethandle, tmp, BUFSIZE);
 	spinlock_init (&d2->lock);
+	for (i = 0; i < NUM_OF_QUEUES; i++) {
+		spinlock_init (&d2->tdesc[i].lock);
+		spinlock_init (&d2->rdesc[i].lock);
+	}
+	d2->num_queues = 1;
 	d = alloc (sizeof *d * 6);
 	for (i = 0; i < 6; i++) {
 		d[i].d = d2;
@@ -1735,6 +1832,10 @@ vpn_pro1000_new (struct pci_device *pci_device, bool option_tty,
 						  pro1000_intr_set,
 						  pro1000_intr_disable,
 						  pro1000_intr_enable, d2);
+		if (d2->virtio_net && pci_device->driver_options[3] &&
+		    !pci_driver_option_get_bool (pci_device->driver_options[3],
+						 NULL))
+			virtio_net_set_event_idx (d2->virtio_net, false);
 	}
 	if (d2->virtio_net) {
 		pci_get_bar_info (pci_device, 0, &bar_info);
@@ -1750,9 +1851,8 @@ vpn_pro1000_new (struct pci_device *pci_device, bool option_tty,
 			d2->msi_intr = 0;
 			d2->msi_intr_pass = false;
 			spinlock_init (&d2->msi_lock);
-			d2->msix_qvec[0] = -1;
-			d2->msix_qvec[1] = -1;
-			d2->msix_qvec[2] = -1;
+			for (i = 0; i < VIRTIO_NET_N_QUEUES; i++)
+				d2->msix_qvec[i] = -1;
 			d2->msicb = pci_register_msi_callback (pci_device,
 							       pro1000_msi,
 							       d2);
@@ -1898,7 +1998,7 @@ pro1000_config_write (struct pci_device *pci_device, u8 iosize,
 static struct pci_driver pro1000_driver = {
 	.name		= driver_name,
 	.longname	= driver_longname,
-	.driver_options	= "tty,net,virtio",
+	.driver_options	= "tty,net,virtio,eventidx",
 	.device		= "class_code=020000,id="
 			/* 31608004.pdf */
 			  "8086:105e|" /* Dual port */
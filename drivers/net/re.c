@@ -153,6 +153,9 @@ re_new (struct pci_device *dev)
 						    re_core_intr_disable,
 						    re_core_intr_enable,
 						    host);
+		if (dev->driver_options[3] &&
+		    !pci_driver_option_get_bool (dev->driver_options[3], NULL))
+			virtio_net_set_event_idx (host->virtio_net, false);
 		virtio_net_set_pci_device (host->virtio_net, dev, &bar_info,
 					   re_core_current_dres_reg (host),
 					   re_core_mmio_change, host);
@@ -220,7 +223,7 @@ re_config_write (struct pci_device *dev,
 static struct pci_driver re_driver = {
 	.name		= driver_name,
 	.longname	= driver_longname,
-	.driver_options	= "tty,net,virtio",
+	.driver_options	= "tty,net,virtio,eventidx",
 	.device		= "class_code=020000,id="
 			  "10ec:8129|"
 			  "10ec:8139|"
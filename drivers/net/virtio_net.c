@@ -28,7 +28,9 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <builtin.h>
 #include <core.h>
+#include <core/arith.h>
 #include <core/dres.h>
 #include <core/mm.h>
 #include <core/panic.h>
@@ -39,13 +41,19 @@
 
 #define OFFSET_TO_DWORD_BLOCK(offset) ((offset) / sizeof (u32))
 
-#define VIRTIO_N_QUEUES 3
+#define VIRTIO_N_QUEUES VIRTIO_NET_N_QUEUES
 
 #define VIRTIO_NET_PKT_BATCH 16
 #define VIRTIO_NET_QUEUE_SIZE 256
-#define VIRTIO_NET_MSIX_N_VECTORS 4
+/* One vector for each queue and one for configuration change */
+#define VIRTIO_NET_MSIX_N_VECTORS (VIRTIO_N_QUEUES + 1)
 #define VIRTIO_NET_MSIX_TAB_LEN (VIRTIO_NET_MSIX_N_VECTORS * 16)
 #define VIRTIO_NET_MSIX_PBA_LEN (VIRTIO_NET_MSIX_N_VECTORS * 8)
+/* Header, Ethernet header with a VLAN tag and 64KiB IP packet */
+#define VIRTIO_NET_GSO_BUF_SIZE (12 + 18 + 65536)
+#define VIRTIO_NET_MAPCACHE_NUM 32
+#define VIRTIO_NET_MAPCACHE_SHIFT (PAGESIZE_SHIFT + 2)
+#define VIRTIO_NET_MAPCACHE_WIN (1U << VIRTIO_NET_MAPCACHE_SHIFT)
 
 struct virtio_pci_regs32 {
 	u32 initial_val;
@@ -63,13 +71,28 @@ struct virtio_ext_cap {
 #define VIRTIO_STATUS_FEATURES_OK 0x8
 
 /* Feature bits */
+#define VIRTIO_NET_F_CSUM	 (1ULL << 0)
+#define VIRTIO_NET_F_GUEST_CSUM	 (1ULL << 1)
 #define VIRTIO_NET_F_MAC	 (1ULL << 5)
+#define VIRTIO_NET_F_HOST_TSO4	 (1ULL << 11)
+#define VIRTIO_NET_F_HOST_TSO6	 (1ULL << 12)
+#define VIRTIO_NET_F_MRG_RXBUF	 (1ULL << 15)
+#define VIRTIO_NET_F_MQ		 (1ULL << 22)
 #define VIRTIO_NET_F_CTRL_VQ	 (1ULL << 17)
 #define VIRTIO_NET_F_CTRL_RX	 (1ULL << 18)
+#define VIRTIO_F_EVENT_IDX	 (1ULL << 29)
 #define VIRTIO_F_VERSION_1	 (1ULL << 32)
 #define VIRTIO_F_ACCESS_PLATFORM (1ULL << 33)
-#define VIRTIO_NET_DEVICE_FEATURES (VIRTIO_NET_F_MAC | VIRTIO_NET_F_CTRL_VQ | \
+#define VIRTIO_NET_DEVICE_FEATURES (VIRTIO_NET_F_CSUM | \
+				    VIRTIO_NET_F_GUEST_CSUM | \
+				    VIRTIO_NET_F_MAC | \
+				    VIRTIO_NET_F_HOST_TSO4 | \
+				    VIRTIO_NET_F_HOST_TSO6 | \
+				    VIRTIO_NET_F_MRG_RXBUF | \
+				    VIRTIO_NET_F_CTRL_VQ | \
 				    VIRTIO_NET_F_CTRL_RX | \
+				    VIRTIO_NET_F_MQ | \
+				    VIRTIO_F_EVENT_IDX | \
 				    VIRTIO_F_VERSION_1 | \
 				    VIRTIO_F_ACCESS_PLATFORM)
 
@@ -80,6 +103,7 @@ struct virtio_ext_cap {
 /* Ctrl command class */
 #define VIRTIO_NET_CTRL_RX  0
 #define VIRTIO_NET_CTRL_MAC 1
+#define VIRTIO_NET_CTRL_MQ  4
 
 /* Ctrl command code for VIRTIO_NET_CTRL_RX */
 #define VIRTIO_NET_CTRL_RX_PROMISC  0
@@ -91,6 +115,9 @@ struct virtio_ext_cap {
 #define VIRTIO_NET_CTRL_MAC_TABLE_SET  0
 #define VIRTIO_NET_CTRL_MAC_ADDR_SET   1
 
+/* Ctrl command code for VIRTIO_NET_CTRL_MQ */
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
 #define VIRTIO_PCI_CAP_COMMON_CFG 1
 #define VIRTIO_PCI_CAP_NOTIFY_CFG 2
 #define VIRTIO_PCI_CAP_ISR_CFG	  3
@@ -163,6 +190,40 @@ struct virtio_net_hdr {
 	u16 num_buffers;
 };
 
+/* Mappings of guest memory kept across packets.  Each buffer entry
+ * maps an aligned window of VIRTIO_NET_MAPCACHE_WIN bytes, which every
+ * buffer inside the window can use, or a single buffer crossing the
+ * window boundary.  The ring is mapped separately because it is
+ * accessed while buffers are mapped.  The translation of the first
+ * page is kept to find out which mappings are still valid after the
+ * DMA address space changes. */
+struct virtio_net_mapent {
+	u64 addr;
+	u64 pte;
+	u8 *virt;
+	uint len;		/* 0 if unused */
+	int flags;
+};
+
+struct virtio_net_mapcache {
+	spinlock_t lock;
+	const struct mm_as *as;
+	u32 gen;		/* mm_as_generation() of as */
+	u64 ring_addr[3];
+	u64 ring_pte[3];
+	uint ring_len[3];	/* 0 if unused */
+	void *ring_virt[3];
+	struct virtio_net_mapent ent[VIRTIO_NET_MAPCACHE_NUM];
+};
+
+/* Staging buffers for packets sent by the guest.  Each transmit
+ * queue has its own, since transmit queues are processed in parallel
+ * under their own mapcache locks. */
+struct virtio_net_txbuf {
+	u8 buf[VIRTIO_NET_PKT_BATCH][2048];
+	u8 *gso_buf;
+};
+
 struct virtio_net {
 	u32 prev_port;
 	u32 port;
@@ -225,8 +286,8 @@ struct virtio_net {
 	u16 next_ext_cap_offset;
 	bool pcie_cap;
 	struct virtio_pci_cfg_cap pci_cfg;
-	struct msix_table msix_table_entry[VIRTIO_N_QUEUES];
-	u8 buf[VIRTIO_NET_PKT_BATCH][2048];
+	struct msix_table msix_table_entry[VIRTIO_NET_MSIX_N_VECTORS];
+	struct virtio_net_txbuf txbuf[VIRTIO_NET_MAX_QUEUE_PAIRS];
 	spinlock_t msix_lock;
 	u8 unicast_filter[VIRTIO_NET_CTRL_MAC_TABLE_MAX_ENTRIES][6];
 	u8 multicast_filter[VIRTIO_NET_CTRL_MAC_TABLE_MAX_ENTRIES][6];
@@ -234,6 +295,8 @@ struct virtio_net {
 	u32 multicast_filter_entries;
 	bool allow_multicast;
 	bool allow_promisc;
+	u16 queue_pairs;
+	struct virtio_net_mapcache mapcache[VIRTIO_N_QUEUES];
 };
 
 struct vr_desc {
@@ -262,6 +325,21 @@ struct vr_used {
 	} ring[VIRTIO_NET_QUEUE_SIZE];
 };
 
+/* With VIRTIO_F_EVENT_IDX, used_event follows the available ring and
+ * avail_event follows the used ring. */
+static inline u16 *
+vr_used_event (struct vr_avail *avail, u16 queue_size)
+{
+	return &avail->ring[0] + queue_size;
+}
+
+static inline u16 *
+vr_avail_event (struct vr_used *used, u16 queue_size)
+{
+	return (u16 *)(void *)((u8 *)used->ring +
+			       sizeof used->ring[0] * queue_size);
+}
+
 #define DESC_SIZE (sizeof (struct vr_desc) * VIRTIO_NET_QUEUE_SIZE)
 #define AVAIL_SIZE (sizeof (struct vr_avail))
 #define DA_N_PAGES ((DESC_SIZE + AVAIL_SIZE + (PAGESIZE - 1)) / PAGESIZE)
@@ -436,12 +514,198 @@ virtio_net_reset_ctrl_mac (struct virtio_net *vnet)
 	vnet->multicast_filter_entries = 0;
 }
 
+static void
+virtio_net_mapcache_flush_locked (struct virtio_net_mapcache *c)
+{
+	uint i;
+
+	for (i = 0; i < 3; i++) {
+		if (c->ring_len[i])
+			unmapmem (c->ring_virt[i], c->ring_len[i]);
+		c->ring_len[i] = 0;
+	}
+	for (i = 0; i < VIRTIO_NET_MAPCACHE_NUM; i++) {
+		if (c->ent[i].len)
+			unmapmem (c->ent[i].virt, c->ent[i].len);
+		c->ent[i].len = 0;
+	}
+}
+
+/* Check whether guest addresses addr to addr + len - 1 are still
+ * translated to contiguous pages starting with pte. */
+static bool
+virtio_net_mapcache_valid (const struct mm_as *as, u64 addr, uint len,
+			   u64 pte)
+{
+	unsigned int npages, n;
+
+	npages = ((addr & PAGESIZE_MASK) + len + PAGESIZE - 1) >>
+		PAGESIZE_SHIFT;
+	n = npages;
+	if (mm_as_translate (as, &n, addr) != pte)
+		return false;
+	while (npages > n) {
+		addr += n << PAGESIZE_SHIFT;
+		pte += n << PAGESIZE_SHIFT;
+		npages -= n;
+		n = npages;
+		if (mm_as_translate (as, &n, addr) != pte)
+			return false;
+	}
+	return true;
+}
+
+/* Drop the mappings whose translations have been changed.  The cache
+ * lock must be held. */
+static void
+virtio_net_mapcache_invalidate_locked (struct virtio_net_mapcache *c)
+{
+	struct virtio_net_mapent *e;
+	uint i;
+
+	for (i = 0; i < 3; i++) {
+		if (c->ring_len[i] &&
+		    !virtio_net_mapcache_valid (c->as, c->ring_addr[i],
+						c->ring_len[i],
+						c->ring_pte[i])) {
+			unmapmem (c->ring_virt[i], c->ring_len[i]);
+			c->ring_len[i] = 0;
+		}
+	}
+	for (i = 0; i < VIRTIO_NET_MAPCACHE_NUM; i++) {
+		e = &c->ent[i];
+		if (e->len && !virtio_net_mapcache_valid (c->as, e->addr,
+							  e->len, e->pte)) {
+			unmapmem (e->virt, e->len);
+			e->len = 0;
+		}
+	}
+}
+
+static void
+virtio_net_mapcache_flush (struct virtio_net *vnet, uint n)
+{
+	struct virtio_net_mapcache *c = &vnet->mapcache[n];
+
+	spinlock_lock (&c->lock);
+	virtio_net_mapcache_flush_locked (c);
+	spinlock_unlock (&c->lock);
+}
+
+/* Map the ring of queue n.  The cache lock must be held.  The
+ * mappings are reused while the ring addresses, the queue size and
+ * the DMA address space are unchanged.  When the generation of the
+ * address space changes, for example when the guest invalidates the
+ * DMA remapping, the mappings of the queue are translated again and
+ * only the ones whose translations have been changed are dropped.
+ * The translation is read before mapping so that a change between
+ * the two is found at the next generation change. */
+static void
+virtio_net_mapcache_ring (struct virtio_net *vnet, uint n, uint queue_size,
+			  struct vr_desc **desc, struct vr_avail **avail,
+			  struct vr_used **used)
+{
+	struct virtio_net_mapcache *c = &vnet->mapcache[n];
+	struct virtio_ring *p;
+	u64 addr[3];
+	uint len[3];
+	uint i, ev;
+	u32 gen;
+
+	ev = vnet->driver_feature & VIRTIO_F_EVENT_IDX ? sizeof (u16) : 0;
+	gen = mm_as_generation (vnet->as_dma);
+	if (c->as != vnet->as_dma) {
+		virtio_net_mapcache_flush_locked (c);
+		c->as = vnet->as_dma;
+		c->gen = gen;
+	} else if (c->gen != gen) {
+		virtio_net_mapcache_invalidate_locked (c);
+		c->gen = gen;
+	}
+	if (vnet->v1) {
+		addr[0] = vnet->desc[n];
+		len[0] = sizeof **desc * queue_size;
+		addr[1] = vnet->avail[n];
+		len[1] = AVAIL_MAP_SIZE (queue_size) + ev;
+		addr[2] = vnet->used[n];
+		len[2] = USED_MAP_SIZE (queue_size) + ev;
+	} else {
+		addr[0] = (u64)vnet->queue[n] << 12;
+		len[0] = sizeof *p + ev;
+		addr[1] = addr[2] = 0;
+		len[1] = len[2] = 0;
+	}
+	for (i = 0; i < 3; i++) {
+		if (c->ring_addr[i] == addr[i] && c->ring_len[i] == len[i])
+			continue;
+		if (c->ring_len[i])
+			unmapmem (c->ring_virt[i], c->ring_len[i]);
+		c->ring_addr[i] = addr[i];
+		c->ring_len[i] = len[i];
+		if (!len[i])
+			continue;
+		c->ring_pte[i] = mm_as_translate (c->as, NULL, addr[i]);
+		c->ring_virt[i] = mapmem_as (c->as, addr[i], len[i],
+					     MAPMEM_WRITE);
+	}
+	if (vnet->v1) {
+		*desc = c->ring_virt[0];
+		*avail = c->ring_virt[1];
+		*used = c->ring_virt[2];
+	} else {
+		p = c->ring_virt[0];
+		*desc = p->desc;
+		*avail = &p->avail;
+		*used = &p->used;
+	}
+}
+
+/* Map a guest buffer.  The cache lock must be held.  The returned
+ * address is valid until the next call with the same cache. */
+static u8 *
+virtio_net_mapcache_buf (struct virtio_net_mapcache *c, u64 addr, uint len,
+			 int flags)
+{
+	struct virtio_net_mapent *e;
+	u64 base;
+
+	if (!len)
+		len = 1;
+	base = addr & ~(u64)(VIRTIO_NET_MAPCACHE_WIN - 1);
+	e = &c->ent[(base >> VIRTIO_NET_MAPCACHE_SHIFT) %
+		    VIRTIO_NET_MAPCACHE_NUM];
+	if (e->len && addr >= e->addr && addr - e->addr + len <= e->len &&
+	    (e->flags & flags) == flags)
+		return e->virt + (addr - e->addr);
+	if (e->len)
+		unmapmem (e->virt, e->len);
+	e->flags = flags;
+	/* The window may contain pages that cannot be mapped.  Map
+	 * the buffer only in that case. */
+	if (addr - base + len <= VIRTIO_NET_MAPCACHE_WIN) {
+		e->pte = mm_as_translate (c->as, NULL, base);
+		e->virt = mapmem_as (c->as, base, VIRTIO_NET_MAPCACHE_WIN,
+				     flags | MAPMEM_CANFAIL);
+		if (e->virt) {
+			e->addr = base;
+			e->len = VIRTIO_NET_MAPCACHE_WIN;
+			return e->virt + (addr - base);
+		}
+	}
+	e->pte = mm_as_translate (c->as, NULL, addr);
+	e->virt = mapmem_as (c->as, addr, len, flags);
+	e->addr = addr;
+	e->len = len;
+	return e->virt;
+}
+
 static void
 virtio_net_reset_dev (struct virtio_net *vnet)
 {
 	uint i;
 
 	for (i = 0; i < VIRTIO_N_QUEUES; i++) {
+		virtio_net_mapcache_flush (vnet, i);
 		vnet->queue[i] = 0;
 		vnet->desc[i] = 0;
 		vnet->avail[i] = 0;
@@ -460,17 +724,176 @@ virtio_net_reset_dev (struct virtio_net *vnet)
 	virtio_net_reset_ctrl_mac (vnet);
 	vnet->allow_multicast = false;
 	vnet->allow_promisc = false;
+	vnet->queue_pairs = 1;
+}
+
+/* The control queue follows the receive and transmit queues of all the
+ * queue pairs if VIRTIO_NET_F_MQ is negotiated. */
+static uint
+virtio_net_ctrl_queue (struct virtio_net *vnet)
+{
+	return vnet->driver_feature & VIRTIO_NET_F_MQ ? VIRTIO_N_QUEUES - 1 :
+		2;
 }
 
 static uint
-virtio_net_hdr_size (bool legacy)
+virtio_net_hdr_size (struct virtio_net *vnet, bool legacy)
 {
 	/* In legacy mode, 16bit field "num_buffers" is not
-	 * presented. */
-	return legacy ? sizeof (struct virtio_net_hdr) - 2 :
+	 * presented unless VIRTIO_NET_F_MRG_RXBUF is negotiated. */
+	return legacy && !(vnet->driver_feature & VIRTIO_NET_F_MRG_RXBUF) ?
+		sizeof (struct virtio_net_hdr) - 2 :
 		sizeof (struct virtio_net_hdr);
 }
 
+static u16
+virtio_net_get16 (u8 *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static void
+virtio_net_put16 (u8 *p, u16 v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static u32
+virtio_net_get32 (u8 *p)
+{
+	return (u32)virtio_net_get16 (p) << 16 | virtio_net_get16 (p + 2);
+}
+
+static void
+virtio_net_put32 (u8 *p, u32 v)
+{
+	virtio_net_put16 (p, v >> 16);
+	virtio_net_put16 (p + 2, v);
+}
+
+/* Complete a partial checksum: the field at csum_start + csum_offset
+ * holds the pseudo header sum and the rest is summed here. */
+static void
+virtio_net_csum (u8 *pkt, uint len, uint csum_start, uint csum_offset)
+{
+	u16 sum;
+
+	if (csum_start >= len || csum_offset + 2 > len - csum_start)
+		return;
+	sum = ipchecksum (&pkt[csum_start], len - csum_start);
+	if (!sum)		/* 0 means no checksum in case of UDP */
+		sum = ~0;
+	*(u16 *)(void *)&pkt[csum_start + csum_offset] = sum;
+}
+
+/* Compute TCP checksum of a segment including the pseudo header. */
+static void
+virtio_net_tcp_csum (u8 *pkt, uint len, uint ipoff, uint l4off, bool v4)
+{
+	u8 ph[40];
+	uint l4len = len - l4off, phlen;
+
+	memset (ph, 0, sizeof ph);
+	if (v4) {
+		memcpy (&ph[0], &pkt[ipoff + 12], 8);
+		ph[9] = 6;
+		virtio_net_put16 (&ph[10], l4len);
+		phlen = 12;
+	} else {
+		memcpy (&ph[0], &pkt[ipoff + 8], 32);
+		virtio_net_put32 (&ph[32], l4len);
+		ph[39] = 6;
+		phlen = 40;
+	}
+	*(u16 *)(void *)&pkt[l4off + 16] = ~ipchecksum (ph, phlen);
+	*(u16 *)(void *)&pkt[l4off + 16] = ipchecksum (&pkt[l4off], l4len);
+}
+
+/* Split a TCP packet sent with VIRTIO_NET_F_HOST_TSO4/6 into MSS
+ * sized segments in the batch buffers.  The batch is passed to
+ * recv_func when it becomes full.  Returns the new batch count. */
+static unsigned int
+virtio_net_gso (struct virtio_net *vnet, struct virtio_net_txbuf *tx, u8 *pkt,
+		uint len, struct virtio_net_hdr *h, unsigned int count,
+		void **pkts, unsigned int *pkt_sizes)
+{
+	uint ipoff = 14, l4off, hlen, mss, off, paylen, seglen;
+	u8 *seg, *ip, *tcp, tcpflags;
+	u16 id;
+	u32 seq;
+	bool v4;
+
+	switch (h->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		v4 = true;
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		v4 = false;
+		break;
+	default:
+		return count;
+	}
+	if (len > 18 && pkt[12] == 0x81 && pkt[13] == 0x00) /* VLAN */
+		ipoff = 18;
+	/* Every header field read or written below lies within hlen
+	 * bytes, and hlen is at most len and fits in tx->buf[].  A
+	 * packet failing any of these checks is dropped. */
+	l4off = h->csum_start;
+	if (l4off < ipoff + (v4 ? 20 : 40) || l4off + 20 > len)
+		return count;
+	if ((pkt[ipoff] >> 4) != (v4 ? 4 : 6))
+		return count;
+	if (v4 && ((pkt[ipoff] & 0xF) < 5 ||
+		   ipoff + (pkt[ipoff] & 0xF) * 4 > l4off))
+		return count;
+	if ((pkt[l4off + 12] >> 4) < 5)	/* TCP data offset */
+		return count;
+	hlen = l4off + (pkt[l4off + 12] >> 4) * 4;
+	mss = h->gso_size;
+	if (!mss || hlen > len || hlen + mss > sizeof tx->buf[0])
+		return count;
+	id = virtio_net_get16 (&pkt[ipoff + 4]);
+	seq = virtio_net_get32 (&pkt[l4off + 4]);
+	tcpflags = pkt[l4off + 13];
+	for (off = hlen; off < len; off += paylen) {
+		paylen = len - off;
+		if (paylen > mss)
+			paylen = mss;
+		seglen = hlen + paylen;
+		seg = tx->buf[count];
+		memcpy (seg, pkt, hlen);
+		memcpy (&seg[hlen], &pkt[off], paylen);
+		ip = &seg[ipoff];
+		tcp = &seg[l4off];
+		if (v4) {
+			virtio_net_put16 (&ip[2], seglen - ipoff);
+			virtio_net_put16 (&ip[4], id++);
+			*(u16 *)(void *)&ip[10] = 0;
+			*(u16 *)(void *)&ip[10] = ipchecksum (ip, (ip[0] & 0xF) *
+							       4);
+		} else {
+			virtio_net_put16 (&ip[4], seglen - ipoff - 40);
+		}
+		virtio_net_put32 (&tcp[4], seq + (off - hlen));
+		tcp[13] = tcpflags;
+		if (off + paylen < len)
+			tcp[13] &= ~0x09; /* FIN and PSH only in the last */
+		if (off > hlen)
+			tcp[13] &= ~0x80; /* CWR only in the first */
+		virtio_net_tcp_csum (seg, seglen, ipoff, l4off, v4);
+		pkts[count] = seg;
+		pkt_sizes[count] = seglen;
+		count++;
+		if (count == VIRTIO_NET_PKT_BATCH) {
+			vnet->recv_func (vnet, count, pkts, pkt_sizes,
+					 vnet->recv_param, NULL);
+			count = 0;
+		}
+	}
+	return count;
+}
+
 static void
 virtio_net_get_nic_info (void *handle, struct nicinfo *info)
 {
@@ -585,20 +1008,68 @@ virtio_net_untrigger_interrupt (struct virtio_net *vnet)
 	return false;
 }
 
+/* Decide whether the guest wants an interrupt after the used ring
+ * index moved from old_idx. */
+static bool
+virtio_net_intr_wanted (struct virtio_net *vnet, struct vr_avail *avail,
+			struct vr_used *used, u16 queue_size, u16 old_idx)
+{
+	u16 new_idx, event;
+
+	if (!(vnet->driver_feature & VIRTIO_F_EVENT_IDX))
+		return !(avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT);
+	/* The used index must be visible before reading used_event */
+	atomic_fence ();
+	new_idx = used->idx;
+	event = *vr_used_event (avail, queue_size);
+	return (u16)(new_idx - event - 1) < (u16)(new_idx - old_idx);
+}
+
+/* Write num_buffers of the header at the head of a descriptor chain.
+ * The header may be split into descriptors. */
 static void
-do_net_send (struct virtio_net *vnet, struct vr_desc *desc,
+virtio_net_set_num_buffers (struct virtio_net_mapcache *c,
+			    struct vr_desc *desc, u16 queue_size, u16 ring,
+			    u16 num_buffers)
+{
+	u8 v[2] = { num_buffers, num_buffers >> 8 };
+	u32 off = offsetof (struct virtio_net_hdr, num_buffers);
+	u32 ring_tmp, d, base = 0, i = 0;
+	u8 *p;
+
+	ring_tmp = ((u32)ring << 16) | 1;
+	while ((ring_tmp & 1) && i < 2) {
+		ring_tmp >>= 16;
+		d = ring_tmp % queue_size;
+		for (; i < 2 && off + i - base < desc[d].len; i++) {
+			p = virtio_net_mapcache_buf (c, desc[d].addr +
+						     (off + i - base), 1,
+						     MAPMEM_WRITE);
+			*p = v[i];
+		}
+		base += desc[d].len;
+		ring_tmp = desc[d].flags_next;
+	}
+}
+
+static void
+do_net_send (struct virtio_net *vnet, uint n, struct vr_desc *desc,
 	     struct vr_avail *avail, struct vr_used *used, u16 queue_size,
 	     bool legacy_hdr, unsigned int num_packets, void **packets,
 	     unsigned int *packet_sizes, bool print_ok)
 {
-	u16 idx_a, idx_u, ring;
-	u32 len, desc_len, i, j;
+	struct virtio_net_mapcache *c = &vnet->mapcache[n];
+	u16 idx_a, idx_u, ring, ring0, nbufs;
+	u16 used_start = used->idx;
+	u32 len, chain_len, desc_len, i, j;
 	u32 ring_tmp, d;
 	u8 *buf_ring;
 	u8 *buf;
 	int buflen;
 	bool intr = false;
-	uint desc_hdr_len = virtio_net_hdr_size (legacy_hdr);
+	bool mrg = !!(vnet->driver_feature & VIRTIO_NET_F_MRG_RXBUF);
+	bool event = !!(vnet->driver_feature & VIRTIO_F_EVENT_IDX);
+	uint desc_hdr_len = virtio_net_hdr_size (vnet, legacy_hdr);
 loop:
 	if (!num_packets--)
 		goto ret;
@@ -618,8 +1089,13 @@ loop:
 			goto ret;
 		/* Suppress interrupts.  While the used->flags is
 		 * cleared, the guest sends a notification when
-		 * updating available ring index. */
+		 * updating available ring index.  With event index,
+		 * avail_event requests the notification instead. */
 		used->flags = 0;
+		if (event) {
+			*vr_avail_event (used, queue_size) = idx_a;
+			atomic_fence ();
+		}
 		virtio_net_suppress_interrupt (vnet, true);
 		if (vnet->intr) {
 			/* In case of conflicting with
@@ -636,16 +1112,20 @@ loop:
 	}
 	used->flags = VIRTQ_USED_F_NO_NOTIFY;
 	virtio_net_suppress_interrupt (vnet, false);
-	idx_u %= queue_size;
+	len = 0;
+	nbufs = 0;
+	ring0 = avail->ring[idx_u % queue_size];
+next_chain:
+	idx_u = (u16)(used->idx + nbufs) % queue_size;
 	ring = avail->ring[idx_u];
 	ring_tmp = ((u32)ring << 16) | 1;
-	len = 0;
+	chain_len = len;
 	while (ring_tmp & 1) {
 		ring_tmp >>= 16;
 		d = ring_tmp % queue_size;
 		desc_len = desc[d].len;
-		buf_ring = mapmem_as (vnet->as_dma, desc[d].addr, desc_len,
-				      MAPMEM_WRITE);
+		buf_ring = virtio_net_mapcache_buf (c, desc[d].addr, desc_len,
+						    MAPMEM_WRITE);
 		i = 0;
 		if (len < desc_hdr_len) {
 			i = desc_hdr_len - len;
@@ -654,7 +1134,8 @@ loop:
 			if (i == desc_hdr_len) {
 				/* Fast path */
 				memset (buf_ring, 0, i);
-				if (!legacy_hdr) {
+				if (desc_hdr_len == sizeof (struct
+							    virtio_net_hdr)) {
 					struct virtio_net_hdr *h;
 					h = (struct virtio_net_hdr *)buf_ring;
 					h->num_buffers = 1;
@@ -680,111 +1161,209 @@ loop:
 			memcpy (&buf_ring[i], &buf[len - desc_hdr_len], j);
 			len += j;
 		}
-		unmapmem (buf_ring, desc_len);
 		ring_tmp = desc[d].flags_next;
 	}
+	used->ring[idx_u].id = ring;
+	used->ring[idx_u].len = len - chain_len;
+	nbufs++;
+	if (mrg && len < desc_hdr_len + buflen) {
+		/* Continue with the next descriptor chain.  If there
+		 * is none, drop the packet without updating the used
+		 * ring index. */
+		if (nbufs < queue_size && (u16)(used->idx + nbufs) !=
+		    avail->idx)
+			goto next_chain;
+		goto loop;
+	}
+	if (nbufs > 1)
+		virtio_net_set_num_buffers (c, desc, queue_size, ring0, nbufs);
 	if (0)
 		printf ("Receive %u bytes %02X:%02X:%02X:%02X:%02X:%02X"
 			" <- %02X:%02X:%02X:%02X:%02X:%02X\n", buflen,
 			buf[0], buf[1], buf[2], buf[3], buf[4], buf[5],
 			buf[6], buf[7], buf[8], buf[9], buf[10], buf[11]);
-	used->ring[idx_u].id = ring;
-	used->ring[idx_u].len = len;
 	asm volatile ("" : : : "memory");
-	used->idx++;
+	used->idx += nbufs;
 	intr = true;
 	goto loop;
 ret:
-	if (avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT)	/* No interrupt */
+	if (intr && !virtio_net_intr_wanted (vnet, avail, used, queue_size,
+					     used_start))
 		intr = false;
 	if (intr)
-		virtio_net_trigger_interrupt (vnet, 0);
+		virtio_net_trigger_interrupt (vnet, n);
 }
 
-/* Send to guest */
 static void
-virtio_net_send (void *handle, unsigned int num_packets, void **packets,
-		 unsigned int *packet_sizes, bool print_ok)
+virtio_net_send_queue (struct virtio_net *vnet, uint n,
+		       unsigned int num_packets, void **packets,
+		       unsigned int *packet_sizes, bool print_ok)
 {
-	struct virtio_net *vnet = handle;
-	struct virtio_ring *p;
+	struct virtio_net_mapcache *c = &vnet->mapcache[n];
 	struct vr_desc *desc;
 	struct vr_avail *avail;
 	struct vr_used *used;
 	uint queue_size;
 
-	if (!vnet->ready)
-		return;
-
-	queue_size = get_queue_size (vnet, 0);
+	queue_size = get_queue_size (vnet, n);
 	if (queue_size == 0) {
 		return;
 	}
 
-	if (vnet->v1) {
-		if (!vnet->queue_enable[0])
-			return;
+	if (vnet->v1 && !vnet->queue_enable[n])
+		return;
 
-		desc = mapmem_as (vnet->as_dma, vnet->desc[0],
-				  sizeof *desc * queue_size, MAPMEM_WRITE);
-		avail = mapmem_as (vnet->as_dma, vnet->avail[0],
-				   AVAIL_MAP_SIZE (queue_size), MAPMEM_WRITE);
-		used = mapmem_as (vnet->as_dma, vnet->used[0],
-				  USED_MAP_SIZE (queue_size), MAPMEM_WRITE);
+	spinlock_lock (&c->lock);
+	virtio_net_mapcache_ring (vnet, n, queue_size, &desc, &avail, &used);
+	do_net_send (vnet, n, desc, avail, used, queue_size,
+		     vnet->v1 ? vnet->v1_legacy : true, num_packets, packets,
+		     packet_sizes, print_ok);
+	spinlock_unlock (&c->lock);
+}
 
-		do_net_send (vnet, desc, avail, used, queue_size,
-			     vnet->v1_legacy, num_packets, packets,
-			     packet_sizes, print_ok);
+/* Flow hash for choosing a receive queue.  Packets of a TCP or UDP
+ * flow always go to the same queue. */
+static u32
+virtio_net_rx_hash (u8 *pkt, uint len)
+{
+	uint off = 14, l4off, i;
+	u16 type;
+	u32 h;
+	u8 proto;
 
-		unmapmem (used, USED_MAP_SIZE (queue_size));
-		unmapmem (avail, AVAIL_MAP_SIZE (queue_size));
-		unmapmem (desc, sizeof *desc * queue_size);
+	if (len < 14)
+		return 0;
+	type = virtio_net_get16 (&pkt[12]);
+	if (type == 0x8100 && len >= 18) {
+		type = virtio_net_get16 (&pkt[16]);
+		off = 18;
+	}
+	if (type == 0x0800 && len >= off + 20) {
+		h = virtio_net_get32 (&pkt[off + 12]) ^
+			virtio_net_get32 (&pkt[off + 16]);
+		proto = pkt[off + 9];
+		l4off = off + (pkt[off] & 0xF) * 4;
+		if (virtio_net_get16 (&pkt[off + 6]) & 0x3FFF)
+			proto = 0; /* Fragment */
+	} else if (type == 0x86DD && len >= off + 40) {
+		h = 0;
+		for (i = 0; i < 32; i += 4)
+			h ^= virtio_net_get32 (&pkt[off + 8 + i]);
+		proto = pkt[off + 6];
+		l4off = off + 40;
 	} else {
-		p = mapmem_as (vnet->as_dma, (u64)vnet->queue[0] << 12,
-			       sizeof *p, MAPMEM_WRITE);
+		return 0;
+	}
+	if ((proto == 6 || proto == 17) && len >= l4off + 4)
+		h ^= virtio_net_get32 (&pkt[l4off]);
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Send to guest */
+static void
+virtio_net_send (void *handle, unsigned int num_packets, void **packets,
+		 unsigned int *packet_sizes, bool print_ok)
+{
+	struct virtio_net *vnet = handle;
+	void *qpkts[VIRTIO_NET_MAX_QUEUE_PAIRS][VIRTIO_NET_PKT_BATCH];
+	unsigned int qsizes[VIRTIO_NET_MAX_QUEUE_PAIRS][VIRTIO_NET_PKT_BATCH];
+	unsigned int qnum[VIRTIO_NET_MAX_QUEUE_PAIRS];
+	uint pairs, i, q;
 
-		do_net_send (vnet, p->desc, &p->avail, &p->used, queue_size,
-			     true, num_packets, packets, packet_sizes,
-			     print_ok);
+	if (!vnet->ready)
+		return;
 
-		unmapmem (p, sizeof *p);
+	pairs = vnet->queue_pairs;
+	if (pairs <= 1) {
+		virtio_net_send_queue (vnet, 0, num_packets, packets,
+				       packet_sizes, print_ok);
+		return;
+	}
+	/* Distribute packets to receive queues of active queue
+	 * pairs by the flow hash */
+	for (q = 0; q < pairs; q++)
+		qnum[q] = 0;
+	for (i = 0; i < num_packets; i++) {
+		q = virtio_net_rx_hash (packets[i], packet_sizes[i]) % pairs;
+		qpkts[q][qnum[q]] = packets[i];
+		qsizes[q][qnum[q]] = packet_sizes[i];
+		if (++qnum[q] == VIRTIO_NET_PKT_BATCH) {
+			virtio_net_send_queue (vnet, q * 2, qnum[q], qpkts[q],
+					       qsizes[q], print_ok);
+			qnum[q] = 0;
+		}
 	}
+	for (q = 0; q < pairs; q++)
+		if (qnum[q])
+			virtio_net_send_queue (vnet, q * 2, qnum[q], qpkts[q],
+					       qsizes[q], print_ok);
 }
 
 static void
-do_net_recv (struct virtio_net *vnet, struct vr_desc *desc,
+do_net_recv (struct virtio_net *vnet, uint n, struct vr_desc *desc,
 	     struct vr_avail *avail, struct vr_used *used, u16 queue_size,
 	     bool legacy_hdr)
 {
+	struct virtio_net_mapcache *c = &vnet->mapcache[n];
+	struct virtio_net_txbuf *tx = &vnet->txbuf[n / 2];
 	u16 idx_a, idx_u, ring;
-	u32 len, desc_len, count = 0, pkt_sizes[VIRTIO_NET_PKT_BATCH];
+	u16 used_start = used->idx;
+	u32 len, desc_len, bufsize, count = 0;
+	unsigned int pkt_sizes[VIRTIO_NET_PKT_BATCH];
 	u32 ring_tmp, d;
 	u8 *buf, *buf_ring;
 	void *pkts[VIRTIO_NET_PKT_BATCH];
+	struct virtio_net_hdr *h;
 	bool intr = false;
-	uint desc_hdr_len = virtio_net_hdr_size (legacy_hdr);
+	bool gso = !!(vnet->driver_feature & (VIRTIO_NET_F_HOST_TSO4 |
+					      VIRTIO_NET_F_HOST_TSO6));
+	uint desc_hdr_len = virtio_net_hdr_size (vnet, legacy_hdr);
 
 	idx_a = avail->idx;
+again:
 	while (idx_a != used->idx) {
 		idx_u = used->idx % queue_size;
 		ring = avail->ring[idx_u];
+		/* Large packets sent with TSO are gathered in gso_buf
+		 * and segmented. */
+		buf = tx->buf[count];
+		bufsize = sizeof tx->buf[count];
+		if (gso) {
+			ring_tmp = ((u32)ring << 16) | 1;
+			len = 0;
+			while ((ring_tmp & 1) && len <= bufsize) {
+				ring_tmp >>= 16;
+				d = ring_tmp % queue_size;
+				desc_len = desc[d].len;
+				len += desc_len < VIRTIO_NET_GSO_BUF_SIZE ?
+					desc_len : VIRTIO_NET_GSO_BUF_SIZE;
+				ring_tmp = desc[d].flags_next;
+			}
+			if (len > bufsize) {
+				buf = tx->gso_buf;
+				bufsize = VIRTIO_NET_GSO_BUF_SIZE;
+			}
+		}
 		ring_tmp = ((u32)ring << 16) | 1;
 		len = 0;
-		buf = vnet->buf[count];
 		while (ring_tmp & 1) {
 			ring_tmp >>= 16;
 			d = ring_tmp % queue_size;
 			desc_len = desc[d].len;
 			/* Detect unsupported MTU setting or corrupted
 			 * case like 0xFFFFFFFF. */
-			if (desc_len > sizeof vnet->buf[count] - len) {
+			if (desc_len > bufsize - len) {
 				len = 0;
 				break;
 			}
-			buf_ring = mapmem_as (vnet->as_dma, desc[d].addr,
-					      desc_len, 0);
+			buf_ring = virtio_net_mapcache_buf (c, desc[d].addr,
+							    desc_len, 0);
 			memcpy (&buf[len], buf_ring, desc_len);
-			unmapmem (buf_ring, desc_len);
 			len += desc_len;
 			ring_tmp = desc[d].flags_next;
 		}
@@ -804,31 +1383,66 @@ do_net_recv (struct virtio_net *vnet, struct vr_desc *desc,
 		asm volatile ("" : : : "memory");
 		used->idx++;
 		intr = true;
-		if (len > desc_hdr_len) {
-			pkts[count] = &buf[desc_hdr_len];
-			pkt_sizes[count] = len - desc_hdr_len;
-			count++;
-			if (count == VIRTIO_NET_PKT_BATCH) {
-				vnet->recv_func (vnet, count, pkts, pkt_sizes,
-						 vnet->recv_param, NULL);
-				count = 0;
+		if (len <= desc_hdr_len)
+			continue;
+		h = (struct virtio_net_hdr *)buf;
+		buf += desc_hdr_len;
+		len -= desc_hdr_len;
+		if (h->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+			/* Segments are written to tx->buf[count] and
+			 * later, so a small packet gathered there is
+			 * moved to gso_buf first. */
+			if (buf != &tx->gso_buf[desc_hdr_len]) {
+				memcpy (tx->gso_buf, h, desc_hdr_len + len);
+				h = (struct virtio_net_hdr *)tx->gso_buf;
+				buf = &tx->gso_buf[desc_hdr_len];
 			}
+			count = virtio_net_gso (vnet, tx, buf, len, h, count,
+						pkts, pkt_sizes);
+			continue;
 		}
+		if (h->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+			virtio_net_csum (buf, len, h->csum_start,
+					 h->csum_offset);
+		if (len > sizeof tx->buf[count])
+			continue;
+		if (buf != &tx->buf[count][desc_hdr_len]) {
+			memcpy (tx->buf[count], buf, len);
+			buf = tx->buf[count];
+		}
+		pkts[count] = buf;
+		pkt_sizes[count] = len;
+		count++;
+		if (count == VIRTIO_NET_PKT_BATCH) {
+			vnet->recv_func (vnet, count, pkts, pkt_sizes,
+					 vnet->recv_param, NULL);
+			count = 0;
+		}
+	}
+	if (vnet->driver_feature & VIRTIO_F_EVENT_IDX) {
+		/* Ask for a notification of the next packet and check
+		 * packets added meanwhile */
+		*vr_avail_event (used, queue_size) = used->idx;
+		atomic_fence ();
+		idx_a = avail->idx;
+		if (idx_a != used->idx)
+			goto again;
 	}
 	if (count)
 		vnet->recv_func (vnet, count, pkts, pkt_sizes,
 				 vnet->recv_param, NULL);
-	if (avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT)
+	if (intr && !virtio_net_intr_wanted (vnet, avail, used, queue_size,
+					     used_start))
 		intr = false;
 	if (intr)
-		virtio_net_trigger_interrupt (vnet, 1);
+		virtio_net_trigger_interrupt (vnet, n);
 }
 
 /* Receive from guest */
 static void
-virtio_net_recv (struct virtio_net *vnet)
+virtio_net_recv (struct virtio_net *vnet, uint n)
 {
-	struct virtio_ring *p;
+	struct virtio_net_mapcache *c = &vnet->mapcache[n];
 	struct vr_desc *desc;
 	struct vr_avail *avail;
 	struct vr_used *used;
@@ -837,37 +1451,19 @@ virtio_net_recv (struct virtio_net *vnet)
 	if (!vnet->ready)
 		return;
 
-	queue_size = get_queue_size (vnet, 1);
+	queue_size = get_queue_size (vnet, n);
 	if (queue_size == 0) {
 		return;
 	}
 
-	if (vnet->v1) {
-		if (!vnet->queue_enable[1])
-			return;
-
-		desc = mapmem_as (vnet->as_dma, vnet->desc[1],
-				  sizeof *desc * queue_size, MAPMEM_WRITE);
-		avail = mapmem_as (vnet->as_dma, vnet->avail[1],
-				   AVAIL_MAP_SIZE (queue_size), MAPMEM_WRITE);
-		used = mapmem_as (vnet->as_dma, vnet->used[1],
-				  USED_MAP_SIZE (queue_size), MAPMEM_WRITE);
-
-		do_net_recv (vnet, desc, avail, used, queue_size,
-			     vnet->v1_legacy);
-
-		unmapmem (used, USED_MAP_SIZE (queue_size));
-		unmapmem (avail, AVAIL_MAP_SIZE (queue_size));
-		unmapmem (desc, sizeof *desc * queue_size);
-	} else {
-		p = mapmem_as (vnet->as_dma, (u64)vnet->queue[1] << 12,
-			       sizeof *p, MAPMEM_WRITE);
-
-		do_net_recv (vnet, p->desc, &p->avail, &p->used, queue_size,
-			     true);
+	if (vnet->v1 && !vnet->queue_enable[n])
+		return;
 
-		unmapmem (p, sizeof *p);
-	}
+	spinlock_lock (&c->lock);
+	virtio_net_mapcache_ring (vnet, n, queue_size, &desc, &avail, &used);
+	do_net_recv (vnet, n, desc, avail, used, queue_size,
+		     vnet->v1 ? vnet->v1_legacy : true);
+	spinlock_unlock (&c->lock);
 }
 
 static u8
@@ -999,6 +1595,30 @@ end:
 	return ack;
 }
 
+static u8
+process_ctrl_mq_cmd (struct virtio_net *vnet, u8 *cmd, unsigned int cmd_size)
+{
+	u8 ack = VIRTIO_NET_ACK_OK;
+	u16 pairs;
+
+	if (cmd[1] != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || cmd_size < 5) {
+		printf ("virtio_net: unsupported code %u for "
+			"VIRTIO_NET_CTRL_MQ\n", cmd[1]);
+		ack = VIRTIO_NET_ACK_ERR;
+		goto end;
+	}
+	pairs = cmd[2] | cmd[3] << 8;
+	if (pairs < 1 || pairs > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+		printf ("virtio_net: invalid number of queue pairs %u\n",
+			pairs);
+		ack = VIRTIO_NET_ACK_ERR;
+		goto end;
+	}
+	vnet->queue_pairs = pairs;
+end:
+	return ack;
+}
+
 static u8
 process_ctrl_cmd (struct virtio_net *vnet, u8 *cmd, unsigned int cmd_size)
 {
@@ -1018,6 +1638,9 @@ process_ctrl_cmd (struct virtio_net *vnet, u8 *cmd, unsigned int cmd_size)
 	case VIRTIO_NET_CTRL_MAC:
 		ack = process_ctrl_mac_cmd (vnet, cmd, cmd_size);
 		break;
+	case VIRTIO_NET_CTRL_MQ:
+		ack = process_ctrl_mq_cmd (vnet, cmd, cmd_size);
+		break;
 	default:
 		printf ("virtio_net: unsupport class %u\n", cmd[0]);
 		ack = VIRTIO_NET_ACK_ERR;
@@ -1027,10 +1650,11 @@ end:
 }
 
 static void
-do_net_ctrl (struct virtio_net *vnet, struct vr_desc *desc,
+do_net_ctrl (struct virtio_net *vnet, uint n, struct vr_desc *desc,
 	     struct vr_avail *avail, struct vr_used *used, u16 queue_size)
 {
 	u16 idx_a, idx_u, ring;
+	u16 used_start = used->idx;
 	u32 len, desc_len, copied;
 	u32 ring_tmp, d;
 	u8 *buf_ring, *cmd, ack;
@@ -1095,16 +1719,18 @@ do_net_ctrl (struct virtio_net *vnet, struct vr_desc *desc,
 		used->idx++;
 		intr = true;
 	}
-	if (avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT)
+	if (intr && !virtio_net_intr_wanted (vnet, avail, used, queue_size,
+					     used_start))
 		intr = false;
 	if (intr)
-		virtio_net_trigger_interrupt (vnet, 2);
+		virtio_net_trigger_interrupt (vnet, n);
 }
 
 static void
 virtio_net_ctrl (struct virtio_net *vnet)
 {
-	struct virtio_ring *p;
+	uint n = virtio_net_ctrl_queue (vnet);
+	struct virtio_net_mapcache *c = &vnet->mapcache[n];
 	struct vr_desc *desc;
 	struct vr_avail *avail;
 	struct vr_used *used;
@@ -1116,35 +1742,18 @@ virtio_net_ctrl (struct virtio_net *vnet)
 	if (!(vnet->driver_feature & VIRTIO_NET_F_CTRL_VQ))
 		return;
 
-	queue_size = get_queue_size (vnet, 2);
+	queue_size = get_queue_size (vnet, n);
 	if (queue_size == 0) {
 		return;
 	}
 
-	if (vnet->v1) {
-		if (!vnet->queue_enable[2])
-			return;
-
-		desc = mapmem_as (vnet->as_dma, vnet->desc[2],
-				  sizeof *desc * queue_size, MAPMEM_WRITE);
-		avail = mapmem_as (vnet->as_dma, vnet->avail[2],
-				   AVAIL_MAP_SIZE (queue_size), MAPMEM_WRITE);
-		used = mapmem_as (vnet->as_dma, vnet->used[2],
-				  USED_MAP_SIZE (queue_size), MAPMEM_WRITE);
-
-		do_net_ctrl (vnet, desc, avail, used, queue_size);
-
-		unmapmem (used, USED_MAP_SIZE (queue_size));
-		unmapmem (avail, AVAIL_MAP_SIZE (queue_size));
-		unmapmem (desc, sizeof *desc * queue_size);
-	} else {
-		p = mapmem_as (vnet->as_dma, (u64)vnet->queue[2] << 12,
-			       sizeof *p, MAPMEM_WRITE);
-
-		do_net_ctrl (vnet, p->desc, &p->avail, &p->used, queue_size);
+	if (vnet->v1 && !vnet->queue_enable[n])
+		return;
 
-		unmapmem (p, sizeof *p);
-	}
+	spinlock_lock (&c->lock);
+	virtio_net_mapcache_ring (vnet, n, queue_size, &desc, &avail, &used);
+	do_net_ctrl (vnet, n, desc, avail, used, queue_size);
+	spinlock_unlock (&c->lock);
 }
 
 static void
@@ -1242,6 +1851,12 @@ eval_status (struct virtio_net *vnet, bool v1, u8 new_status)
 				"VIRTIO_NET_F_CTRL_VQ\n");
 			return;
 		}
+		if (vnet->driver_feature & VIRTIO_NET_F_MQ &&
+		    !(vnet->driver_feature & VIRTIO_NET_F_CTRL_VQ)) {
+			printf ("virtio_net: VIRTIO_NET_F_MQ requires "
+				"VIRTIO_NET_F_CTRL_VQ\n");
+			return;
+		}
 	}
 	if (new_status & VIRTIO_STATUS_DRIVER_OK) {
 		vnet->v1 = v1;
@@ -1330,6 +1945,8 @@ ccfg_queue_msix_vector (struct virtio_net *vnet, bool wr, union mem *data,
 	spinlock_lock (&vnet->msix_lock);
 	if (wr) {
 		u16 v = data->word;
+		if (v >= VIRTIO_NET_MSIX_N_VECTORS)
+			v = 0xFFFF;
 		vnet->msix_quevec[n] = v;
 		vnet->msix_vector_change (vnet->msix_param, n, ~v ? v : -1);
 	} else {
@@ -1345,9 +1962,13 @@ ccfg_queue_enable (struct virtio_net *vnet, bool wr, union mem *data,
 	u16 n = vnet->selected_queue;
 	if (n >= VIRTIO_N_QUEUES)
 		return;
-	if (wr)
+	if (wr) {
+		/* Mappings are dropped when the queue is enabled or
+		 * disabled, i.e. at queue reset */
+		if (vnet->queue_enable[n] != !!data->word)
+			virtio_net_mapcache_flush (vnet, n);
 		vnet->queue_enable[n] = data->word;
-	else
+	} else
 		data->word = vnet->queue_enable[n];
 }
 
@@ -1365,10 +1986,12 @@ ccfg_queue_legacy (struct virtio_net *vnet, bool wr, union mem *data,
 {
 	u16 n = vnet->selected_queue;
 	if (n < VIRTIO_N_QUEUES) {
-		if (wr)
+		if (wr) {
+			virtio_net_mapcache_flush (vnet, n);
 			vnet->queue[n] = data->dword;
-		else
+		} else {
 			data->dword = vnet->queue[n];
+		}
 	}
 }
 
@@ -1412,18 +2035,21 @@ static void
 queue_notify (struct virtio_net *vnet, bool wr, union mem *data,
 	      const void *extra_info)
 {
+	u16 n, ctrlq;
+
 	if (wr) {
-		switch (data->word) {
-		case 0:
-			virtio_net_suppress_interrupt (vnet, false);
-			break;
-		case 1:
-			virtio_net_recv (vnet);
-			break;
-		case 2:
+		/* Even numbers are receive queues and odd numbers are
+		 * transmit queues */
+		n = data->word;
+		ctrlq = virtio_net_ctrl_queue (vnet);
+		if (n == ctrlq)
 			virtio_net_ctrl (vnet);
-			break;
-		}
+		else if (n > ctrlq)
+			;
+		else if (n & 1)
+			virtio_net_recv (vnet, n);
+		else
+			virtio_net_suppress_interrupt (vnet, false);
 	}
 }
 
@@ -1447,6 +2073,22 @@ dcfg_mac_addr (struct virtio_net *vnet, bool wr, union mem *data,
 		memcpy (data, vnet->macaddr, 6);
 }
 
+static void
+dcfg_status (struct virtio_net *vnet, bool wr, union mem *data,
+	     const void *extra_info)
+{
+	if (!wr)
+		data->word = 0;
+}
+
+static void
+dcfg_max_virtqueue_pairs (struct virtio_net *vnet, bool wr, union mem *data,
+			  const void *extra_info)
+{
+	if (!wr)
+		data->word = VIRTIO_NET_MAX_QUEUE_PAIRS;
+}
+
 static enum dres_reg_ret_t
 virtio_net_iohandler (const struct dres_reg *m, void *handle, phys_t offset,
 		      bool wr, void *buf, uint len)
@@ -1461,6 +2103,8 @@ virtio_net_iohandler (const struct dres_reg *m, void *handle, phys_t offset,
 		{ 1, legacy_device_status },
 		{ 1, isr_status },
 		{ 6, dcfg_mac_addr },
+		{ 2, dcfg_status },
+		{ 2, dcfg_max_virtqueue_pairs },
 		{ 0, NULL },
 	};
 	static const struct handle_io_data d_msix[] = {
@@ -1475,6 +2119,8 @@ virtio_net_iohandler (const struct dres_reg *m, void *handle, phys_t offset,
 		{ 2, ccfg_msix_config },
 		{ 2, ccfg_queue_msix_vector },
 		{ 6, dcfg_mac_addr },
+		{ 2, dcfg_status },
+		{ 2, dcfg_max_virtqueue_pairs },
 		{ 0, NULL },
 	};
 	struct virtio_net *vnet = handle;
@@ -1550,6 +2196,8 @@ handle_dev_cfg (struct virtio_net *vnet, bool wr, u32 iosize, u32 offset,
 {
 	static const struct handle_io_data d[] = {
 		{ 6, dcfg_mac_addr },
+		{ 2, dcfg_status },
+		{ 2, dcfg_max_virtqueue_pairs },
 		{ 0, NULL },
 	};
 	handle_io (vnet, wr, iosize, offset, data, d);
@@ -1823,8 +2471,9 @@ pci_handle_msix (struct virtio_net *vnet, bool wr, union mem *data,
 		}
 	} else {
 		data->dword = 0x11 | VIRTIO_COMMON_CFG_CAP_OFFSET << 8 |
-			      (2 | (vnet->msix_enabled ? 0x8000 : 0) |
-			      (vnet->msix_mask ? 0x4000 : 0)) << 16;
+			      ((VIRTIO_NET_MSIX_N_VECTORS - 1) |
+			       (vnet->msix_enabled ? 0x8000 : 0) |
+			       (vnet->msix_mask ? 0x4000 : 0)) << 16;
 	}
 }
 
@@ -1941,6 +2590,17 @@ virtio_net_set_multifunction (void *handle, int enable)
 	vnet->multifunction = enable;
 }
 
+void
+virtio_net_set_event_idx (void *handle, bool enable)
+{
+	struct virtio_net *vnet = handle;
+
+	if (enable)
+		vnet->device_feature |= VIRTIO_F_EVENT_IDX;
+	else
+		vnet->device_feature &= ~VIRTIO_F_EVENT_IDX;
+}
+
 struct msix_table *
 virtio_net_set_msix (void *handle,
 		     void (*msix_disable) (void *msix_param),
@@ -2093,9 +2753,16 @@ virtio_net_init (struct nicfunc **func, u8 *macaddr,
 	memset (&vnet->pci_cfg, 0, sizeof vnet->pci_cfg);
 	memset (&vnet->msix_table_entry, 0, sizeof vnet->msix_table_entry);
 	spinlock_init (&vnet->msix_lock);
-	for (i = 0; i < VIRTIO_N_QUEUES; i++) {
+	for (i = 0; i < VIRTIO_N_QUEUES; i++)
 		vnet->msix_quevec[i] = 0xFFFF;
+	for (i = 0; i < VIRTIO_NET_MSIX_N_VECTORS; i++)
 		vnet->msix_table_entry[i].mask = 1;
+	for (i = 0; i < VIRTIO_NET_MAX_QUEUE_PAIRS; i++)
+		vnet->txbuf[i].gso_buf = alloc (VIRTIO_NET_GSO_BUF_SIZE);
+	memset (&vnet->mapcache, 0, sizeof vnet->mapcache);
+	for (i = 0; i < VIRTIO_N_QUEUES; i++) {
+		spinlock_init (&vnet->mapcache[i].lock);
+		vnet->mapcache[i].as = as_dma;
 	}
 	virtio_net_reset_dev (vnet);
 	*func = &virtio_net_func;
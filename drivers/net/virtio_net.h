@@ -36,12 +36,18 @@ struct pci_bar_info;
 struct pci_device;
 struct dres_reg;
 
+/* Queue pairs offered with VIRTIO_NET_F_MQ.  The control queue comes
+ * after them. */
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 4
+#define VIRTIO_NET_N_QUEUES (VIRTIO_NET_MAX_QUEUE_PAIRS * 2 + 1)
+
 #ifdef VIRTIO_NET
 void virtio_net_handle_config_read (void *handle, u8 iosize, u16 offset,
 				    union mem *data);
 void virtio_net_handle_config_write (void *handle, u8 iosize, u16 offset,
 				     union mem *data);
 void virtio_net_set_multifunction (void *handle, int enable);
+void virtio_net_set_event_idx (void *handle, bool enable);
 struct msix_table *
 virtio_net_set_msix (void *handle,
 		     void (*msix_disable) (void *msix_param),
@@ -90,6 +96,11 @@ virtio_net_set_multifunction (void *handle, int enable)
 {
 }
 
+static inline void
+virtio_net_set_event_idx (void *handle, bool enable)
+{
+}
+
 static inline struct msix_table *
 virtio_net_set_msix (void *handle,
 		     void (*msix_disable) (void *msix_param),
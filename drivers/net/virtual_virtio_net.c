@@ -53,7 +53,7 @@ struct data {
 	void *virtio_net;
 	u8 macaddr[6];
 	const struct mm_as *as_dma;
-	int msix_qvec[3];
+	int msix_qvec[VIRTIO_NET_N_QUEUES];
 	struct msix_table *msix_tbl;
 	pci_config_address_t address;
 };
@@ -127,7 +127,7 @@ virtual_virtio_net_msix_vector_change (void *param, unsigned int queue,
 {
 	struct data *d = param;
 
-	if (queue < 3)
+	if (queue < VIRTIO_NET_N_QUEUES)
 		d->msix_qvec[queue] = vector;
 }
 
@@ -137,7 +137,7 @@ virtual_virtio_net_msix_generate (void *param, unsigned int queue)
 	struct data *d = param;
 	struct msix_table m = { 0, 0, 0, 1 };
 
-	if (queue < 3)
+	if (queue < VIRTIO_NET_N_QUEUES && d->msix_qvec[queue] >= 0)
 		m = d->msix_tbl[d->msix_qvec[queue]];
 	if (!(m.mask & 1))
 		pci_arch_msi_to_ipi (d->address, d->as_dma, m.addr, m.upper,
@@ -157,6 +157,7 @@ virtual_virtio_net_new (struct pci_virtual_device *dev)
 	struct data *d = alloc (sizeof *d);
 	struct nicfunc *virtio_net_func;
 	static u8 devcount;
+	int i;
 
 	dev->host = d;
 	if (dev->driver_options[0] &&
@@ -178,10 +179,12 @@ virtual_virtio_net_new (struct pci_virtual_device *dev)
 					 virtual_virtio_net_intr_enable, d);
 	d->address = dev->address;
 	if (d->virtio_net) {
+		if (dev->driver_options[2] &&
+		    !pci_driver_option_get_bool (dev->driver_options[2], NULL))
+			virtio_net_set_event_idx (d->virtio_net, false);
 		d->as_dma = dev->as_dma;
-		d->msix_qvec[0] = -1;
-		d->msix_qvec[1] = -1;
-		d->msix_qvec[2] = -1;
+		for (i = 0; i < VIRTIO_NET_N_QUEUES; i++)
+			d->msix_qvec[i] = -1;
 		/* BAR5 for MSI-X tables. */
 		d->msix_tbl = virtio_net_set_msix
 			(d->virtio_net,
@@ -224,7 +227,7 @@ virtual_virtio_net_config_write (struct pci_virtual_device *dev, u8 iosize,
 static struct pci_virtual_driver virtual_virtio_net_driver = {
 	.name		= "virtio-net",
 	.longname	= "virtio-net virtual driver",
-	.driver_options	= "tty,net",
+	.driver_options	= "tty,net,eventidx",
 	.new		= virtual_virtio_net_new,
 	.config_read	= virtual_virtio_net_config_read,
 	.config_write	= virtual_virtio_net_config_write,
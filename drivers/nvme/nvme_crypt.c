@@ -34,20 +34,43 @@
  */
 
 #include <core.h>
+#include <core/debug.h>
 #include <storage.h>
 #include "nvme_io.h"
 
 static uint storage_id;
+static struct nvme_crypt_meta *crypt_meta_list;
+static spinlock_t crypt_meta_list_lock;
+
+#define FETCHING_THRESHOLD (32)
+
+/*
+ * Reads up to this size are decrypted directly into the guest buffer
+ * piece by piece. Larger reads are decrypted in place with one
+ * storage_handle_sectors() call, which the storage splits into 64 KiB
+ * chunks processed in parallel, and then copied to the guest buffer.
+ */
+#define DECRYPT_SCATTER_MAX_NBYTES (64 * 1024)
+
+/* Memory kept for the per-queue DMA buffer pools of a controller */
+#define DMABUF_POOL_MAX_NBYTES (8 * 1024 * 1024)
 
 struct nvme_crypt_meta {
+	struct nvme_crypt_meta *next;
 	struct nvme_host *host;
 	struct storage_device **devices;
+	struct nvme_io_dmabuf_pool **dmabuf_pools; /* Indexed by queue ID */
+	u16 n_dmabuf_pools;
+	u64 n_unpooled;		/* Allocations without a pool */
+	struct req_meta *req_meta_free;
 	uint id;
 	uint n_intercepted_reqs;
 	spinlock_t lock;
 };
 
 struct req_meta {
+	struct req_meta *next;
+	struct nvme_crypt_meta *crypt_meta;
 	struct nvme_request *g_req; /* soft reference */
 	struct nvme_io_g_buf *g_buf;
 	struct nvme_io_dmabuf *dmabuf;
@@ -57,14 +80,131 @@ struct req_meta {
 	u8 write;
 };
 
+/* req_meta is kept in a per-controller free list.  At most
+ * FETCHING_THRESHOLD of them are in use at the same time, so the list
+ * is filled by init() and alloc() is rarely called. */
+static struct req_meta *
+alloc_req_meta (struct nvme_crypt_meta *crypt_meta)
+{
+	struct req_meta *req_meta;
+
+	spinlock_lock (&crypt_meta->lock);
+	req_meta = crypt_meta->req_meta_free;
+	if (req_meta)
+		crypt_meta->req_meta_free = req_meta->next;
+	crypt_meta->n_intercepted_reqs++;
+	spinlock_unlock (&crypt_meta->lock);
+	if (!req_meta)
+		req_meta = alloc (sizeof (*req_meta));
+	req_meta->crypt_meta = crypt_meta;
+	return req_meta;
+}
+
 static void
 free_req_meta (struct req_meta *req_meta)
 {
+	struct nvme_crypt_meta *crypt_meta = req_meta->crypt_meta;
+
 	if (req_meta->g_buf)
 		nvme_io_free_g_buf (req_meta->g_buf);
 	if (req_meta->dmabuf)
 		nvme_io_free_dmabuf (req_meta->dmabuf);
-	free (req_meta);
+	spinlock_lock (&crypt_meta->lock);
+	req_meta->next = crypt_meta->req_meta_free;
+	crypt_meta->req_meta_free = req_meta;
+	ASSERT (crypt_meta->n_intercepted_reqs > 0);
+	crypt_meta->n_intercepted_reqs--;
+	spinlock_unlock (&crypt_meta->lock);
+}
+
+static u64
+get_max_req_nbytes (struct nvme_host *host, uint n_ns)
+{
+	u64 max_nbytes = 0;
+	uint i;
+
+	for (i = 0; i < n_ns; i++) {
+		u32 lba_nbytes;
+		u16 max_n_lbas;
+		if (nvme_io_get_lba_nbytes (host, i + 1, &lba_nbytes) ||
+		    nvme_io_get_max_n_lbas (host, i + 1, &max_n_lbas))
+			continue;
+		if (max_nbytes < (u64)max_n_lbas * lba_nbytes)
+			max_nbytes = (u64)max_n_lbas * lba_nbytes;
+	}
+
+	return max_nbytes;
+}
+
+/*
+ * Preallocate DMA buffers for the largest possible request so that
+ * intercept_rw() usually does not allocate anything. The buffers are
+ * spread across I/O queues within DMABUF_POOL_MAX_NBYTES. The number of
+ * intercepted requests is limited by FETCHING_THRESHOLD, so more
+ * buffers than that are never used at the same time.
+ */
+static void
+init_dmabuf_pools (struct nvme_crypt_meta *crypt_meta, uint n_ns)
+{
+	u64 buf_nbytes = get_max_req_nbytes (crypt_meta->host, n_ns);
+	if (buf_nbytes == 0)
+		return;
+	buf_nbytes = (buf_nbytes + (PAGE_NBYTES - 1)) & ~(u64)(PAGE_NBYTES - 1);
+
+	u16 n_queues;
+	if (nvme_io_get_max_n_io_queues (crypt_meta->host, &n_queues))
+		return;
+
+	uint n_bufs = DMABUF_POOL_MAX_NBYTES / buf_nbytes;
+	if (n_bufs > FETCHING_THRESHOLD)
+		n_bufs = FETCHING_THRESHOLD;
+	if (n_bufs == 0)
+		n_bufs = 1;
+
+	uint n_bufs_per_queue = n_bufs / n_queues;
+	if (n_bufs_per_queue == 0)
+		n_bufs_per_queue = 1;
+
+	uint n_pools = n_bufs / n_bufs_per_queue;
+	if (n_pools > n_queues)
+		n_pools = n_queues;
+
+	/* Queue ID 0 is the admin queue */
+	crypt_meta->dmabuf_pools = alloc (sizeof (void *) * (n_pools + 1));
+	crypt_meta->dmabuf_pools[0] = NULL;
+	uint i;
+	for (i = 1; i <= n_pools; i++)
+		crypt_meta->dmabuf_pools[i] =
+			nvme_io_alloc_dmabuf_pool (buf_nbytes,
+						   n_bufs_per_queue);
+	crypt_meta->n_dmabuf_pools = n_pools;
+
+	printf ("NVMe encryption DMA buffer pools: %u queues,"
+		" %u x %llu bytes each\n", n_pools, n_bufs_per_queue,
+		buf_nbytes);
+}
+
+/* Queues share the pools if there are fewer pools than queues.
+ * Allocations without a pool are counted as misses. */
+static struct nvme_io_dmabuf *
+alloc_dmabuf (struct nvme_crypt_meta *crypt_meta, struct nvme_request *g_req,
+	      u64 nbytes)
+{
+	struct nvme_io_dmabuf_pool *pool = NULL;
+	u16 queue_id, n_pools = crypt_meta->n_dmabuf_pools;
+
+	if (nvme_io_req_queue_id (g_req, &queue_id))
+		queue_id = 1;
+	if (n_pools)
+		pool = crypt_meta->dmabuf_pools[1 + (queue_id + n_pools - 1) %
+						n_pools];
+	if (!pool) {
+		spinlock_lock (&crypt_meta->lock);
+		crypt_meta->n_unpooled++;
+		spinlock_unlock (&crypt_meta->lock);
+	}
+
+	return nvme_io_pool_alloc_dmabuf (pool, nbytes);
 }
 
 static int
@@ -94,6 +234,16 @@ init (void *interceptor)
 						      i,
 						      NULL,
 						      NULL);
+
+	init_dmabuf_pools (crypt_meta, n_ns);
+
+	for (i = 0; i < FETCHING_THRESHOLD; i++) {
+		struct req_meta *req_meta = alloc (sizeof (*req_meta));
+		spinlock_lock (&crypt_meta->lock);
+		req_meta->next = crypt_meta->req_meta_free;
+		crypt_meta->req_meta_free = req_meta;
+		spinlock_unlock (&crypt_meta->lock);
+	}
 end:
 	return NVME_IO_RESUME_FETCHING_GUEST_CMDS;
 }
@@ -118,6 +268,66 @@ do_buffer_hook (struct storage_device *storage_device,
 				dmabuf->buf);
 }
 
+struct decrypt_scatter {
+	struct storage_device *storage_device;
+	u8 *buf;
+	u64 start_lba;
+	uint lba_nbytes;
+	u64 inplace_end; /* End of sectors decrypted in buf */
+};
+
+static void
+decrypt_sectors (struct decrypt_scatter *ds, u8 *dst, u64 offset,
+		 uint n_lbas)
+{
+	struct storage_access access;
+	access.rw    = 0;
+	access.lba   = ds->start_lba + offset / ds->lba_nbytes;
+	access.count = n_lbas;
+	access.sector_size = ds->lba_nbytes;
+
+	storage_handle_sectors (ds->storage_device,
+				&access,
+				ds->buf + offset,
+				dst);
+}
+
+/*
+ * Decrypt from the DMA buffer directly into a piece of the guest
+ * buffer. A sector crossing a piece boundary is decrypted in place in
+ * the DMA buffer and then copied.
+ */
+static void
+decrypt_scatter_piece (void *arg, u8 *g_ptr, u64 g_buf_offset, u64 nbytes)
+{
+	struct decrypt_scatter *ds = arg;
+
+	u64 pos = g_buf_offset;
+	u64 end = g_buf_offset + nbytes;
+
+	while (pos < end) {
+		if (pos < ds->inplace_end) {
+			u64 n = (end < ds->inplace_end ? end :
+				 ds->inplace_end) - pos;
+			memcpy (g_ptr + (pos - g_buf_offset), ds->buf + pos,
+				n);
+			pos += n;
+			continue;
+		}
+
+		u64 n_lbas = (end - pos) / ds->lba_nbytes;
+		if (n_lbas > 0) {
+			decrypt_sectors (ds, g_ptr + (pos - g_buf_offset), pos,
+					 n_lbas);
+			pos += n_lbas * ds->lba_nbytes;
+			continue;
+		}
+
+		decrypt_sectors (ds, ds->buf + pos, pos, 1);
+		ds->inplace_end = pos + ds->lba_nbytes;
+	}
+}
+
 static void
 buffer_hook (struct nvme_crypt_meta *crypt_meta,
 	     struct req_meta *req_meta,
@@ -146,27 +356,34 @@ buffer_hook (struct nvme_crypt_meta *crypt_meta,
 			     	req_meta->n_lbas,
 			     	lba_nbytes,
 			     	write);
-	} else {
-		/* Decrypt and copy back */
+	} else if (nbytes > DECRYPT_SCATTER_MAX_NBYTES) {
+		/* Decrypt in place and copy back */
 		do_buffer_hook (crypt_meta->devices[device_id],
 				req_meta->dmabuf,
-			     	req_meta->start_lba,
-			     	req_meta->n_lbas,
-			     	lba_nbytes,
-			     	write);
+				req_meta->start_lba,
+				req_meta->n_lbas,
+				lba_nbytes,
+				write);
 		nvme_io_memcpy_g_buf (req_meta->g_buf,
 				      req_meta->dmabuf->buf,
 				      nbytes,
 				      0,
 				      write);
+	} else {
+		/* Decrypt into the guest buffer directly */
+		struct decrypt_scatter ds;
+		ds.storage_device = crypt_meta->devices[device_id];
+		ds.buf = req_meta->dmabuf->buf;
+		ds.start_lba = req_meta->start_lba;
+		ds.lba_nbytes = lba_nbytes;
+		ds.inplace_end = 0;
+		nvme_io_g_buf_foreach (req_meta->g_buf,
+				       nbytes,
+				       decrypt_scatter_piece,
+				       &ds);
 	}
 }
 
-struct req_cb_data {
-	struct nvme_crypt_meta *crypt_meta;
-	struct req_meta *req_meta;
-};
-
 static void
 req_callback (struct nvme_host *host,
 	      u8 status_type,
@@ -174,12 +391,8 @@ req_callback (struct nvme_host *host,
 	      u32 cmd_specific,
 	      void *arg)
 {
-	struct req_cb_data *cb_data = arg;
-
-	struct nvme_crypt_meta *crypt_meta = cb_data->crypt_meta;
-	struct req_meta *req_meta = cb_data->req_meta;
-
-	free (cb_data);
+	struct req_meta *req_meta = arg;
+	struct nvme_crypt_meta *crypt_meta = req_meta->crypt_meta;
 
 	if (!req_meta->write) {
 		if (status_type == 0 && status == 0)
@@ -189,11 +402,6 @@ req_callback (struct nvme_host *host,
 	}
 
 	free_req_meta (req_meta);
-
-	spinlock_lock (&crypt_meta->lock);
-	ASSERT (crypt_meta->n_intercepted_reqs > 0);
-	crypt_meta->n_intercepted_reqs--;
-	spinlock_unlock (&crypt_meta->lock);
 }
 
 static void
@@ -212,7 +420,7 @@ intercept_rw (struct nvme_crypt_meta *crypt_meta,
 	uint nbytes = n_lbas * lba_nbytes;
 
 	struct nvme_io_dmabuf *dmabuf;
-	dmabuf = nvme_io_alloc_dmabuf (nbytes);
+	dmabuf = alloc_dmabuf (crypt_meta, g_req, nbytes);
 	ASSERT (dmabuf);
 
 	error = nvme_io_set_shadow_buffer (g_req, dmabuf);
@@ -222,7 +430,7 @@ intercept_rw (struct nvme_crypt_meta *crypt_meta,
 	g_buf = nvme_io_alloc_g_buf (crypt_meta->host, g_req);
 	ASSERT (g_buf);
 
-	struct req_meta *req_meta = alloc (sizeof (*req_meta));
+	struct req_meta *req_meta = alloc_req_meta (crypt_meta);
 	req_meta->g_req = g_req;
 	req_meta->g_buf = g_buf;
 	req_meta->dmabuf = dmabuf;
@@ -234,16 +442,8 @@ intercept_rw (struct nvme_crypt_meta *crypt_meta,
 	if (write)
 		buffer_hook (crypt_meta, req_meta, 1);
 
-	struct req_cb_data *cb_data = alloc (sizeof (*cb_data));
-	cb_data->crypt_meta = crypt_meta;
-	cb_data->req_meta = req_meta;
-
-	error = nvme_io_set_g_req_callback (g_req, req_callback, cb_data);
+	error = nvme_io_set_g_req_callback (g_req, req_callback, req_meta);
 	ASSERT (!error);
-
-	spinlock_lock (&crypt_meta->lock);
-	crypt_meta->n_intercepted_reqs++;
-	spinlock_unlock (&crypt_meta->lock);
 }
 
 static void
@@ -322,8 +522,6 @@ filter_identify_data (void *interceptor,
 	}
 }
 
-#define FETCHING_THRESHOLD (32)
-
 static uint
 get_fetching_limit (void *interceptor,
 		    uint n_waiting_g_req)
@@ -344,9 +542,17 @@ install_nvme_crypt (struct nvme_host *host)
 	struct nvme_crypt_meta *crypt_meta = alloc (sizeof (*crypt_meta));
 	crypt_meta->host = host;
 	crypt_meta->devices = NULL;
+	crypt_meta->dmabuf_pools = NULL;
+	crypt_meta->n_dmabuf_pools = 0;
+	crypt_meta->n_unpooled = 0;
+	crypt_meta->req_meta_free = NULL;
 	crypt_meta->id = storage_id++;
 	crypt_meta->n_intercepted_reqs = 0;
 	spinlock_init (&crypt_meta->lock);
+	spinlock_lock (&crypt_meta_list_lock);
+	crypt_meta->next = crypt_meta_list;
+	crypt_meta_list = crypt_meta;
+	spinlock_unlock (&crypt_meta_list_lock);
 
 	struct nvme_io_interceptor *io_interceptor;
 	io_interceptor = alloc (sizeof (*io_interceptor));
@@ -367,10 +573,49 @@ install_nvme_crypt (struct nvme_host *host)
 	return nvme_io_install_interceptor (host, io_interceptor);
 }
 
+/* DMA buffer pool hits and misses of each controller */
+static char *
+nvme_crypt_status (void)
+{
+	static char buf[1024];
+	struct nvme_crypt_meta *crypt_meta;
+	u64 n_hits, n_misses, total_hits, total_misses;
+	int n = 0, len = sizeof buf;
+	uint i;
+
+	n = snprintf (buf, len, "NVMe encryption DMA buffer pools:\n");
+	spinlock_lock (&crypt_meta_list_lock);
+	for (crypt_meta = crypt_meta_list; crypt_meta && n < len - 1;
+	     crypt_meta = crypt_meta->next) {
+		total_hits = 0;
+		spinlock_lock (&crypt_meta->lock);
+		total_misses = crypt_meta->n_unpooled;
+		spinlock_unlock (&crypt_meta->lock);
+		for (i = 1; i <= crypt_meta->n_dmabuf_pools; i++) {
+			if (nvme_io_get_dmabuf_pool_stat
+			    (crypt_meta->dmabuf_pools[i], &n_hits,
+			     &n_misses))
+				continue;
+			total_hits += n_hits;
+			total_misses += n_misses;
+		}
+		n += snprintf (buf + n, len - n,
+			       " storage %u: %u queues, %llu hits,"
+			       " %llu misses\n", crypt_meta->id,
+			       crypt_meta->n_dmabuf_pools, total_hits,
+			       total_misses);
+	}
+	spinlock_unlock (&crypt_meta_list_lock);
+	return buf;
+}
+
 static void
 nvme_crypt_ext (void)
 {
+	crypt_meta_list = NULL;
+	spinlock_init (&crypt_meta_list_lock);
 	nvme_io_register_ext ("encrypt", install_nvme_crypt);
+	register_status_callback (nvme_crypt_status);
 }
 
 INITFUNC ("driver1", nvme_crypt_ext);
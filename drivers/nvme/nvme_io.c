@@ -104,6 +104,14 @@ guest_req_callback (struct nvme_host *host, struct nvme_comp *comp,
 
 /* ----- Start buffer related functions ----- */
 
+struct nvme_io_dmabuf_pool {
+	struct nvme_io_dmabuf *free_list;
+	u64 buf_nbytes;
+	u64 n_hits;
+	u64 n_misses;
+	spinlock_t lock;
+};
+
 struct nvme_io_dmabuf *
 nvme_io_alloc_dmabuf (u64 nbytes)
 {
@@ -132,6 +140,9 @@ nvme_io_alloc_dmabuf (u64 nbytes)
 	new_dmabuf->dma_list = dma_list;
 	new_dmabuf->dma_list_phys = dma_list_phys;
 
+	new_dmabuf->pool = NULL;
+	new_dmabuf->next = NULL;
+
 	uint i;
 	for (i = 0; i < n_pages; i++)
 		dma_list[i] = dma_phys + (i * PAGE_NBYTES);
@@ -142,6 +153,16 @@ nvme_io_alloc_dmabuf (u64 nbytes)
 void
 nvme_io_free_dmabuf (struct nvme_io_dmabuf *dmabuf)
 {
+	struct nvme_io_dmabuf_pool *pool = dmabuf->pool;
+
+	if (pool) {
+		spinlock_lock (&pool->lock);
+		dmabuf->next = pool->free_list;
+		pool->free_list = dmabuf;
+		spinlock_unlock (&pool->lock);
+		return;
+	}
+
 	if (dmabuf->buf)
 		free (dmabuf->buf);
 	if (dmabuf->dma_list)
@@ -149,6 +170,81 @@ nvme_io_free_dmabuf (struct nvme_io_dmabuf *dmabuf)
 	free (dmabuf);
 }
 
+struct nvme_io_dmabuf_pool *
+nvme_io_alloc_dmabuf_pool (u64 buf_nbytes, uint n_bufs)
+{
+	if (buf_nbytes == 0 || n_bufs == 0)
+		return NULL;
+
+	struct nvme_io_dmabuf_pool *pool;
+	pool = alloc (sizeof (*pool));
+	pool->free_list = NULL;
+	pool->buf_nbytes = buf_nbytes;
+	pool->n_hits = 0;
+	pool->n_misses = 0;
+	spinlock_init (&pool->lock);
+
+	/* The DMA list of each buffer is built once here */
+	uint i;
+	for (i = 0; i < n_bufs; i++) {
+		struct nvme_io_dmabuf *dmabuf;
+		dmabuf = nvme_io_alloc_dmabuf (buf_nbytes);
+		dmabuf->pool = pool;
+		dmabuf->next = pool->free_list;
+		pool->free_list = dmabuf;
+	}
+
+	return pool;
+}
+
+struct nvme_io_dmabuf *
+nvme_io_pool_alloc_dmabuf (struct nvme_io_dmabuf_pool *pool, u64 nbytes)
+{
+	struct nvme_io_dmabuf *dmabuf = NULL;
+
+	if (nbytes == 0)
+		return NULL;
+	if (!pool)
+		return nvme_io_alloc_dmabuf (nbytes);
+
+	spinlock_lock (&pool->lock);
+	if (nbytes <= pool->buf_nbytes && pool->free_list) {
+		dmabuf = pool->free_list;
+		pool->free_list = dmabuf->next;
+		pool->n_hits++;
+	} else {
+		pool->n_misses++;
+	}
+	spinlock_unlock (&pool->lock);
+
+	if (!dmabuf)
+		return nvme_io_alloc_dmabuf (nbytes);
+
+	dmabuf->nbytes = nbytes;
+	dmabuf->next = NULL;
+
+	return dmabuf;
+}
+
+nvme_io_error_t
+nvme_io_get_dmabuf_pool_stat (struct nvme_io_dmabuf_pool *pool,
+			      u64 *n_hits, u64 *n_misses)
+{
+	if (!n_hits && !n_misses)
+		return NVME_IO_ERROR_NO_OPERATION;
+	if (!pool)
+		return NVME_IO_ERROR_INVALID_PARAM;
+
+	spinlock_lock (&pool->lock);
+	if (n_hits)
+		*n_hits = pool->n_hits;
+	if (n_misses)
+		*n_misses = pool->n_misses;
+	spinlock_unlock (&pool->lock);
+
+	return NVME_IO_ERROR_OK;
+}
+
 struct g_buf_list {
 	phys_t addr_phys;
 	phys_t addr_in_buflist;
@@ -406,6 +502,36 @@ end:
 	return NVME_IO_ERROR_OK;
 }
 
+nvme_io_error_t
+nvme_io_g_buf_foreach (struct nvme_io_g_buf *g_buf,
+		       u64 buf_nbytes,
+		       void (*func) (void *arg, u8 *g_ptr, u64 g_buf_offset,
+				     u64 nbytes),
+		       void *arg)
+{
+	if (!g_buf || !func)
+		return NVME_IO_ERROR_NO_OPERATION;
+
+	struct g_buf_list *cur_buf_list = g_buf->buf_list;
+
+	u64 offset = 0;
+
+	while (cur_buf_list && offset < buf_nbytes) {
+		u64 nbytes = cur_buf_list->nbytes;
+		if (buf_nbytes - offset <= nbytes)
+			nbytes = buf_nbytes - offset;
+
+		func (arg, cur_buf_list->buf, offset, nbytes);
+
+		offset += nbytes;
+		cur_buf_list = cur_buf_list->next;
+	}
+
+	ASSERT (offset == buf_nbytes);
+
+	return NVME_IO_ERROR_OK;
+}
+
 /* ----- End buffer related functions ----- */
 
 /* ----- Start NVMe host controller driver related functions ----- */
@@ -542,6 +668,21 @@ nvme_io_get_max_n_lbas (struct nvme_host *host, u32 nsid, u16 *max_n_lbas)
 	return NVME_IO_ERROR_OK;
 }
 
+nvme_io_error_t
+nvme_io_get_max_n_io_queues (struct nvme_host *host, u16 *max_n_subm_queues)
+{
+	if (!max_n_subm_queues)
+		return NVME_IO_ERROR_NO_OPERATION;
+	if (!host)
+		return NVME_IO_ERROR_INVALID_PARAM;
+	if (host->h_queue.max_n_subm_queues == 0)
+		return NVME_IO_ERROR_NOT_READY;
+
+	*max_n_subm_queues = host->h_queue.max_n_subm_queues;
+
+	return NVME_IO_ERROR_OK;
+}
+
 /* ----- End NVMe host controller driver related functions ----- */
 
 /* ----- Start NVMe guest request related functions ----- */
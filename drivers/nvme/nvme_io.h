@@ -81,8 +81,12 @@
  * The NVMe driver implementation, by default, does not shadow guest
  * requests' buffers. If an interceptor wants to create a shadow buffer,
  * it must allocate a nvme_io_dmabuf, and call nvme_io_set_shadow_buffer().
+ * Interceptors that shadow every request can keep preallocated dmabufs in
+ * an nvme_io_dmabuf_pool and take them with nvme_io_pool_alloc_dmabuf().
  * Copying data between the guest buffer and the allocated nvme_io_dmabuf
- * can be done by nvme_io_memcpy_g_buf().
+ * can be done by nvme_io_memcpy_g_buf(). nvme_io_g_buf_foreach() gives
+ * direct access to each mapped piece of the guest buffer for combining
+ * the copy with other processing.
  *
  * To send I/O requests, senders need to create nvme_io_descriptor and
  * nvme_io_req_handle objects. Senders create an nvme_io_descriptor object
@@ -200,13 +204,34 @@ struct nvme_io_dmabuf {
 	phys_t *dma_list;
 	phys_t dma_list_phys;
 	u64 nbytes;
+	struct nvme_io_dmabuf_pool *pool; /* NULL if not from a pool */
+	struct nvme_io_dmabuf *next;
 };
 
 /* Return NULL if nbytes is 0 */
 struct nvme_io_dmabuf * nvme_io_alloc_dmabuf (u64 nbytes);
 
+/* A dmabuf from a pool goes back to the pool */
 void nvme_io_free_dmabuf (struct nvme_io_dmabuf *dmabuf);
 
+struct nvme_io_dmabuf_pool;
+
+/* Return NULL if buf_nbytes or n_bufs is 0 */
+struct nvme_io_dmabuf_pool *nvme_io_alloc_dmabuf_pool (u64 buf_nbytes,
+							uint n_bufs);
+
+/*
+ * Take a dmabuf from the pool. If the pool is empty, NULL, or nbytes is
+ * larger than its buffers, a new dmabuf is allocated instead and it is
+ * counted as a miss. Return NULL if nbytes is 0.
+ */
+struct nvme_io_dmabuf *
+nvme_io_pool_alloc_dmabuf (struct nvme_io_dmabuf_pool *pool, u64 nbytes);
+
+nvme_io_error_t
+nvme_io_get_dmabuf_pool_stat (struct nvme_io_dmabuf_pool *pool,
+			      u64 *n_hits, u64 *n_misses);
+
 struct nvme_io_g_buf;
 
 /* Return NULL if a parameter is invalid */
@@ -223,6 +248,14 @@ nvme_io_error_t nvme_io_memset_g_buf (struct nvme_io_g_buf *g_buf,
 				      u8 value, u64 buf_nbytes,
 				      u64 g_buf_offset);
 
+/* Call func for each mapped piece of the guest buffer in order */
+nvme_io_error_t nvme_io_g_buf_foreach (struct nvme_io_g_buf *g_buf,
+				       u64 buf_nbytes,
+				       void (*func) (void *arg, u8 *g_ptr,
+						     u64 g_buf_offset,
+						     u64 nbytes),
+				       void *arg);
+
 /* ----- End buffer related functions ----- */
 
 /* ----- Start NVMe host controller driver related functions ----- */
@@ -249,6 +282,10 @@ nvme_io_error_t nvme_io_get_lba_nbytes (struct nvme_host *host, u32 nsid,
 nvme_io_error_t nvme_io_get_max_n_lbas (struct nvme_host *host, u32 nsid,
 					u16 *max_n_lbas);
 
+/* Number of I/O submission queues allocated by the controller */
+nvme_io_error_t nvme_io_get_max_n_io_queues (struct nvme_host *host,
+					     u16 *max_n_subm_queues);
+
 /* ----- End NVMe host controller driver related functions ----- */
 
 /* ----- Start NVMe guest request related functions ----- */
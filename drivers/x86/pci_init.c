@@ -74,6 +74,14 @@ dmar_msi_to_icr (void *data, u32 maddr, u32 mupper, u16 mdata)
 	return acpi_dmar_msi_to_icr (dev->dmar_info, maddr, mupper, mdata);
 }
 
+static u32
+dmar_generation (void *data)
+{
+	struct pci_device *dev = data;
+
+	return acpi_dmar_generation (dev->dmar_info);
+}
+
 static u64
 virtual_dmar_translate (void *data, unsigned int *npages, u64 address)
 {
@@ -108,6 +116,14 @@ virtual_dmar_msi_to_icr (void *data, u32 maddr, u32 mupper, u16 mdata)
 	return acpi_dmar_msi_to_icr (dev->dmar_info, maddr, mupper, mdata);
 }
 
+static u32
+virtual_dmar_generation (void *data)
+{
+	struct pci_virtual_device *dev = data;
+
+	return acpi_dmar_generation (dev->dmar_info);
+}
+
 static const struct mm_as *
 do_init_as_dma (struct pci_device *dev, struct pci_device *pdev,
 		struct acpi_pci_addr *next)
@@ -128,6 +144,7 @@ do_init_as_dma (struct pci_device *dev, struct pci_device *pdev,
 	if (dev->dmar_info) {
 		dev->as_dma_dmar.translate = dmar_translate;
 		dev->as_dma_dmar.msi_to_icr = dmar_msi_to_icr;
+		dev->as_dma_dmar.generation = dmar_generation;
 		dev->as_dma_dmar.data = dev;
 		return &dev->as_dma_dmar;
 	}
@@ -158,6 +175,7 @@ pci_init_arch_virtual_as_dma (struct pci_virtual_device *dev)
 	if (dev->dmar_info) {
 		dev->as_dma_dmar.translate = virtual_dmar_translate;
 		dev->as_dma_dmar.msi_to_icr = virtual_dmar_msi_to_icr;
+		dev->as_dma_dmar.generation = virtual_dmar_generation;
 		dev->as_dma_dmar.data = dev;
 		return &dev->as_dma_dmar;
 	}
@@ -51,18 +51,56 @@ atomic_fetch_and32 (u32 *ptr, u32 val)
 	return __atomic_fetch_and (ptr, val, __ATOMIC_ACQ_REL);
 }
 
+static inline u32
+atomic_fetch_or32 (u32 *ptr, u32 val)
+{
+	return __atomic_fetch_or (ptr, val, __ATOMIC_ACQ_REL);
+}
+
 static inline u32
 atomic_fetch_add32 (u32 *ptr, u32 val)
 {
 	return __atomic_fetch_add (ptr, val, __ATOMIC_ACQ_REL);
 }
 
+static inline u64
+atomic_fetch_add64 (u64 *ptr, u64 val)
+{
+	return __atomic_fetch_add (ptr, val, __ATOMIC_ACQ_REL);
+}
+
 static inline u32
 atomic_xchg32 (u32 *ptr, u32 val)
 {
 	return __atomic_exchange_n (ptr, val, __ATOMIC_ACQ_REL);
 }
 
+static inline u32
+atomic_load_acquire32 (u32 *ptr)
+{
+	return __atomic_load_n (ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+atomic_store_release32 (u32 *ptr, u32 val)
+{
+	__atomic_store_n (ptr, val, __ATOMIC_RELEASE);
+}
+
+/* Order preceding loads before following loads and stores */
+static inline void
+atomic_fence_acquire (void)
+{
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+}
+
+/* Full memory barrier including store-load ordering */
+static inline void
+atomic_fence (void)
+{
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
 /*
  * We currently have no use case of weak cmpxchg. If we have the weak use case
  * in the future, we need to add 'weak' parameter in the future.
@@ -31,5 +31,6 @@
 #define __CORE_DEBUG_H
 
 void debug_shell (int ttyin, int ttyout);
+void register_status_callback (char *(*func) (void));
 
 #endif
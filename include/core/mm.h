@@ -49,6 +49,8 @@ struct mempool;
 struct mm_as {
 	u64 (*translate) (void *data, unsigned int *npages, u64 address);
 	u64 (*msi_to_icr) (void *data, u32 maddr, u32 mupper, u16 mdata);
+	/* Optional; changes when translations may have been changed */
+	u32 (*generation) (void *data);
 	void *data;
 };
 
@@ -70,8 +72,11 @@ void *mempool_allocmem (struct mempool *mp, uint len);
 void mempool_freemem (struct mempool *mp, void *virt);
 
 /* Address space */
+u64 mm_as_translate (const struct mm_as *as, unsigned int *npages,
+		     u64 address);
 u64 mm_as_msi_to_icr (const struct mm_as *as, u32 maddr, u32 mupper,
 		      u16 mdata);
+u32 mm_as_generation (const struct mm_as *as);
 
 /* accessing memory */
 void unmapmem (void *virt, uint len);
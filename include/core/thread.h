@@ -38,6 +38,7 @@ tid_t thread_new (void (*func) (void *), void *arg, int stacksize);
 void thread_exit (void);
 void thread_wakeup (tid_t tid);
 void thread_will_stop (void);
+void thread_pool_run (void (*func) (void *arg, int index), void *arg, int n);
 
 #define VMM_STACKSIZE			(4096 * 8)
 
@@ -36,5 +36,6 @@
 void *timer_new (void (*callback) (void *handle, void *data), void *data);
 void timer_set (void *handle, u64 interval_usec);
 void timer_free (void *handle);
+void timer_check_deadline (void);
 
 #endif
@@ -45,6 +45,7 @@ u64 acpi_dmar_translate (struct dmar_drhd_reg_data *d, u8 bus, u8 dev, u8 func,
 			 u64 address);
 u64 acpi_dmar_msi_to_icr (struct dmar_drhd_reg_data *d, u32 maddr, u32 mupper,
 			  u16 mdata);
+u32 acpi_dmar_generation (struct dmar_drhd_reg_data *d);
 struct dmar_drhd_reg_data *acpi_dmar_add_pci_device (u16 segment,
 						     const struct acpi_pci_addr
 						     *addr, bool bridge);
@@ -214,6 +214,8 @@ struct config_data_ip {
 	u8 netmask[4];
 	u8 gateway[4];
 	int use_dhcp;
+	unsigned int input_queue_max;
+	int input_drop_policy;
 };
 
 struct config_data_vmm {
@@ -233,6 +235,8 @@ struct config_data_vmm {
 	int conceal_hw_feedback;
 	int allow_pt;
 	int localapic_intercept;
+	int paging_fault_around;
+	int paging_premap_ram;
 	char tty_mac_address[6];
 	int tty_pro1000;
 	int tty_rtl8169;
@@ -78,9 +78,12 @@ struct custom_pbuf {
 	void (*free) (void *free_arg);
 	void *free_arg;
 	void *buf;
+	struct custom_pbuf *next;
 };
 
 static struct tcpip_context *tcpip_context;
+/* Free custom_pbufs.  Only accessed on the network thread. */
+static struct custom_pbuf *custom_pbuf_free_list;
 
 static void
 tcpip_netif_ipaddr_check_sub (struct netif *netif, ip_addr_t *oldip_addr)
@@ -152,7 +155,8 @@ custom_free (struct pbuf *p)
 	struct custom_pbuf *cpbuf = (void *)p;
 
 	cpbuf->free (cpbuf->free_arg);
-	mem_free (cpbuf);
+	cpbuf->next = custom_pbuf_free_list;
+	custom_pbuf_free_list = cpbuf;
 }
 
 /* This function is not called on a network thread */
@@ -212,8 +216,13 @@ ip_main_input (void *arg, void *buf, unsigned int len,
 	struct custom_pbuf *cpbuf;
 	struct pbuf *p;
 
-	cpbuf = mem_malloc (sizeof *cpbuf);
-	LWIP_ASSERT ("mem_malloc cpbuf", cpbuf);
+	cpbuf = custom_pbuf_free_list;
+	if (cpbuf) {
+		custom_pbuf_free_list = cpbuf->next;
+	} else {
+		cpbuf = mem_malloc (sizeof *cpbuf);
+		LWIP_ASSERT ("mem_malloc cpbuf", cpbuf);
+	}
 	cpbuf->free = free;
 	cpbuf->free_arg = free_arg;
 	cpbuf->buf = buf;
@@ -228,6 +237,13 @@ ip_main_input (void *arg, void *buf, unsigned int len,
 	}
 }
 
+/* Returns milliseconds until the next lwIP timeout */
+unsigned int
+ip_main_sleeptime (void)
+{
+	return sys_timeouts_sleeptime ();
+}
+
 void
 tcpip_begin (tcpip_task_fn_t *func, void *arg)
 {
@@ -38,6 +38,8 @@
 #include <core/spinlock.h>
 #include <core/string.h>
 #include <core/thread.h>
+#include <core/time.h>
+#include <core/timer.h>
 #include <net/netapi.h>
 #include "ip_main.h"
 #include "net_main.h"
@@ -46,7 +48,27 @@
 #include "wireguard/wg_main.h"
 
 #define INPUT_QUEUE_MAX 1000
+#define INPUT_BUF_SIZE 2048
+#define INPUT_BUF_CACHE_MAX 256
+#define NET_TASK_RING_SIZE 1024	/* must be a power of 2 */
+#define NET_TASK_BATCH 32
+#define NET_THREAD_IDLE_USEC 1000	/* busy polling after the last task */
+#define NET_THREAD_POLL_USEC 1000	/* polling interval while sleeping */
+
+/* ip.input_drop_policy */
+#define INPUT_DROP_TAIL 0	/* drop packets over the queue limit */
+#define INPUT_DROP_EARLY 1	/* also drop some above half of the limit */
+
+/* Tasks are passed to the network thread through a bounded
+ * multi-producer single-consumer ring.  A slot is free for position
+ * pos if its seq equals pos and is filled if it equals pos + 1. */
+struct net_task_slot {
+	u32 seq;
+	void (*func) (void *arg);
+	void *arg;
+};
 
+/* Tasks added while the ring is full */
 struct net_task {
 	LIST1_DEFINE (struct net_task);
 	void (*func) (void *arg);
@@ -54,35 +76,116 @@ struct net_task {
 };
 
 struct net_ip_input_data {
+	struct net_ip_input_data *free_next;
 	struct net_ip_data *p;
 	void *arg;
 	unsigned int len;
 	u8 buf[];
 };
 
+static struct net_task_slot net_task_ring[NET_TASK_RING_SIZE];
+static u32 net_task_head;	/* consumer position */
+static u32 net_task_tail;	/* producer position */
 static LIST1_DEFINE_HEAD (struct net_task, net_task_list);
 static spinlock_t net_task_lock;
+static bool net_task_overflow;	/* net_task_list is in use */
+static tid_t net_thread_tid;
+static u32 net_thread_sleeping;
+static void *net_thread_timer;
+
+/* Input buffers of INPUT_BUF_SIZE bytes are recycled to avoid an
+ * allocation per received packet. */
+static struct net_ip_input_data *input_free_list;
+static unsigned int input_free_count;
+static spinlock_t input_free_lock;
 
 static void
+net_thread_wakeup (void)
+{
+	if (atomic_xchg32 (&net_thread_sleeping, 0))
+		thread_wakeup (net_thread_tid);
+}
+
+static bool
+net_task_ring_put (void (*func) (void *arg), void *arg)
+{
+	struct net_task_slot *slot;
+	u32 pos, seq;
+
+	pos = atomic_load_acquire32 (&net_task_tail);
+	for (;;) {
+		slot = &net_task_ring[pos & (NET_TASK_RING_SIZE - 1)];
+		seq = atomic_load_acquire32 (&slot->seq);
+		if ((int)(seq - pos) < 0)
+			return false; /* Full */
+		if (seq == pos) {
+			if (atomic_cmpxchg32 (&net_task_tail, &pos, pos + 1))
+				break;
+		} else {
+			pos = atomic_load_acquire32 (&net_task_tail);
+		}
+	}
+	slot->func = func;
+	slot->arg = arg;
+	atomic_store_release32 (&slot->seq, pos + 1);
+	return true;
+}
+
+static bool
+net_task_pending (void)
+{
+	struct net_task_slot *slot;
+
+	slot = &net_task_ring[net_task_head & (NET_TASK_RING_SIZE - 1)];
+	return atomic_load_acquire32 (&slot->seq) == net_task_head + 1 ||
+		*(volatile bool *)&net_task_overflow;
+}
+
+/* Returns the number of tasks called */
+static unsigned int
 net_task_call (void)
 {
+	void (*func[NET_TASK_BATCH]) (void *arg);
+	void *arg[NET_TASK_BATCH];
+	struct net_task_slot *slot;
 	struct net_task *p;
-
-	/* net_task_list might be extended during this function.  Get
-	 * the list head and initialize before looking at the list to
-	 * prevent this function from eating CPU resource too long and
-	 * reduce holding spinlock time. */
+	unsigned int i, n;
+
+	/* Take a batch of tasks and free the slots before calling
+	 * them, so that producers can refill the ring meanwhile. */
+	for (n = 0; n < NET_TASK_BATCH; n++) {
+		slot = &net_task_ring[net_task_head &
+				      (NET_TASK_RING_SIZE - 1)];
+		if (atomic_load_acquire32 (&slot->seq) != net_task_head + 1)
+			break;
+		func[n] = slot->func;
+		arg[n] = slot->arg;
+		atomic_store_release32 (&slot->seq,
+					net_task_head + NET_TASK_RING_SIZE);
+		net_task_head++;
+	}
+	for (i = 0; i < n; i++)
+		func[i] (arg[i]);
+	if (n || !*(volatile bool *)&net_task_overflow ||
+	    atomic_load_acquire32 (&net_task_tail) != net_task_head)
+		return n;
+	/* The ring is empty and no producers are filling a slot.  Tasks
+	 * added to net_task_list while the ring was full come next.
+	 * Producers keep using the list until it is taken here, to keep
+	 * the order of tasks. */
 	spinlock_lock (&net_task_lock);
 	p = net_task_list.next;
-	if (p != NULL)
-		LIST1_HEAD_INIT (net_task_list);
+	LIST1_HEAD_INIT (net_task_list);
+	net_task_overflow = false;
 	spinlock_unlock (&net_task_lock);
 	while (p != NULL) {
 		struct net_task *pnext = p->next;
 		p->func (p->arg);
 		free (p);
 		p = pnext;
+		n++;
 	}
+	return n;
 }
 
 void
@@ -90,12 +193,42 @@ net_main_task_add (void (*func) (void *arg), void *arg)
 {
 	struct net_task *p;
 
-	p = alloc (sizeof *p);
-	p->func = func;
-	p->arg = arg;
-	spinlock_lock (&net_task_lock);
-	LIST1_ADD (net_task_list, p);
-	spinlock_unlock (&net_task_lock);
+	if (*(volatile bool *)&net_task_overflow ||
+	    !net_task_ring_put (func, arg)) {
+		p = alloc (sizeof *p);
+		p->func = func;
+		p->arg = arg;
+		spinlock_lock (&net_task_lock);
+		LIST1_ADD (net_task_list, p);
+		net_task_overflow = true;
+		spinlock_unlock (&net_task_lock);
+	}
+	net_thread_wakeup ();
+}
+
+static void
+net_thread_timer_callback (void *handle, void *data)
+{
+	net_thread_wakeup ();
+}
+
+/* Stop the network thread until a task is added or the next lwIP
+ * timeout or the polling interval passes. */
+static void
+net_thread_sleep (void)
+{
+	u64 usec = ip_main_sleeptime ();
+
+	usec *= 1000;
+	if (usec > NET_THREAD_POLL_USEC)
+		usec = NET_THREAD_POLL_USEC;
+	timer_set (net_thread_timer, usec);
+	thread_will_stop ();
+	atomic_xchg32 (&net_thread_sleeping, 1);
+	/* A task might be added before net_thread_sleeping is set */
+	if (net_task_pending () && atomic_xchg32 (&net_thread_sleeping, 0))
+		thread_wakeup (net_thread_tid);
+	schedule ();
 }
 
 static void
@@ -103,6 +236,7 @@ net_thread (void *arg)
 {
 	struct net_ip_data *p = arg;
 	struct ip_main_netif netif_arg[1];
+	u64 last_task_time;
 
 	netif_arg[0].handle = p;
 	netif_arg[0].use_as_default = 1;
@@ -118,9 +252,15 @@ net_thread (void *arg)
 		wg_gos_init (p, wg1, wg2);
 	}
 #endif
+	net_thread_tid = thread_gettid ();
+	net_thread_timer = timer_new (net_thread_timer_callback, NULL);
+	last_task_time = get_time ();
 	for (;;) {
 		ip_main_task ();
-		net_task_call ();
+		if (net_task_call ())
+			last_task_time = get_time ();
+		else if (get_time () - last_task_time >= NET_THREAD_IDLE_USEC)
+			net_thread_sleep ();
 		schedule ();
 	}
 }
@@ -143,6 +283,13 @@ net_ip_new_nic (char *arg, void *param)
 	p->input_count = 0;
 	p->input_done_count = 0;
 	p->input_drop_count = 0;
+	p->input_drop_full = 0;
+	p->input_drop_early = 0;
+	p->input_drop_ring = 0;
+	p->input_early_seq = 0;
+	p->input_queue_max = config.ip.input_queue_max ?
+		config.ip.input_queue_max : INPUT_QUEUE_MAX;
+	p->input_drop_policy = config.ip.input_drop_policy;
 	if (param && param_str[0] == 'f') {
 		p->pass = -1;
 		p->filter_count = param_str[1] == 'f' ? 1 : 0;
@@ -181,19 +328,57 @@ net_ip_virt_recv (void *handle, unsigned int num_packets, void **packets,
 		wg_gos_task_add (num_packets, packets, packet_sizes, param);
 }
 
+static struct net_ip_input_data *
+net_main_input_alloc (unsigned int packet_size)
+{
+	struct net_ip_input_data *data;
+
+	if (sizeof *data + packet_size > INPUT_BUF_SIZE)
+		return alloc (sizeof *data + packet_size);
+	spinlock_lock (&input_free_lock);
+	data = input_free_list;
+	if (data) {
+		input_free_list = data->free_next;
+		input_free_count--;
+	}
+	spinlock_unlock (&input_free_lock);
+	if (!data)
+		data = alloc (INPUT_BUF_SIZE);
+	return data;
+}
+
+static void
+net_main_input_release (struct net_ip_input_data *data)
+{
+	if (sizeof *data + data->len <= INPUT_BUF_SIZE) {
+		spinlock_lock (&input_free_lock);
+		if (input_free_count < INPUT_BUF_CACHE_MAX) {
+			data->free_next = input_free_list;
+			input_free_list = data;
+			input_free_count++;
+			data = NULL;
+		}
+		spinlock_unlock (&input_free_lock);
+	}
+	if (data)
+		free (data);
+}
+
 static void
 net_main_input_free (void *arg)
 {
 	struct net_ip_input_data *data = arg;
 	struct net_ip_data *p = data->p;
-	free (data);
+	net_main_input_release (data);
 	u32 input_done_count = atomic_fetch_add32 (&p->input_done_count, 1);
 	if (p->input_count - input_done_count == 1 &&
 	    p->input_drop_count > 0) {
 		u32 input_drop_count = atomic_xchg32 (&p->input_drop_count, 0);
 		if (input_drop_count > 0)
-			printf ("Dropped %u incoming packets.\n",
-				input_drop_count);
+			printf ("Dropped %u incoming packets."
+				" (total: full %u early %u ring %u)\n",
+				input_drop_count, p->input_drop_full,
+				p->input_drop_early, p->input_drop_ring);
 	}
 }
 
@@ -206,23 +391,55 @@ net_main_input_direct (void *arg)
 		       net_main_input_free, data);
 }
 
+/* Decide whether to drop a packet while input_count_diff packets are
+ * queued */
+static bool
+net_main_input_drop (struct net_ip_data *p, u32 input_count_diff)
+{
+	u32 half, over, seq;
+
+	if (input_count_diff > p->input_queue_max) {
+		atomic_fetch_add32 (&p->input_drop_full, 1);
+		return true;
+	}
+	half = p->input_queue_max / 2;
+	if (p->input_drop_policy != INPUT_DROP_EARLY ||
+	    input_count_diff <= half)
+		return false;
+	/* Drop with a probability growing linearly from 0 at half of
+	 * the limit to 1 at the limit */
+	over = input_count_diff - half;
+	seq = atomic_fetch_add32 (&p->input_early_seq, 1);
+	if ((seq * 2654435761U) % (p->input_queue_max - half) >= over)
+		return false;
+	atomic_fetch_add32 (&p->input_drop_early, 1);
+	return true;
+}
+
 static void
 net_main_input_queue (struct net_ip_data *p, void *arg, void *packet,
 		      unsigned int packet_size)
 {
 	struct net_ip_input_data *data;
 	u32 input_count_diff = p->input_count - p->input_done_count;
-	if (input_count_diff > INPUT_QUEUE_MAX) {
+	if (net_main_input_drop (p, input_count_diff)) {
 		atomic_fetch_add32 (&p->input_drop_count, 1);
 		return;
 	}
 	atomic_fetch_add32 (&p->input_count, 1);
-	data = alloc (sizeof *data + packet_size);
+	data = net_main_input_alloc (packet_size);
 	data->p = p;
 	data->arg = arg;
 	data->len = packet_size;
 	memcpy (data->buf, packet, packet_size);
-	net_main_task_add (net_main_input_direct, data);
+	if (!net_task_ring_put (net_main_input_direct, data)) {
+		net_main_input_release (data);
+		atomic_fetch_add32 (&p->input_count, -1);
+		atomic_fetch_add32 (&p->input_drop_ring, 1);
+		atomic_fetch_add32 (&p->input_drop_count, 1);
+		return;
+	}
+	net_thread_wakeup ();
 }
 
 void
@@ -383,8 +600,19 @@ static struct netfunc net_ip_func = {
 static void
 net_main_init (void)
 {
+	u32 i;
+
+	for (i = 0; i < NET_TASK_RING_SIZE; i++)
+		net_task_ring[i].seq = i;
+	net_task_head = 0;
+	net_task_tail = 0;
+	net_task_overflow = false;
+	net_thread_sleeping = 0;
 	spinlock_init (&net_task_lock);
 	LIST1_HEAD_INIT (net_task_list);
+	spinlock_init (&input_free_lock);
+	input_free_list = NULL;
+	input_free_count = 0;
 	net_register ("ip", &net_ip_func, NULL);
 	net_register ("ippass", &net_ip_func, "");
 	net_register ("ippassfilter", &net_ip_func, "f");
@@ -13,6 +13,12 @@ struct net_ip_data {
 	u32 input_count;
 	u32 input_done_count;
 	u32 input_drop_count;
+	u32 input_drop_full;
+	u32 input_drop_early;
+	u32 input_drop_ring;
+	u32 input_early_seq;
+	u32 input_queue_max;
+	int input_drop_policy;
 };
 
 void net_main_send_virt (struct net_ip_data *handle, unsigned int num_packets,
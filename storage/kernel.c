@@ -27,9 +27,13 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <builtin.h>
 #include <core.h>
 #include <core/process.h>
+#include <core/thread.h>
+#include <core/time.h>
 #include <storage.h>
+#include "lib/crypto/crypto.h"
 #include "lib/storage_msg.h"
 
 static int desc;
@@ -37,6 +41,11 @@ static int desc;
 #ifdef STORAGE_PD
 
 static struct mempool *mp;
+static struct storage_ring *ring;
+static long ring_premap;
+static u32 ring_free_slots = ~0U;
+
+#define RING_TIMEOUT_USEC	5000000
 
 static void
 callsub (int c, struct msgbuf *buf, int bufcnt)
@@ -115,6 +124,77 @@ storage_free (struct storage_device *storage)
 	mempool_freemem (mp, arg);
 }
 
+static int
+ring_get_slot (void)
+{
+	u32 mask = ring_free_slots;
+	int i;
+
+	do {
+		if (!mask)
+			return -1;
+		i = builtin_ffs (mask) - 1;
+	} while (!atomic_cmpxchg32 (&ring_free_slots, &mask,
+				    mask & ~(1U << i)));
+	return i;
+}
+
+/* Submit a request whose buffers are premapped.  If no consumer is
+   running, ring the doorbell and kick the storage process, which
+   drains the ring.  Otherwise the running consumer handles the slot,
+   so the request does not enter the storage process.  The status is
+   written by the storage process, so the wait is bounded.  A request
+   not taken in time is taken back and sent by a message.  A request
+   taken but not finished in time fails, and the ring is not used
+   any more since the slot may still be written. */
+static bool
+ring_handle_sectors (struct storage_device *storage,
+		     struct storage_access *access, u8 *src, u8 *dst,
+		     long premap_src, long premap_dst, int *ret)
+{
+	struct storage_ring_slot *s;
+	volatile u32 *status;
+	u32 tmp;
+	u64 start;
+	int i;
+
+	i = ring_get_slot ();
+	if (i < 0)
+		return false;
+	s = &ring->slot[i];
+	s->arg.storage = storage;
+	memcpy (&s->arg.access, access, sizeof s->arg.access);
+	s->src = src - premap_src;
+	s->dst = dst - premap_dst;
+	status = &s->status;
+	atomic_xchg32 (&s->status, STORAGE_RING_SUBMITTED);
+	if (!atomic_xchg32 (&ring->doorbell, 1) &&
+	    msgsendint (desc, STORAGE_MSG_RING))
+		panic ("msgsendint failed");
+	start = get_time ();
+	while (*status != STORAGE_RING_DONE) {
+		if (get_time () - start < RING_TIMEOUT_USEC) {
+			cpu_relax ();
+			continue;
+		}
+		tmp = STORAGE_RING_SUBMITTED;
+		if (atomic_cmpxchg32 (&s->status, &tmp, STORAGE_RING_IDLE)) {
+			atomic_fetch_or32 (&ring_free_slots, 1U << i);
+			return false;
+		}
+		if (tmp == STORAGE_RING_DONE)
+			break;
+		printf ("storage: ring request timed out, ring disabled\n");
+		ring = NULL;
+		*ret = -1;
+		return true;
+	}
+	*ret = s->arg.retval;
+	*status = STORAGE_RING_IDLE;
+	atomic_fetch_or32 (&ring_free_slots, 1U << i);
+	return true;
+}
+
 /* src and dst should be in "safe" page */
 static int
 _storage_handle_sectors (struct storage_device *storage,
@@ -126,6 +206,10 @@ _storage_handle_sectors (struct storage_device *storage,
 	unsigned int size;
 	int ret;
 
+	if (ring && premap_src && premap_dst &&
+	    ring_handle_sectors (storage, access, src, dst, premap_src,
+				 premap_dst, &ret))
+		return ret;
 	arg = mempool_allocmem (mp, sizeof *arg);
 	arg->storage = storage;
 	memcpy (&arg->access, access, sizeof arg->access);
@@ -172,6 +256,30 @@ storage_init (struct config_data_storage *config_storage)
 	msgclose (d);
 }
 
+/* The ring is on its own page since premapped pages are shared with
+   the storage process */
+static void
+ring_init (void)
+{
+	struct msgbuf buf[1];
+	void *tmp;
+
+	ASSERT (sizeof *ring <= PAGESIZE);
+	alloc_page (&tmp, NULL);
+	memset (tmp, 0, PAGESIZE);
+	setmsgbuf (&buf[0], tmp, sizeof *ring, 1);
+	ring_premap = msgpremapbuf (desc, &buf[0]);
+	if (!ring_premap) {
+		printf ("storage: cannot premap the ring\n");
+		free_page (tmp);
+		return;
+	}
+	setmsgbuf_premap (&buf[0], tmp, sizeof *ring, 1, ring_premap);
+	if (msgsendbuf (desc, STORAGE_MSG_RING_INIT, buf, 1))
+		panic ("storage ring init failed");
+	ring = tmp;
+}
+
 #endif /* STORAGE_PD */
 
 long
@@ -202,9 +310,16 @@ static void
 storage_kernel_init (void)
 {
 	storage_init (&config.storage);
+#ifndef STORAGE_PD
+	aes_xts_ni_init ();
+	crypto_set_parallel (thread_pool_run);
+#endif /* STORAGE_PD */
 	desc = msgopen ("storage");
 	if (desc < 0)
 		panic ("open storage");
+#ifdef STORAGE_PD
+	ring_init ();
+#endif /* STORAGE_PD */
 }
 
 INITFUNC ("driver1", storage_kernel_init);
@@ -149,10 +149,22 @@ static struct crypto aes_xts_crypto = {
 	.setkey =	aes_xts_setkey,
 };
 
+/* Used as "aes-xts-ni" unless aes_xts_ni_init () registers the AES-NI
+ * engine, which is found first by crypto_find () */
+static struct crypto aes_xts_ni_crypto = {
+	.name = 	"aes-xts-ni",
+	.block_size =	AES_BLK_BYTES,
+	.keyctx_size =	sizeof(struct aes_xts_keyctx),
+	.encrypt =	aes_xts_encrypt,
+	.decrypt =	aes_xts_decrypt,
+	.setkey =	aes_xts_setkey,
+};
+
 void
 aes_xts_init (void)
 {
 	printf("AES/AES-XTS Encryption Engine initialized (AES=%s)\n", AES_VERSION);
 	printf(COPYRIGHT "\n");
 	crypto_register(&aes_xts_crypto);
+	crypto_register(&aes_xts_ni_crypto);
 }
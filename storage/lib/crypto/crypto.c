@@ -30,12 +30,26 @@
 #include <core.h>
 #include "crypto.h"
 
+#define CRYPTO_PARALLEL_CHUNK	65536
+
 struct crypto_list {
 	struct crypto_list *next;
 	struct crypto *crypto;
 };
 
+struct crypto_range_job {
+	struct crypto *crypto;
+	u8 *dst, *src;
+	void *keyctx;
+	lba_t lba;
+	count_t count, chunk;
+	int sector_size;
+	int crypt;
+};
+
 static struct crypto_list *crypto_list;
+static void (*crypto_parallel) (void (*func) (void *arg, int index),
+				void *arg, int n);
 
 struct crypto *crypto_find(char *name)
 {
@@ -58,6 +72,77 @@ void crypto_register(struct crypto *crypto)
 	crypto_list = p;
 }
 
+/* Per-sector adapter for engines without crypt_range */
+static void
+crypto_crypt_range_sub (struct crypto *crypto, void *dst, void *src,
+			void *keyctx, lba_t lba, count_t count,
+			int sector_size, int crypt)
+{
+	void (*func)(void *dst, void *src, void *keyctx, lba_t lba,
+		     int sector_size);
+	u8 *d = dst, *s = src;
+
+	if (crypto->crypt_range) {
+		crypto->crypt_range (dst, src, keyctx, lba, count, sector_size,
+				     crypt);
+		return;
+	}
+	func = crypt == CRYPTO_ENCRYPT ? crypto->encrypt : crypto->decrypt;
+	while (count-- > 0) {
+		func (d, s, keyctx, lba++, sector_size);
+		d += sector_size;
+		s += sector_size;
+	}
+}
+
+static void
+crypto_range_job_func (void *arg, int index)
+{
+	struct crypto_range_job *job = arg;
+	count_t offset = job->chunk * index;
+	count_t count = MIN (job->chunk, job->count - offset);
+	unsigned long off = (unsigned long)offset * job->sector_size;
+
+	crypto_crypt_range_sub (job->crypto, job->dst + off, job->src + off,
+				job->keyctx, job->lba + offset, count,
+				job->sector_size, job->crypt);
+}
+
+/* Large ranges are split into CRYPTO_PARALLEL_CHUNK bytes and
+ * processed in parallel if crypto_set_parallel () has been called */
+void
+crypto_crypt_range (struct crypto *crypto, void *dst, void *src, void *keyctx,
+		    lba_t lba, count_t count, int sector_size, int crypt)
+{
+	struct crypto_range_job job;
+	count_t chunk;
+
+	chunk = CRYPTO_PARALLEL_CHUNK / sector_size;
+	if (!crypto_parallel || !chunk || count <= chunk) {
+		crypto_crypt_range_sub (crypto, dst, src, keyctx, lba, count,
+					sector_size, crypt);
+		return;
+	}
+	job.crypto = crypto;
+	job.dst = dst;
+	job.src = src;
+	job.keyctx = keyctx;
+	job.lba = lba;
+	job.count = count;
+	job.chunk = chunk;
+	job.sector_size = sector_size;
+	job.crypt = crypt;
+	crypto_parallel (crypto_range_job_func, &job,
+			 (count + chunk - 1) / chunk);
+}
+
+void
+crypto_set_parallel (void (*parallel) (void (*func) (void *arg, int index),
+				       void *arg, int n))
+{
+	crypto_parallel = parallel;
+}
+
 void
 crypto_init (void)
 {
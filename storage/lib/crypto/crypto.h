@@ -40,6 +40,10 @@ enum {
 struct crypto {
 	void	(*encrypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
 	void	(*decrypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
+	/* optional; processes count sectors from lba in one call.
+	   crypt is CRYPTO_ENCRYPT or CRYPTO_DECRYPT. */
+	void	(*crypt_range)(void *dst, void *src, void *keyctx, lba_t lba,
+			       count_t count, int sector_size, int crypt);
 	void	*(*setkey)(const u8 *key, int bits);
 	int	block_size;
 	int	keyctx_size;
@@ -48,5 +52,12 @@ struct crypto {
 
 void crypto_register(struct crypto *crypto);
 struct crypto *crypto_find(char *name);
+void crypto_set_parallel (void (*parallel) (void (*func) (void *arg,
+							 int index),
+					       void *arg, int n));
+void crypto_crypt_range (struct crypto *crypto, void *dst, void *src,
+			 void *keyctx, lba_t lba, count_t count,
+			 int sector_size, int crypt);
+void aes_xts_ni_init (void);
 
 #endif
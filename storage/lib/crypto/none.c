@@ -51,6 +51,13 @@ crypto_none_decrypt (void *dst, void *src, void *keyctx, lba_t lba,
 	crypto_none_crypt (dst, src, sector_size);
 }
 
+static void
+crypto_none_crypt_range (void *dst, void *src, void *keyctx, lba_t lba,
+			 count_t count, int sector_size, int crypt)
+{
+	crypto_none_crypt (dst, src, count * sector_size);
+}
+
 static void *
 crypto_none_setkey (const u8 *key, int bits)
 {
@@ -63,6 +70,7 @@ static struct crypto crypto_none_crypto = {
 	.keyctx_size =	0,
 	.encrypt =	crypto_none_encrypt,
 	.decrypt =	crypto_none_decrypt,
+	.crypt_range =	crypto_none_crypt_range,
 	.setkey =	crypto_none_setkey,
 };
 
@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <builtin.h>
 #include <core.h>
 #include <core/config.h>
 #include <core/process.h>
@@ -45,6 +46,7 @@
 static struct guid anyguid = STORAGE_GUID_ANY;
 static struct config_data_storage *cfg;
 static int storage_desc;
+static struct storage_ring *storage_ring;
 
 struct storage_keys {
 	lba_t		lba_low, lba_high;
@@ -170,7 +172,7 @@ storage_handle_sectors (struct storage_device *storage,
 	count_t	count = access->count, size;
 	int sector_size = access->sector_size;
 	struct crypto *crypto;
-	void (*crypt)(void *dst, void *src, void *keyctx, lba_t lba, int sector_size);
+	int crypt;
 	void *keyctx;
 
 	for (i = 0; count > 0 && i < storage->keynum; i++) {
@@ -197,14 +199,15 @@ storage_handle_sectors (struct storage_device *storage,
 				sub_count = sub_count2 + 1;
 			keyctx = storage->keys[i].keyctx;
 			crypto = storage->keys[i].crypto;
-			crypt = (access->rw == STORAGE_READ) ? crypto->decrypt : crypto->encrypt;
+			crypt = (access->rw == STORAGE_READ) ? CRYPTO_DECRYPT : CRYPTO_ENCRYPT;
 			sub_count = MIN (count, sub_count);
 			count -= sub_count;
-			while (sub_count-- > 0) {
-				crypt(dst, src, keyctx, lba++, sector_size);
-				src += sector_size;
-				dst += sector_size;
-			}
+			size = sub_count * sector_size;
+			crypto_crypt_range (crypto, dst, src, keyctx, lba,
+					    sub_count, sector_size, crypt);
+			lba += sub_count;
+			src += size;
+			dst += size;
 		}
 	}
 	if (count > 0 && dst != src)
@@ -244,9 +247,74 @@ storage_free (struct storage_device *storage)
 	free (storage);
 }
 
+static bool
+storage_ring_pending (void)
+{
+	int i;
+
+	for (i = 0; i < STORAGE_RING_NSLOTS; i++)
+		if (*(volatile u32 *)&storage_ring->slot[i].status ==
+		    STORAGE_RING_SUBMITTED)
+			return true;
+	return false;
+}
+
+/* Handle submitted slots until none is left.  A slot is claimed
+   before handling because a consumer kicked after the doorbell is
+   cleared may run on another processor at the same time. */
+static void
+storage_ring_drain (void)
+{
+	struct storage_ring_slot *s;
+	bool found;
+	u32 status;
+	int i;
+
+	do {
+		found = false;
+		for (i = 0; i < STORAGE_RING_NSLOTS; i++) {
+			s = &storage_ring->slot[i];
+			status = STORAGE_RING_SUBMITTED;
+			if (!atomic_cmpxchg32 (&s->status, &status,
+					       STORAGE_RING_RUNNING))
+				continue;
+			s->arg.retval = storage_handle_sectors (s->arg.storage,
+								&s->arg.access,
+								s->src,
+								s->dst);
+			atomic_xchg32 (&s->status, STORAGE_RING_DONE);
+			found = true;
+		}
+	} while (found);
+}
+
+/* The consumer kicked by the submitter which set the doorbell.
+   Submitters which see the doorbell set only wait, so the slots
+   submitted after the last scan are checked again after the doorbell
+   is cleared. */
+static int
+storage_ring_handle (void)
+{
+	if (!storage_ring)
+		return -1;
+	for (;;) {
+		storage_ring_drain ();
+		atomic_xchg32 (&storage_ring->doorbell, 0);
+		if (!storage_ring_pending ())
+			break;
+		/* Another submitter has set the doorbell and kicks
+		 * another consumer */
+		if (atomic_xchg32 (&storage_ring->doorbell, 1))
+			break;
+	}
+	return 0;
+}
+
 static int
 storage_msghandler (int m, int c, struct msgbuf *buf, int bufcnt)
 {
+	if (m == MSG_INT && c == STORAGE_MSG_RING)
+		return storage_ring_handle ();
 	if (m != MSG_BUF)
 		return -1;
 	if (c == STORAGE_MSG_NEW) {
@@ -309,6 +377,13 @@ storage_msghandler (int m, int c, struct msgbuf *buf, int bufcnt)
 						      buf[1].base,
 						      buf[2].base);
 		return 0;
+	} else if (c == STORAGE_MSG_RING_INIT) {
+		if (bufcnt != 1)
+			return -1;
+		if (buf[0].len != sizeof *storage_ring)
+			return -1;
+		storage_ring = buf[0].base;
+		return 0;
 	} else {
 		return -1;
 	}
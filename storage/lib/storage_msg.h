@@ -31,6 +31,23 @@ enum {
 	STORAGE_MSG_NEW,
 	STORAGE_MSG_FREE,
 	STORAGE_MSG_HANDLE_SECTORS,
+	STORAGE_MSG_RING_INIT,
+	STORAGE_MSG_RING,
+};
+
+/* The ring is shared between the VMM and the storage process.  It is
+   premapped once.  The doorbell is nonzero while a consumer is running
+   in the process.  Only the submitter which sets the doorbell sends
+   STORAGE_MSG_RING (MSG_INT), and the consumer drains the ring until
+   no slot is submitted, so that requests from other processors are
+   handled without entering the process again. */
+#define STORAGE_RING_NSLOTS 32
+
+enum {
+	STORAGE_RING_IDLE,
+	STORAGE_RING_SUBMITTED,
+	STORAGE_RING_RUNNING,
+	STORAGE_RING_DONE,
 };
 
 struct storage_msg_new {
@@ -51,3 +68,14 @@ struct storage_msg_handle_sectors {
 	struct storage_access access;
 	int retval;
 };
+
+struct storage_ring_slot {
+	u32 status;
+	struct storage_msg_handle_sectors arg;
+	u8 *src, *dst;		/* addresses in the storage process */
+};
+
+struct storage_ring {
+	u32 doorbell;
+	struct storage_ring_slot slot[STORAGE_RING_NSLOTS];
+};